@@ -0,0 +1,108 @@
+#include <rbtree.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Write throughput of one shared tree with 1 to 64 writer threads.
+// "concurrent" is an RBTREE_CONCURRENT tree updated without any outside lock,
+// "locked" is a default tree behind a single pthread mutex (the baseline).
+// Every writer does a random 50/50 mix of insert and erase_key over a key
+// range of 2n, on a tree prefilled with n keys, for a fixed wall-clock time.
+
+#define RUN_NS 500e6
+
+typedef struct
+{
+  rbtree *t;
+  pthread_mutex_t *lock;  // NULL for the concurrent tree
+  unsigned int seed;
+  key_t range;
+  size_t ops;
+} writer_t;
+
+static atomic_int stop;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *writer(void *arg)
+{
+  writer_t *w = arg;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed))
+  {
+    const key_t key = rand_r(&w->seed) % w->range;
+    const int ins = rand_r(&w->seed) & 1;
+    if (w->lock)
+    {
+      pthread_mutex_lock(w->lock);
+    }
+    if (ins)
+    {
+      rbtree_insert(w->t, key);
+    }
+    else
+    {
+      rbtree_erase_key(w->t, key);
+    }
+    if (w->lock)
+    {
+      pthread_mutex_unlock(w->lock);
+    }
+    w->ops++;
+  }
+  return NULL;
+}
+
+static double run(const unsigned int flags, const int locked, const size_t n,
+                  const int nthreads)
+{
+  rbtree *t = new_rbtree_flags(flags);
+  srand(1);
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, rand() % (2 * n));
+  }
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  writer_t w[64];
+  pthread_t th[64];
+  atomic_store(&stop, 0);
+  for (int i = 0; i < nthreads; i++)
+  {
+    w[i] = (writer_t){.t = t, .lock = locked ? &lock : NULL, .seed = i + 1,
+                      .range = (key_t)(2 * n)};
+    pthread_create(&th[i], NULL, writer, &w[i]);
+  }
+  const double start = now_ns();
+  struct timespec ts = {.tv_sec = 0, .tv_nsec = (long)RUN_NS};
+  nanosleep(&ts, NULL);
+  atomic_store(&stop, 1);
+  size_t ops = 0;
+  for (int i = 0; i < nthreads; i++)
+  {
+    pthread_join(th[i], NULL);
+    ops += w[i].ops;
+  }
+  const double ns = now_ns() - start;
+  delete_rbtree(t);
+  return ops / ns * 1e3;  // million operations per second
+}
+
+int main(int argc, char *argv[])
+{
+  const size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1u << 20;
+  printf("%-8s %12s %12s\n", "writers", "concurrent", "locked");
+  for (int nthreads = 1; nthreads <= 64; nthreads *= 2)
+  {
+    const double c = run(RBTREE_CONCURRENT, 0, n, nthreads);
+    const double l = run(0, 1, n, nthreads);
+    printf("%-8d %8.2f M/s %8.2f M/s\n", nthreads, c, l);
+  }
+  return 0;
+}
@@ -0,0 +1,254 @@
+#include <rbtree.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares the balancing policies selected with -DRBTREE_BALANCE, and with
+// "btree" as the second argument the B-tree engine (RBTREE_BTREE), and with
+// "huge" the default tree with its nodes in huge-page chunks (RBTREE_HUGEPAGE),
+// and with "buffer" inserts staged in the write buffer (RBTREE_BUFFERED).
+// With "log" every tree writes an operation log (rbtree_log_open), so the
+// difference from the plain run is the logging cost per update; the last
+// line is the time to rebuild the tree from its checkpoint and log.
+// For each workload it prints time per operation, tree height and the
+// number of rotations performed by that phase. "join sorted" checks the
+// sorted probes with one rbtree_contains_sorted call instead of n finds, and
+// "join sparse" does the same for every 1024th of them ("find sparse" is the
+// per-key baseline). "find compacted" repeats the lookups after
+// rbtree_compact has packed the surviving nodes, and "clone" copies that tree
+// with rbtree_clone. The last lines show how long dropping a tree blocks the
+// caller with each delete variant.
+
+#if RBTREE_BALANCE == RBTREE_BALANCE_AVL
+static const char *policy = "avl";
+#elif RBTREE_BALANCE == RBTREE_BALANCE_WAVL
+static const char *policy = "wavl";
+#else
+static const char *policy = "rb";
+#endif
+static unsigned int flags = 0;
+static const char *log_base = NULL;
+
+static rbtree *open_tree(void)
+{
+  rbtree *t = new_rbtree_flags(flags);
+  if (log_base && rbtree_log_open(t, log_base) != 0)
+  {
+    fprintf(stderr, "cannot open log %s\n", log_base);
+    exit(1);
+  }
+  return t;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+  const key_t x = *(const key_t *)a, y = *(const key_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *phase, const rbtree *t, const size_t ops,
+                   const double ns, const unsigned long rotations)
+{
+  rbtree_stats st;
+  rbtree_get_stats(t, &st);
+  printf("%-5s %-16s %9zu ops %8.1f ns/op  height %3zu  rotations %9lu\n",
+         policy, phase, ops, ns / ops, st.height, rotations);
+}
+
+// time the calling thread spends dropping a tree of n random keys
+static void bench_delete(const key_t *keys, const size_t n)
+{
+  const char *names[] = {"delete", "delete parallel", "delete async"};
+  for (int mode = 0; mode < 3; mode++)
+  {
+    rbtree *t = new_rbtree_flags(flags);
+    for (size_t i = 0; i < n; i++)
+    {
+      rbtree_insert(t, keys[i]);
+    }
+    double start = now_ns();
+    if (mode == 0)
+    {
+      delete_rbtree(t);
+    }
+    else if (mode == 1)
+    {
+      delete_rbtree_parallel(t, 0);
+    }
+    else
+    {
+      delete_rbtree_async(t);
+    }
+    printf("%-5s %-16s %9zu nodes %8.2f ms on the caller\n", policy, names[mode], n,
+           (now_ns() - start) / 1e6);
+    rbtree_reclaim_wait();
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1u << 20;
+  if (argc > 2 && strcmp(argv[2], "btree") == 0)
+  {
+    policy = "btree";
+    flags = RBTREE_BTREE;
+  }
+  if (argc > 2 && strcmp(argv[2], "huge") == 0)
+  {
+    policy = "huge";
+    flags = RBTREE_HUGEPAGE;
+  }
+  if (argc > 2 && strcmp(argv[2], "buffer") == 0)
+  {
+    policy = "buf";
+    flags = RBTREE_BUFFERED;
+  }
+  if (argc > 2 && strcmp(argv[2], "log") == 0)
+  {
+    policy = "log";
+    log_base = "bench-log";
+  }
+  key_t *keys = malloc(n * sizeof(key_t));
+  key_t *probe = malloc(n * sizeof(key_t));
+  srand(1);
+  for (size_t i = 0; i < n; i++)
+  {
+    keys[i] = rand();
+  }
+  for (size_t i = 0; i < n; i++)
+  {
+    probe[i] = keys[rand() % n];
+  }
+
+  rbtree *t = open_tree();
+  double start = now_ns();
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, keys[i]);
+  }
+  report("insert random", t, n, now_ns() - start, t->rotations);
+  rbtree_memory mem;
+  rbtree_memory_usage(t, &mem);
+  printf("%-5s memory %zu KiB reserved, %zu KiB in use, %zu KiB huge, %.1f%% free\n",
+         policy, mem.reserved >> 10, mem.in_use >> 10, mem.huge_bytes >> 10,
+         mem.fragmentation * 100);
+
+  volatile size_t hits = 0;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+  {
+    hits += rbtree_find(t, probe[i]) != NULL;
+  }
+  report("find hit", t, n, now_ns() - start, 0);
+
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+  {
+    hits += rbtree_find(t, probe[i] ^ 1) != NULL;
+  }
+  report("find mixed", t, n, now_ns() - start, 0);
+
+  // the same probes sorted: one find each, then one merge join over all of
+  // them, then a sparse batch of every 1024th probe
+  key_t *sorted = malloc(n * sizeof(key_t));
+  memcpy(sorted, probe, n * sizeof(key_t));
+  qsort(sorted, n, sizeof(key_t), cmp_key);
+  uint8_t *bits = malloc(n / 8 + 1);
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+  {
+    hits += rbtree_find(t, sorted[i]) != NULL;
+  }
+  report("find sorted", t, n, now_ns() - start, 0);
+  start = now_ns();
+  hits += rbtree_contains_sorted(t, sorted, n, bits);
+  report("join sorted", t, n, now_ns() - start, 0);
+  const size_t sparse = n / 1024 ? n / 1024 : 1;
+  for (size_t i = 0; i < sparse; i++)
+  {
+    sorted[i] = sorted[i * (n / sparse)];
+  }
+  start = now_ns();
+  for (size_t i = 0; i < sparse; i++)
+  {
+    hits += rbtree_find(t, sorted[i]) != NULL;
+  }
+  report("find sparse", t, sparse, now_ns() - start, 0);
+  start = now_ns();
+  hits += rbtree_contains_sorted(t, sorted, sparse, bits);
+  report("join sparse", t, sparse, now_ns() - start, 0);
+  free(bits);
+  free(sorted);
+
+  unsigned long before = t->rotations;
+  start = now_ns();
+  for (size_t i = 0; i < n; i += 2)
+  {
+    rbtree_erase_key(t, keys[i]);
+  }
+  report("erase half", t, n / 2, now_ns() - start, t->rotations - before);
+
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+  {
+    hits += rbtree_find(t, probe[i]) != NULL;
+  }
+  report("find after erase", t, n, now_ns() - start, 0);
+
+  // the same lookups once the surviving nodes are packed in preorder
+  if (rbtree_compact(t) == 0)
+  {
+    start = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+      hits += rbtree_find(t, probe[i]) != NULL;
+    }
+    report("find compacted", t, n, now_ns() - start, 0);
+  }
+
+  // one pass copying the surviving nodes, shape and colours included
+  rbtree_stats st;
+  rbtree_get_stats(t, &st);
+  start = now_ns();
+  rbtree *c = rbtree_clone(t);
+  report("clone", c, st.nodes, now_ns() - start, 0);
+  delete_rbtree(c);
+  delete_rbtree(t);
+
+  // ascending keys are the worst case for rotations
+  t = open_tree();
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, (key_t)i);
+  }
+  report("insert ascending", t, n, now_ns() - start, t->rotations);
+  delete_rbtree(t);
+
+  if (log_base)
+  {
+    // empty checkpoint + n logged inserts, replayed in sorted batches
+    start = now_ns();
+    t = rbtree_log_load(log_base, flags);
+    report("recover", t, n, now_ns() - start, t->rotations);
+    delete_rbtree(t);
+    unlink("bench-log.ckpt");
+    unlink("bench-log.log");
+  }
+
+  bench_delete(keys, n);
+
+  free(probe);
+  free(keys);
+  return 0;
+}
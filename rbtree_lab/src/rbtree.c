@@ -1,451 +1,5877 @@
 #include "rbtree.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 static void free_subtree(rbtree *t, node_t *n);
-static void rotate_left(rbtree *t, node_t *x);
-static void rotate_right(rbtree *t, node_t *x);
-static void insert_fixup(rbtree *t, node_t *z);
+static node_t *free_some(rbtree *t, node_t *x, size_t budget);
+static void compact_finish(rbtree *t);
+static const struct rbtree_arena *compact_old(const rbtree *t);
+static node_t *node_alloc(rbtree *t);
+static void node_free(rbtree *t, node_t *n);
+static int compact_release(rbtree *t, node_t *n);
+static void arena_destroy(rbtree *t);
+static int huge_arena_init(rbtree *t);
+static void ctx_reclaim(rbtree *t);
+static rbtree *small_tree_new(size_t);
+static int small_inline(const rbtree *t);
+static node_t *small_find(const rbtree *t, const key_t key);
+static node_t *small_insert(rbtree *t, const key_t key, int unique,
+  int *existed);
+static void small_remove(rbtree *t, node_t *z);
+static node_t *small_step(const rbtree *t, const node_t *x, int dir);
+static int btree_init(rbtree *t);
+static void btree_destroy(rbtree *t);
+static node_t *bt_find(const rbtree *t, const key_t key);
+static node_t *bt_insert(rbtree *t, const key_t key, int unique,
+  int *existed);
+static void bt_erase(rbtree *t, node_t *z);
+static node_t *bt_step(const node_t *x, int dir);
+static size_t bt_to_array(const rbtree *t, key_t *arr, const size_t n);
+static int conc_init(rbtree *t);
+static void conc_destroy(rbtree *t);
+static node_t *cn_find(const rbtree *t, const key_t key);
+static node_t *cn_insert(rbtree *t, const key_t key, int unique, int *existed);
+static int cn_erase(rbtree *t, const key_t key);
+static node_t *cn_next(const rbtree *t, const key_t key);
+static node_t *cn_prev(const rbtree *t, const key_t key, int top);
+static node_t *cn_min(const rbtree *t);
+static size_t cn_to_array(const rbtree *t, key_t *arr, const size_t n);
+static int filter_init(rbtree *t, size_t capacity);
+static void filter_destroy(rbtree *t);
+static void filter_add(rbtree *t, const key_t key);
+static void filter_remove(rbtree *t, const key_t key);
+static int filter_maybe(const rbtree *t, const key_t key);
+static int wbuf_init(rbtree *t);
+static void wbuf_destroy(rbtree *t);
+static size_t wbuf_size(const rbtree *t);
+static size_t wbuf_bytes(void);
+static int wbuf_copy(rbtree *c, const rbtree *t);
+static node_t *wbuf_find(const rbtree *t, const key_t key);
+static node_t *wbuf_insert(rbtree *t, const key_t key);
+static node_t *wbuf_put(rbtree *t, const key_t key);
+static void wbuf_remove(rbtree *t, node_t *x);
+static node_t *wbuf_end(const rbtree *t, node_t *tn, int dir);
+static node_t *wbuf_step(const rbtree *t, const node_t *x, int dir);
+static size_t wbuf_merge_array(const rbtree *t, key_t *arr, const size_t n,
+  size_t len);
+// 증강(augment) 훅이 있는 버전과 없는 버전을 따로 인라인해서, 훅을 안 쓰는 트리에는
+// 훅 호출 코드가 아예 남지 않도록 한다. (aug가 상수 NULL이면 컴파일러가 지움)
+#define RB_INLINE static inline __attribute__((always_inline))
+
+RB_INLINE void rotate_left(rbtree *t, node_t *x, const rbtree_augment_t *aug);
+RB_INLINE void rotate_right(rbtree *t, node_t *x, const rbtree_augment_t *aug);
+RB_INLINE void insert_fixup(rbtree *t, node_t *z, const rbtree_augment_t *aug);
+RB_INLINE void balance_leaf(rbtree *t, node_t *node);
+RB_INLINE void balance_insert(rbtree *t, node_t *node,
+  const rbtree_augment_t *aug);
+RB_INLINE void balance_erase(rbtree *t, node_t *x, node_t *xp,
+  color_t y_origin_color, const rbtree_augment_t *aug);
+static node_t *insert_at(rbtree *t, node_t *parent, const key_t key);
+static node_t *insert_key(rbtree *t, const key_t key);
+static node_t *insert_unique_key(rbtree *t, const key_t key, int *existed);
+static void link_at(rbtree *t, node_t *parent, node_t *node, int left);
+static node_t *descend(const rbtree *t, node_t *from, const key_t key,
+  node_t **parent);
+static node_t *find_below(const rbtree *t, node_t *from, const key_t key,
+  node_t **last);
+static node_t *tree_next(const rbtree *t, const node_t *x);
+static node_t *tree_prev(const rbtree *t, const node_t *x);
+static void next_gen(rbtree *t);
 static void rbtree_transplant(rbtree *t, node_t *u, node_t *v);
-static void rbtree_erase_fixup(rbtree *t, node_t *x);
+RB_INLINE void rbtree_erase_fixup(rbtree *t, node_t *x, node_t *xp,
+  const rbtree_augment_t *aug);
+static void erase_unlink(rbtree *t, node_t *z);
+static int is_str(const rbtree *t);
+static void str_free_subtree(rbtree *t, node_t *n);
+RB_INLINE void erase_unlink_aug(rbtree *t, node_t *z,
+  const rbtree_augment_t *aug);
 static void inorder(const rbtree *t, const node_t *x, 
   key_t *arr, const size_t n, size_t *idx);
+static size_t tree_to_array(const rbtree *t, key_t *arr, const size_t n,
+  int nthreads);
+static void lazy_erase(rbtree *t, node_t *z);
+static void log_append(rbtree *t, unsigned char op, const key_t key);
+static node_t *count_up(rbtree *t, node_t *dup);
+static int pstate_init(rbtree *t);
+static void pstate_destroy(rbtree *t);
+static node_t *pinsert(rbtree *t, const key_t key);
+static int perase(rbtree *t, const node_t *target, const key_t key);
+static node_t *pstep(const rbtree *t, const node_t *x, int dir);
+
+enum { LOG_INSERT = 1, LOG_ERASE = 2 }; // 연산 로그 레코드의 op (RBTREE_LOG 섹션)
+
+// counted 트리의 노드는 rbtree_counted_node로 할당하므로 node_t 바로 뒤에 count가 있다.
+#define NODE_COUNT(x) (((rbtree_counted_node *)(x))->count)
+
+// t가 노드 하나에 쓰는 바이트 (arena chunk와 small 자리의 간격)
+static inline size_t node_bytes(const rbtree *t) {
+  return (t->flags & RBTREE_COUNTED) ? sizeof(rbtree_counted_node) : sizeof(node_t);
+}
+
+// x가 나타내는 key의 개수 (counted 트리가 아니면 1)
+static inline size_t node_count(const rbtree *t, const node_t *x) {
+  return (t->flags & RBTREE_COUNTED) ? NODE_COUNT(x) : 1;
+}
+
+// 새 노드의 개수를 1로 (counted 트리가 아니면 자리가 없으므로 아무 일도 안 함)
+static inline void node_count_init(const rbtree *t, node_t *x) {
+  if (t->flags & RBTREE_COUNTED) NODE_COUNT(x) = 1;
+}
+
+// RBTREE_LAZY의 tombstone (count가 0인 노드)
+static inline int node_dead(const rbtree *t, const node_t *x) {
+  return (t->flags & RBTREE_LAZY) && NODE_COUNT(x) == 0;
+}
+
+// 트리 세대 번호 발급기. 모든 트리가 공유하므로 같은 주소에 새 트리가 생겨도 번호는 겹치지 않는다.
+static atomic_ulong gen_counter = 1;
 
+// 스레드별 마지막 탐색 위치 (RBTREE_FINGER 트리의 rbtree_find가 사용)
+// tree/gen이 현재 트리와 같을 때만 node가 아직 살아있는 노드임을 보장한다.
+static _Thread_local struct {
+  const rbtree *tree;
+  unsigned long gen;
+  node_t *node;
+} last_finger;
 
 rbtree *new_rbtree(void) {
   // TODO: initialize struct if needed
-  rbtree *t = calloc(1, sizeof(*t));
-  node_t *nil = calloc(1, sizeof(*nil));
-  nil->color = RBTREE_BLACK;
-  nil->parent = nil->left = nil->right = nil;
-  t->nil = nil;
-  t->root = nil;
+  return new_rbtree_flags(0);
+}
+
+// flags로 동작 모드를 고른 트리 생성 (0이면 new_rbtree와 같은 multiset)
+rbtree *new_rbtree_flags(unsigned int flags) {
+  // 동시성 트리는 자기 노드 구조를 쓰고 같은 key를 count로 모은다.
+  if (flags & RBTREE_CONCURRENT) {
+    flags &= ~(RBTREE_FINGER | RBTREE_PERSISTENT | RBTREE_INTRUSIVE |
+               RBTREE_FILTER | RBTREE_SMALL | RBTREE_BTREE | RBTREE_LAZY |
+               RBTREE_HUGEPAGE | RBTREE_BUFFERED);
+    flags |= RBTREE_COUNTED;
+  }
+  // persistent 노드에는 parent가 없으므로 finger 탐색은 쓸 수 없다.
+  // (버전끼리 나눠 쓰는 노드는 따로 malloc하므로 arena에도 둘 수 없다)
+  // (버퍼의 노드는 어느 버전에도 속하지 않으므로 쓰기 버퍼도 쓸 수 없다)
+  if (flags & RBTREE_PERSISTENT) {
+    flags &= ~(RBTREE_FINGER | RBTREE_SMALL | RBTREE_BTREE | RBTREE_LAZY |
+               RBTREE_HUGEPAGE | RBTREE_BUFFERED);
+  }
+  // intrusive 노드는 호출한 쪽 것이므로 count 합치기나 경로 복사를 할 수 없고,
+  // 순서가 cmp로 정해지므로 key 기반 filter도 의미가 없다.
+  if (flags & RBTREE_INTRUSIVE) {
+    flags &= ~(RBTREE_COUNTED | RBTREE_PERSISTENT | RBTREE_FILTER |
+               RBTREE_SMALL | RBTREE_BTREE | RBTREE_LAZY | RBTREE_HUGEPAGE |
+               RBTREE_BUFFERED);
+  }
+  // B-tree 엔진은 노드를 덩어리에 담으므로 이진 트리용 모드와 같이 쓸 수 없다.
+  // (덩어리 leaf가 이미 key를 모아서 쓰므로 쓰기 버퍼도 필요 없다)
+  if (flags & RBTREE_BTREE) {
+    flags &= ~(RBTREE_FINGER | RBTREE_SMALL | RBTREE_LAZY | RBTREE_BUFFERED);
+  }
+  // tombstone은 count가 0인 노드이므로 같은 key는 노드 하나로 모은다.
+  if (flags & RBTREE_LAZY) flags = (flags & ~RBTREE_SMALL) | RBTREE_COUNTED;
+  // 쓰기 버퍼는 큰 트리를 위한 것이고, inline 배열과 겹치므로 small 모드는 끈다.
+  if (flags & RBTREE_BUFFERED) flags &= ~RBTREE_SMALL;
+
+  rbtree *t;
+  if (flags & RBTREE_SMALL) {
+    // 트리, sentinel, 첫 노드들을 한 번의 할당으로
+    t = small_tree_new((flags & RBTREE_COUNTED) ? sizeof(rbtree_counted_node)
+                                                : sizeof(node_t));
+    if (!t) return NULL;
+  } else {
+    t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    node_t *nil = calloc(1, sizeof(*nil));
+    if (!nil) {
+      free(t);
+      return NULL;
+    }
+    nil->color = RBTREE_BLACK;
+    nil->parent = nil->left = nil->right = nil;
+    t->nil = nil;
+  }
+  t->root = t->nil;
+  t->max = t->nil;
+  t->flags = flags;
+  next_gen(t);
+  if ((flags & RBTREE_PERSISTENT) && pstate_init(t) != 0) {
+    free(t->nil);
+    free(t);
+    return NULL;
+  }
+  if (((flags & RBTREE_BTREE) && btree_init(t) != 0) ||
+      ((flags & RBTREE_CONCURRENT) && conc_init(t) != 0) ||
+      ((flags & RBTREE_FILTER) && filter_init(t, 0) != 0) ||
+      ((flags & RBTREE_HUGEPAGE) && huge_arena_init(t) != 0) ||
+      ((flags & RBTREE_BUFFERED) && wbuf_init(t) != 0)) {
+    delete_rbtree(t);
+    return NULL;
+  }
   return t;
 }
 
-// 서브트리를 후위순회로 모두 해제
-static void free_subtree(rbtree *t, node_t *n) {
-  if (!t || !n || n == t->nil) return; // sentinel은 free하지 않음
-  free_subtree(t, n->left);
-  free_subtree(t, n->right);
-  free(n);
+// x 서브트리에서 최대 budget 걸음만큼 노드를 해제하고 남은 서브트리(다 했으면 nil)를 반환
+// 재귀 대신 왼쪽 자식을 오른쪽으로 회전시켜 펴가면서 왼쪽이 빈 노드부터 해제한다. (스택 O(1))
+static node_t *free_some(rbtree *t, node_t *x, size_t budget) {
+  for (; x != t->nil && budget > 0; budget--) {
+    node_t *l = x->left;
+    if (l == t->nil) {
+      node_t *r = x->right;
+      node_free(t, x);
+      x = r;
+    } else {
+      x->left = l->right;
+      l->right = x;
+      x = l;
+    }
+  }
+  return x;
 }
 
-// 트리 전체 해제
-void delete_rbtree(rbtree *t) {
-  // TODO: reclaim the tree nodes's memory
-  if (!t) return;
-  free_subtree(t, t->root);
-  free(t->nil); // sentinel은 마지막에 1번만 free
-  free(t);
+// 서브트리의 노드를 모두 해제
+static void free_subtree(rbtree *t, node_t *n) {
+  if (!t || !n || n == t->nil) return; // sentinel은 free하지 않음
+  free_some(t, n, SIZE_MAX);
 }
 
-// 오른쪽에 nil이 아닌 자식 y가 있는 노드 x에 대한 좌회전 함수
-// y가 x의 부모로 올라가며 x는 y의 왼쪽 자식이 되고 
-// 기존에 있던 y의 왼쪽 자식은 x의 오른쪽 자식으로 붙는다.
-static void rotate_left(rbtree *t, node_t *x) {
-  // 전제: x에 nil이 아닌 오른쪽 자식 y가 존재해야 함
-  assert(x != t->nil);
-  assert(x->right != t->nil);
+/*
+작은 트리 inline 모드 (RBTREE_SMALL)
 
-  node_t *y = x->right;
+key가 몇 개 안 되는 트리를 많이 만드는 경우를 위한 모드.
+트리 구조체, sentinel, 노드 SMALL_MAX개 자리를 한 번의 calloc으로 잡고,
+key가 SMALL_MAX개 이하인 동안은 트리 대신 정렬된 key 배열(keys)을 선형 스캔한다.
+노드 자리(slots)의 주소는 바뀌지 않으므로 지금처럼 node_t *를 그대로 돌려줄 수 있고,
+keys[i]가 어느 자리에 들었는지는 slot[i]로 찾는다.
+SMALL_MAX개를 넘으면 그 자리의 노드들을 그대로 레드-블랙 트리로 엮어서(promote) 이후로는 일반 트리처럼 동작한다.
+(이때도 노드 주소는 그대로이고, 트리에서 빠진 자리는 node_alloc이 다시 쓴다)
+*/
 
-  // 최종 목표는 x를 y의 자식으로 옮기고 y를 x의 부모로 바꾸는 것이지만
-  // 실제로 포인터가 가리키는 대상을 바꾸기 전에 y의 기존 자식, x의 기존 부모에 대한 처리를 먼저 해줘야 한다.
+#define SMALL_MAX 8
+#define SMALL_FULL ((1u << SMALL_MAX) - 1)
 
-  // y의 기존 자식(왼쪽 자식) 처리
-  // y의 왼쪽 자식은 이제 x의 오른쪽에 붙는다.
-  x->right = y->left;
-  if (y->left != t->nil)
-  {
-    y->left->parent = x;
-  }
+struct rbtree_small {
+  node_t nil;                      // 이 트리의 sentinel
+  key_t keys[SMALL_MAX];           // inline 상태의 key들 (오름차순)
+  unsigned char slot[SMALL_MAX];   // keys[i]를 담은 노드 자리 번호
+  unsigned char n;                 // inline 상태의 key 개수
+  unsigned char used;              // 사용 중인 노드 자리 비트마스크
+  unsigned char promoted;          // 트리로 바뀌었으면 1
+  size_t stride;                   // 노드 자리 하나의 크기 (node_bytes)
+  node_t slots[];                  // 노드 자리 SMALL_MAX개 (stride 간격)
+};
 
-  // x의 기존 부모(y의 할아버지) 처리
-  // x의 부모에게도 이제 x대신 y를 자식으로 등록해주기
-  y->parent = x->parent; // 이제 y의 부모 포인터는 x가 아닌 x의 부모를 가리키게 됨
-  if (x->parent == t->nil) { // 부모가 없다는건 루트였다는 뜻이므로 y를 새로운 루트로 등록
-    t->root = y;
-  } 
-  else if (x == x->parent->left) { // y를 x가 있던 정확한 위치로 옮김(x가 왼쪽 자식이었는지 오른쪽 자식이었는지)
-    x->parent->left = y;
-  } 
-  else {
-    x->parent->right = y;
-  }
+static node_t *small_slot(const struct rbtree_small *s, int i) {
+  return (node_t *)((char *)s->slots + (size_t)i * s->stride);
+}
 
-  // 기존 부모 자식들에 대한 처리가 끝나면 그제서야 x와 y의 부모자식관계 바꾸기
-  y->left = x;
-  x->parent = y;
+static rbtree *small_tree_new(size_t stride) {
+  rbtree *t = calloc(1, sizeof(*t) + sizeof(struct rbtree_small) +
+                            SMALL_MAX * stride);
+  if (!t) return NULL;
+  struct rbtree_small *s = (struct rbtree_small *)(t + 1);
+  s->stride = stride;
+  s->nil.color = RBTREE_BLACK;
+  s->nil.parent = s->nil.left = s->nil.right = &s->nil;
+  t->small = s;
+  t->nil = &s->nil;
+  return t;
 }
 
-// 좌회전 함수와 대칭
-static void rotate_right(rbtree *t, node_t *x) {
-  assert(x != t->nil);
-  assert(x->left != t->nil);
+static int small_owns(const rbtree *t, const node_t *n) {
+  return t->small && n >= t->small->slots &&
+         n < small_slot(t->small, SMALL_MAX);
+}
 
-  node_t *y = x->left;
+// 아직 정렬 배열 상태인지
+static int small_inline(const rbtree *t) {
+  return t->small && !t->small->promoted;
+}
 
-  x->left = y->right;
-  if (y->right != t->nil)
-  {
-    y->right->parent = x;
+// key보다 작은(or_equal이면 작거나 같은) key의 개수
+// 분기 없는 선형 스캔이라 SMALL_MAX 정도 크기에서는 이분 탐색보다 빠르다.
+static int small_rank(const struct rbtree_small *s, const key_t key,
+  int or_equal) {
+  int r = 0;
+  for (int i = 0; i < s->n; i++) {
+    r += or_equal ? s->keys[i] <= key : s->keys[i] < key;
   }
+  return r;
+}
 
-  y->parent = x->parent;
-  if (x->parent == t->nil) {
-    t->root = y;
-  } 
-  else if (x == x->parent->right) {
-    x->parent->right = y;
-  } 
-  else {
-    x->parent->left = y;
+static node_t *small_at(const rbtree *t, int i) {
+  return small_slot(t->small, t->small->slot[i]);
+}
+
+// 노드 x가 keys의 몇 번째인지 (없으면 -1)
+static int small_pos(const rbtree *t, const node_t *x) {
+  const struct rbtree_small *s = t->small;
+  for (int i = 0; i < s->n; i++) {
+    if (small_slot(s, s->slot[i]) == x) return i;
   }
+  return -1;
+}
 
-  y->right = x;
-  x->parent = y;
+static node_t *small_find(const rbtree *t, const key_t key) {
+  int i = small_rank(t->small, key, 0);
+  return (i < t->small->n && t->small->keys[i] == key) ? small_at(t, i) : NULL;
 }
 
-static void insert_fixup(rbtree *t, node_t *z) {
-  // 부모가 최종적으로 검은색이어야 하므로 부모가 빨간색인 동안 fixup 반복
-  while (z->parent->color == RBTREE_RED)
-  {
-    node_t *p = z->parent;
-    node_t *g = p->parent;
-    if (p == g->left) // z의 부모가 왼쪽 자식일 때
-    {
-      node_t *u = g->right; // u는 z의 삼촌
-      if (u->color == RBTREE_RED) { // case 1: 삼촌 빨간색
-        g->color = RBTREE_RED;
-        p->color = RBTREE_BLACK;
-        u->color = RBTREE_BLACK;
-        z = g;
-      } else {
-        if (z == p->right) {// case 2: g-p-z 꺾임
-          z = p;
-          rotate_left(t, z);
-          // 회전이 끝나면 부모 조부모 관계가 바뀌므로 포인터 갱신 필요
-          p = z->parent;
-          g = p->parent;
-        }
-        // case 3: g-p-z 선형
-        p->color = RBTREE_BLACK;
-        g->color = RBTREE_RED;
-        rotate_right(t, g);
-      }
+// 정렬 배열에 있던 노드들을 순서대로 붙여서 레드-블랙 트리로 바꾼다.
+// 매번 최대 노드 오른쪽에 붙으므로 하강 없이 fixup만 한다.
+static void small_promote(rbtree *t) {
+  struct rbtree_small *s = t->small;
+  struct rbtree_filter *f = t->filter; // filter에는 이미 들어있으므로 다시 넣지 않는다.
+  t->filter = NULL;
+  t->size = 0;
+  for (int i = 0; i < s->n; i++) {
+    link_at(t, t->max, small_at(t, i), 0);
+  }
+  t->filter = f;
+  s->n = 0;
+  s->promoted = 1;
+}
+
+// inline 상태에서의 삽입. 배열이 가득 차서 트리로 바꿨으면 NULL을 반환하므로
+// 호출한 쪽은 이어서 트리 경로로 삽입한다.
+// unique면 같은 key가 있을 때 그 노드를 반환, counted 모드면 count만 올린다.
+static node_t *small_insert(rbtree *t, const key_t key, int unique,
+  int *existed) {
+  struct rbtree_small *s = t->small;
+  int i = small_rank(s, key, 0);
+  if (i < s->n && s->keys[i] == key) {
+    if (unique) {
+      if (existed) *existed = 1;
+      return small_at(t, i);
     }
-    else // z의 부모가 오른쪽 자식일 때
-    {
-      node_t *u = g->left; // u는 z의 삼촌
-      if (u->color == RBTREE_RED) { // case 1: 삼촌 빨간색
-        g->color = RBTREE_RED;
-        p->color = RBTREE_BLACK;
-        u->color = RBTREE_BLACK;
-        z = g;
-      } else {
-        if (z == p->left) {// case 2: g-p-z 꺾임
-          z = p;
-          rotate_right(t, z);
-          p = z->parent;
-          g = p->parent;
-        }
-        // case 3: g-p-z 선형
-        p->color = RBTREE_BLACK;
-        g->color = RBTREE_RED;
-        rotate_left(t, g);
-      }
+    if (t->flags & RBTREE_COUNTED) {
+      NODE_COUNT(small_at(t, i))++;
+      return small_at(t, i);
     }
+    i = small_rank(s, key, 1); // 같은 key는 뒤에 둔다 (트리 삽입과 같은 순서)
+  }
+  if (s->n == SMALL_MAX) {
+    small_promote(t);
+    return NULL;
   }
 
-  t->root->color = RBTREE_BLACK;
+  node_t *node = node_alloc(t);
+  node->key = key;
+  node_count_init(t, node);
+  node->color = RBTREE_BLACK;
+  node->parent = node->left = node->right = t->nil;
+  memmove(&s->keys[i + 1], &s->keys[i], (s->n - i) * sizeof(key_t));
+  memmove(&s->slot[i + 1], &s->slot[i], s->n - i);
+  s->keys[i] = key;
+  s->slot[i] = (unsigned char)(((char *)node - (char *)s->slots) / s->stride);
+  s->n++;
+  t->size++;
+  if (t->filter) filter_add(t, key);
+  if (existed) *existed = 0;
+  return node;
 }
 
-node_t *rbtree_insert(rbtree *t, const key_t key) {
-  // TODO: implement insert
-  if (!t) return NULL;
+static void small_remove(rbtree *t, node_t *z) {
+  struct rbtree_small *s = t->small;
+  int i = small_pos(t, z);
+  if (i < 0) return;
+  memmove(&s->keys[i], &s->keys[i + 1], (s->n - i - 1) * sizeof(key_t));
+  memmove(&s->slot[i], &s->slot[i + 1], s->n - i - 1);
+  s->n--;
+  t->size--;
+  if (t->filter) filter_remove(t, z->key);
+  node_free(t, z);
+  next_gen(t);
+}
 
-  // node 초기 설정
-  node_t *node = calloc(1, sizeof(*node));
-  if (!node) return NULL;
-  node->left = node->right = node->parent = t->nil;
-  node->color = (t->root == t->nil ? RBTREE_BLACK : RBTREE_RED);
-  node->key = key;
+// x 다음(dir > 0) 또는 이전(dir < 0) 노드. x가 NULL이면 그 방향의 첫 노드 (min/max)
+static node_t *small_step(const rbtree *t, const node_t *x, int dir) {
+  int i = x ? small_pos(t, x) : (dir > 0 ? -1 : t->small->n);
+  if (x && i < 0) return NULL;
+  i += dir;
+  return (i >= 0 && i < t->small->n) ? small_at(t, i) : NULL;
+}
 
-  // 트리가 비어있으면 바로 루트로 삼고 함수 종료
-  if (t->root == t->nil)
-  {
-    t->root = node;
-    return node;
-  }
+/*
+노드 arena
 
-  // BST 규칙 삽입 먼저 구현
-  node_t *parent = t->nil;
-  node_t *tmp = t->root;
-  while (tmp != t->nil) {
-    parent = tmp;
-    tmp = (key < tmp->key) ? tmp->left : tmp->right;
+기본 트리는 노드마다 calloc/free를 쓴다. rbtree_build_parallel처럼 노드를 덩어리(chunk)로
+한 번에 잡은 트리는 t->arena를 가지며, 이후 insert/erase도 arena에서 할당/반납한다.
+(chunk 중간의 노드는 free할 수 없으므로 반납된 노드는 free list로 재사용)
+RBTREE_HUGEPAGE 트리는 처음부터 arena를 쓰고, chunk를 2MiB 경계에 맞춘 mmap 영역으로 잡아
+MADV_HUGEPAGE를 요청한다. 노드 수천만 개를 훑는 탐색의 TLB 미스가 줄어든다.
+(mmap이 실패하면 malloc chunk로, madvise가 실패하면 보통 페이지로 그대로 동작)
+*/
+
+// arena가 새로 잡는 chunk의 최소/최대 노드 수
+#define ARENA_CHUNK_MIN 64
+#define ARENA_CHUNK_MAX (1u << 16)
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+typedef struct node_chunk {
+  struct node_chunk *next;
+  size_t cap;      // 이 chunk가 담을 수 있는 노드 수
+  size_t used;     // 앞에서부터 나눠준 노드 수
+  size_t mapped;   // mmap으로 잡은 바이트 (malloc chunk면 0)
+  int huge;        // MADV_HUGEPAGE 요청이 받아들여졌음
+  size_t stride;   // 노드 자리 하나의 크기 (counted 트리는 rbtree_counted_node)
+  node_t nodes[];  // stride 간격 (chunk_at으로 접근)
+} node_chunk;
+
+struct rbtree_arena {
+  node_chunk *chunks;  // 가장 최근 chunk가 맨 앞
+  node_t *free_list;   // 반납된 노드들 (right로 연결)
+  int huge;            // chunk를 huge page mmap으로 잡는다 (RBTREE_HUGEPAGE)
+  size_t stride;       // 새 chunk의 노드 자리 크기 (0이면 sizeof(node_t))
+};
+
+// 공유 context의 노드 풀 (아래 rbtree_ctx 참고)
+struct rbtree_ctx {
+  pthread_mutex_t lock;
+  struct rbtree_arena pool;  // 모든 트리가 나눠 쓰는 노드 풀
+};
+
+static node_t *chunk_at(const node_chunk *c, size_t i) {
+  return (node_t *)((char *)c->nodes + i * c->stride);
+}
+
+static int chunk_owns(const node_chunk *c, const node_t *n) {
+  return n >= c->nodes && n < chunk_at(c, c->cap);
+}
+
+// 2MiB 경계에 맞춘 익명 mmap (앞뒤로 남는 부분은 되돌려준다). 실패하면 NULL
+static void *huge_map(size_t bytes) {
+  char *p = mmap(NULL, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  const size_t head = (HUGE_PAGE_SIZE - (uintptr_t)p % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+  if (head) munmap(p, head);
+  if (HUGE_PAGE_SIZE - head) munmap(p + head + bytes, HUGE_PAGE_SIZE - head);
+  return p + head;
+}
+
+// 노드 cap개짜리 chunk. huge면 2MiB 단위로 올려 잡고 남는 자리까지 cap에 넣는다.
+static node_chunk *chunk_new(size_t cap, int huge, size_t stride) {
+  node_chunk *c = NULL;
+  size_t mapped = 0;
+  if (huge) {
+    mapped = sizeof(*c) + cap * stride;
+    mapped = (mapped + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    c = huge_map(mapped);
   }
+  if (c) {
+    cap = (mapped - sizeof(*c)) / stride;
+#ifdef MADV_HUGEPAGE
+    c->huge = madvise(c, mapped, MADV_HUGEPAGE) == 0;
+#else
+    c->huge = 0;
+#endif
+  } else {
+    c = malloc(sizeof(*c) + cap * stride);
+    if (!c) return NULL;
+    mapped = 0;
+    c->huge = 0;
+  }
+  c->next = NULL;
+  c->cap = cap;
+  c->used = 0;
+  c->mapped = mapped;
+  c->stride = stride;
+  return c;
+}
 
-  node->parent = parent;
-  if (key < parent->key) {
-    parent->left = node;
+static void chunk_release(node_chunk *c) {
+  if (c->mapped) {
+    munmap(c, c->mapped);
   } else {
-    parent->right = node;
+    free(c);
   }
+}
 
-  // BST 규칙 삽입이 끝나면 insert_fixup 함수를 실행시켜 색상 규칙 위반안되도록 트리 수정
-  insert_fixup(t, node);
+// arena에 노드 cap개짜리 chunk를 붙인다. chunk를 반환
+static node_chunk *arena_grow(struct rbtree_arena *a, size_t cap) {
+  node_chunk *c = chunk_new(cap, a->huge, a->stride ? a->stride : sizeof(node_t));
+  if (!c) return NULL;
+  c->next = a->chunks;
+  a->chunks = c;
+  return c;
+}
 
-  return node;
+// t가 arena를 쓰도록 전환하고 노드 cap개짜리 chunk를 붙인다. chunk를 반환
+static node_chunk *arena_reserve(rbtree *t, size_t cap) {
+  if (!t->arena) {
+    t->arena = calloc(1, sizeof(*t->arena));
+    if (!t->arena) return NULL;
+    t->arena->stride = node_bytes(t);
+  }
+  return arena_grow(t->arena, cap);
 }
 
-node_t *rbtree_find(const rbtree *t, const key_t key) {
-  // TODO: implement find
-  if (!t) return NULL;
+// RBTREE_HUGEPAGE: 처음부터 huge page chunk를 잡는 arena를 쓴다.
+static int huge_arena_init(rbtree *t) {
+  t->arena = calloc(1, sizeof(*t->arena));
+  if (!t->arena) return -1;
+  t->arena->huge = 1;
+  t->arena->stride = node_bytes(t);
+  return 0;
+}
 
-  node_t *tmp = t->root;
-  while(tmp != t->nil)
-  {
-    if (tmp->key < key) {
-      tmp = tmp->right;
-    } else if (tmp->key > key) {
-      tmp = tmp->left;
-    } else {
-      return tmp;
-    }
+// arena에서 노드 하나를 꺼낸다. (반납된 노드 → 마지막 chunk의 남은 자리 → 새 chunk 순)
+static node_t *arena_take(struct rbtree_arena *a) {
+  node_t *n = a->free_list;
+  if (n) {
+    a->free_list = n->right;
+    return n;
   }
-  return NULL;
+  node_chunk *c = a->chunks;
+  if (!c || c->used == c->cap) {
+    // chunk 크기는 직전 chunk의 두 배로 키우되 상한을 둔다.
+    size_t cap = c ? c->cap * 2 : ARENA_CHUNK_MIN;
+    if (cap < ARENA_CHUNK_MIN) cap = ARENA_CHUNK_MIN;
+    if (cap > ARENA_CHUNK_MAX) cap = ARENA_CHUNK_MAX;
+    c = arena_grow(a, cap);
+    if (!c) return NULL;
+  }
+  return chunk_at(c, c->used++);
 }
 
-node_t *rbtree_min(const rbtree *t) {
-  if (!t || t->root == t->nil) return NULL;
-  node_t *tmp = t->root;
-  while(tmp->left != t->nil)
-  {
-    tmp = tmp->left;
+static void arena_free_chunks(struct rbtree_arena *a) {
+  node_chunk *c = a->chunks;
+  while (c) {
+    node_chunk *next = c->next;
+    chunk_release(c);
+    c = next;
   }
-  return tmp;
 }
 
-node_t *rbtree_max(const rbtree *t) {
-  if (!t || t->root == t->nil) return NULL;
-  node_t *tmp = t->root;
-  while(tmp->right != t->nil)
-  {
-    tmp = tmp->right;
+static node_t *node_alloc(rbtree *t) {
+  // small 트리는 구조체 안의 노드 자리부터 쓴다.
+  if (t->small && t->small->used != SMALL_FULL) {
+    struct rbtree_small *s = t->small;
+    int i = __builtin_ctz(~s->used & SMALL_FULL);
+    s->used |= 1u << i;
+    return small_slot(s, i);
   }
-  return tmp;
+  if (t->ctx) {
+    pthread_mutex_lock(&t->ctx->lock);
+    node_t *n = arena_take(&t->ctx->pool);
+    pthread_mutex_unlock(&t->ctx->lock);
+    return n;
+  }
+  if (!t->arena) return calloc(1, node_bytes(t));
+  return arena_take(t->arena);
 }
 
-// 노드 u 자리에 v 서브트리를 이식
-static void rbtree_transplant(rbtree *t, node_t *u, node_t *v) {
-  if (u->parent == t->nil) {
-    t->root = v;
-  } else if (u == u->parent->left) {
-    u->parent->left = v;
-  } else {
-    u->parent->right = v;
+static void node_free(rbtree *t, node_t *n) {
+  if (small_owns(t, n)) {
+    t->small->used &= ~(1u << (n - t->small->slots));
+    return;
+  }
+  if (t->ctx) {
+    pthread_mutex_lock(&t->ctx->lock);
+    n->right = t->ctx->pool.free_list;
+    t->ctx->pool.free_list = n;
+    pthread_mutex_unlock(&t->ctx->lock);
+    return;
   }
-  v->parent = u->parent;
+  if (t->compact && compact_release(t, n)) return; // 재배치 중 옛 자리의 노드
+  if (!t->arena) {
+    free(n);
+    return;
+  }
+  n->right = t->arena->free_list;
+  t->arena->free_list = n;
 }
 
-static void rbtree_erase_fixup(rbtree *t, node_t *x) {
-  while (x != t->root && x->color == RBTREE_BLACK)
-  {
-    if (x == x->parent->left) // x가 왼쪽 자식일 때
-    {
-      node_t *w = x->parent->right; // w는 x의 형제
-      // case 1: 형제가 적색일 경우 회전과 색 교환을 통해 형제가 흑색인 형태로(새로운 형제) 트리 구조를 조작
-      // => case 2,3,4(형제가 흑색인 case들) 중 하나로 변환되어 이중 흑색 처리를 이어나감
-      if (w->color == RBTREE_RED) {
-        // x.p, w 색 바꾸기
-        w->color = RBTREE_BLACK;
-        x->parent->color = RBTREE_RED;
-        // x.p 기준 좌회전
-        rotate_left(t, x->parent);
-        // new w 설정
-        w = x->parent->right;
-      }
-      // case 2: 형제가 흑색이면서 형제의 자식들이 모두 흑색일 경우
-      // => 재색칠을 통해 문제를 한 단계 위로 밀어올림(이중 흑색을 부모에게 전파) 
-      if (w->left->color == RBTREE_BLACK && w->right->color == RBTREE_BLACK) 
-      {
-        // x, w 흑색을 x.p로 전파
-        w->color = RBTREE_RED;
-        // x.p를 new x로 설정
-        x = x->parent;
-      }
-      // case 3 & case 4
-      else
-      {
-        // case 3: 형제가 흑색이면서 형제의 왼쪽 자식이 적색, 오른쪽 자식이 흑색인 경우
-        // => 재색칠과 회전을 통해 적색 노드를 오른쪽 자식으로 갖는 새로운 흑색 형제 만듬
-        // => case 4로 변환 완료!
-        if (w->left->color == RBTREE_RED && w->right->color == RBTREE_BLACK) 
-        {
-          // w, w.left 색 바꾸기
-          w->color = RBTREE_RED;
-          w->left->color = RBTREE_BLACK;
-          // w 기준 우회전
-          rotate_right(t, w);
-          // new w 설정
-          w = w->parent;
-        }
-        // case 4: 형제가 흑색이면서 형제의 오른쪽 자식(x에서 멀리 떨어져있는 조카)이 적색인 경우(최종 해결 단계)
-        if (w->right->color == RBTREE_RED) 
+static void arena_destroy(rbtree *t) {
+  arena_free_chunks(t->arena);
+  free(t->arena);
+  t->arena = NULL;
+}
+
+/*
+공유 context (rbtree_ctx)
+
+작은 트리를 아주 많이 만들 때 트리마다 sentinel과 malloc 헤더를 따로 갖지 않도록,
+new_rbtree_in으로 만든 트리는 읽기 전용 sentinel 하나와 context의 노드 풀을 같이 쓴다.
+sentinel은 const 객체이고 insert/erase 어디에서도 nil에 쓰지 않으므로
+서로 다른 트리를 서로 다른 스레드에서 동시에 고쳐도 안전하다. (풀은 lock으로 보호)
+*/
+
+// 모든 context 트리가 공유하는 sentinel
+static const node_t shared_nil = {
+  .color = RBTREE_BLACK,
+  .parent = (node_t *)&shared_nil,
+  .left = (node_t *)&shared_nil,
+  .right = (node_t *)&shared_nil,
+};
+
+rbtree_ctx *rbtree_ctx_new(void) {
+  rbtree_ctx *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) return NULL;
+  pthread_mutex_init(&ctx->lock, NULL);
+  return ctx;
+}
+
+// context의 노드를 모두 해제한다. context에서 만든 트리는 먼저 delete_rbtree로 지워야 한다.
+void rbtree_ctx_delete(rbtree_ctx *ctx) {
+  if (!ctx) return;
+  arena_free_chunks(&ctx->pool);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+}
+
+rbtree *new_rbtree_in(rbtree_ctx *ctx) {
+  if (!ctx) return NULL;
+  rbtree *t = calloc(1, sizeof(*t));
+  if (!t) return NULL;
+  t->ctx = ctx;
+  t->nil = (node_t *)&shared_nil;
+  t->root = t->nil;
+  t->max = t->nil;
+  next_gen(t);
+  return t;
+}
+
+// x 서브트리의 노드들을 right로 엮어서 list 앞에 붙인다. 처음 붙은 노드를 *tail에 기록
+static node_t *ctx_collect(rbtree *t, node_t *x, node_t *list, node_t **tail) {
+  while (x != t->nil) {
+    list = ctx_collect(t, x->left, list, tail);
+    node_t *r = x->right;
+    if (!*tail) *tail = x;
+    x->right = list;
+    list = x;
+    x = r;
+  }
+  return list;
+}
+
+// 트리의 노드를 lock 한 번으로 풀에 모두 돌려준다.
+static void ctx_reclaim(rbtree *t) {
+  node_t *tail = NULL;
+  node_t *list = ctx_collect(t, t->root, NULL, &tail);
+  if (!list) return;
+  pthread_mutex_lock(&t->ctx->lock);
+  tail->right = t->ctx->pool.free_list;
+  t->ctx->pool.free_list = list;
+  pthread_mutex_unlock(&t->ctx->lock);
+}
+
+/*
+B-tree 엔진 (RBTREE_BTREE)
+
+노드 하나에 key 하나씩 두는 이진 트리는 비교 한 번마다 캐시 미스가 난다.
+이 엔진은 key를 BT_MAX개씩 정렬해서 캐시 라인에 맞춘 덩어리(B+ tree 노드)에 담고,
+덩어리 안에서는 SIMD 비교 + movemask로 "key보다 작은 key 수"를 한 번에 센다.
+API는 그대로 node_t *를 주고받으므로 key마다 node_t는 여전히 있지만, 탐색 중에는
+덩어리만 읽고 마지막에 찾은 node_t 하나만 따라간다.
+- leaf의 vals[i]가 keys[i]의 node_t이고, node_t의 parent 자리에 그 노드가 든 leaf를 기록해둔다.
+  (erase/next/prev가 노드에서 바로 leaf 위치로 갈 수 있도록)
+- leaf들은 prev/next로 이어져 있어 순회와 rbtree_to_array는 leaf만 차례로 훑는다.
+- 내부 노드의 keys[i]는 child[i]와 child[i + 1]의 경계. 같은 key가 여러 leaf에 걸칠 수 있으므로
+  child[i]의 key는 keys[i - 1] 이상 keys[i] 이하이고, 하강은 "key보다 작은 경계 수"로 자식을 고른다.
+- 안 쓰는 key 자리는 INT_MAX로 채워두므로 SIMD 비교는 항상 BT_MAX개 전체를 본다.
+  (INT_MAX는 어떤 key보다도 작지 않으므로 개수에 섞이지 않는다)
+- 루트가 아닌 노드는 BT_MIN개 이상을 유지하도록 erase 때 이웃에서 빌리거나 합친다.
+SIMD 폭은 컴파일 옵션을 따른다. (-mavx2면 AVX2, x86-64 기본은 SSE2, 그 외는 스칼라)
+*/
+
+#define BT_MAX 32
+#define BT_MIN (BT_MAX / 2)
+
+// leaf와 내부 노드가 같이 쓰는 앞부분 (keys가 맨 앞이어야 64바이트 정렬을 그대로 받는다)
+typedef struct bt_node {
+  key_t keys[BT_MAX];
+  struct bt_inner *parent;
+  int n;  // 쓰고 있는 key 수
+} bt_node;
+
+typedef struct bt_inner {
+  bt_node h;
+  bt_node *child[BT_MAX + 1];
+} bt_inner;
+
+typedef struct bt_leaf {
+  bt_node h;
+  node_t *vals[BT_MAX];
+  struct bt_leaf *prev, *next;
+} bt_leaf;
+
+struct rbtree_btree {
+  bt_node *root;
+  int height;  // 내부 노드 단계 수 (0이면 루트가 leaf)
+  bt_leaf *first, *last;
+};
+
+// keys[0..BT_MAX) 중 key보다 작은 것의 개수 (정렬되어 있으므로 lower bound 위치)
+static inline int bt_rank(const key_t *keys, const key_t key) {
+#if defined(__AVX2__)
+  const __m256i k = _mm256_set1_epi32(key);
+  int r = 0;
+  for (int i = 0; i < BT_MAX; i += 8) {
+    __m256i v = _mm256_load_si256((const __m256i *)(keys + i));
+    r += __builtin_popcount(
+      _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, v))));
+  }
+  return r;
+#elif defined(__SSE2__)
+  const __m128i k = _mm_set1_epi32(key);
+  int r = 0;
+  for (int i = 0; i < BT_MAX; i += 4) {
+    __m128i v = _mm_load_si128((const __m128i *)(keys + i));
+    r += __builtin_popcount(
+      _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, v))));
+  }
+  return r;
+#else
+  int r = 0;
+  for (int i = 0; i < BT_MAX; i++) r += keys[i] < key;
+  return r;
+#endif
+}
+
+static void *bt_alloc(size_t size) {
+  void *p = aligned_alloc(64, (size + 63) & ~(size_t)63);
+  if (!p) return NULL;
+  memset(p, 0, size);
+  for (int i = 0; i < BT_MAX; i++) ((bt_node *)p)->keys[i] = INT_MAX;
+  return p;
+}
+
+static int btree_init(rbtree *t) {
+  struct rbtree_btree *b = calloc(1, sizeof(*b));
+  if (!b) return -1;
+  bt_leaf *leaf = bt_alloc(sizeof(bt_leaf));
+  if (!leaf) {
+    free(b);
+    return -1;
+  }
+  b->root = &leaf->h;
+  b->first = b->last = leaf;
+  t->btree = b;
+  return 0;
+}
+
+static void bt_free_node(rbtree *t, bt_node *x, int height) {
+  if (height > 0) {
+    bt_inner *in = (bt_inner *)x;
+    for (int i = 0; i <= x->n; i++) bt_free_node(t, in->child[i], height - 1);
+  } else if (!(t->flags & RBTREE_INTRUSIVE)) {
+    bt_leaf *leaf = (bt_leaf *)x;
+    for (int i = 0; i < x->n; i++) node_free(t, leaf->vals[i]);
+  }
+  free(x);
+}
+
+static void btree_destroy(rbtree *t) {
+  bt_free_node(t, t->btree->root, t->btree->height);
+  free(t->btree);
+  t->btree = NULL;
+}
+
+static bt_leaf *bt_descend(const struct rbtree_btree *b, const key_t key) {
+  bt_node *x = b->root;
+  for (int h = b->height; h > 0; h--) {
+    x = ((bt_inner *)x)->child[bt_rank(x->keys, key)];
+  }
+  return (bt_leaf *)x;
+}
+
+// key를 가진 첫 노드. 없으면 NULL
+static node_t *bt_find(const rbtree *t, const key_t key) {
+  bt_leaf *leaf = bt_descend(t->btree, key);
+  int pos = bt_rank(leaf->h.keys, key);
+  if (pos == leaf->h.n) {
+    // 경계와 같은 key는 다음 leaf의 맨 앞에 있을 수 있다.
+    leaf = leaf->next;
+    pos = 0;
+    if (!leaf) return NULL;
+  }
+  return leaf->h.keys[pos] == key ? leaf->vals[pos] : NULL;
+}
+
+static int bt_child_index(const bt_inner *p, const bt_node *x) {
+  int i = 0;
+  while (p->child[i] != x) i++;
+  return i;
+}
+
+static void bt_pad(bt_node *x) {
+  for (int i = x->n; i < BT_MAX; i++) x->keys[i] = INT_MAX;
+}
+
+// leaf->vals[from..)의 노드들이 leaf를 가리키도록
+static void bt_adopt_vals(bt_leaf *leaf, int from) {
+  for (int i = from; i < leaf->h.n; i++) leaf->vals[i]->parent = (node_t *)leaf;
+}
+
+static void bt_adopt_children(bt_inner *p, int from) {
+  for (int i = from; i <= p->h.n; i++) p->child[i]->parent = p;
+}
+
+// left 오른쪽에 새로 생긴 형제 right와 그 경계 sep를 부모에 넣는다.
+// 부모가 가득 차면 부모도 나누어 위로 올린다. 필요한 노드는 spare에서 꺼낸다.
+static void bt_insert_parent(struct rbtree_btree *b, bt_node *left,
+  const key_t sep, bt_node *right, bt_inner **spare) {
+  bt_inner *p = left->parent;
+  if (!p) {
+    bt_inner *root = *spare++;
+    root->h.n = 1;
+    root->h.keys[0] = sep;
+    root->child[0] = left;
+    root->child[1] = right;
+    left->parent = right->parent = root;
+    b->root = &root->h;
+    b->height++;
+    return;
+  }
+
+  int idx = bt_child_index(p, left);
+  if (p->h.n < BT_MAX) {
+    memmove(&p->h.keys[idx + 1], &p->h.keys[idx],
+            (p->h.n - idx) * sizeof(key_t));
+    memmove(&p->child[idx + 2], &p->child[idx + 1],
+            (p->h.n - idx) * sizeof(bt_node *));
+    p->h.keys[idx] = sep;
+    p->child[idx + 1] = right;
+    right->parent = p;
+    p->h.n++;
+    return;
+  }
+
+  // 가득 찬 부모: BT_MAX + 1개의 경계를 반으로 나누고 가운데 경계를 위로 올린다.
+  key_t keys[BT_MAX + 1];
+  bt_node *child[BT_MAX + 2];
+  memcpy(keys, p->h.keys, idx * sizeof(key_t));
+  keys[idx] = sep;
+  memcpy(&keys[idx + 1], &p->h.keys[idx], (BT_MAX - idx) * sizeof(key_t));
+  memcpy(child, p->child, (idx + 1) * sizeof(bt_node *));
+  child[idx + 1] = right;
+  memcpy(&child[idx + 2], &p->child[idx + 1],
+         (BT_MAX - idx) * sizeof(bt_node *));
+
+  const int mid = (BT_MAX + 1) / 2;
+  bt_inner *q = *spare++;
+  p->h.n = mid;
+  memcpy(p->h.keys, keys, mid * sizeof(key_t));
+  memcpy(p->child, child, (mid + 1) * sizeof(bt_node *));
+  bt_pad(&p->h);
+  q->h.n = BT_MAX - mid;
+  memcpy(q->h.keys, &keys[mid + 1], q->h.n * sizeof(key_t));
+  memcpy(q->child, &child[mid + 1], (q->h.n + 1) * sizeof(bt_node *));
+  bt_adopt_children(p, 0);
+  bt_adopt_children(q, 0);
+  bt_insert_parent(b, &p->h, keys[mid], &q->h, spare);
+}
+
+// leaf의 pos 자리에 (key, node)를 넣는다. 가득 차면 leaf를 나눈다.
+// 나누는 데 필요한 노드를 먼저 모두 잡아두므로 실패하면 트리는 그대로이고 -1을 반환
+static int bt_leaf_insert(struct rbtree_btree *b, bt_leaf *leaf, int pos,
+  const key_t key, node_t *node) {
+  if (leaf->h.n < BT_MAX) {
+    memmove(&leaf->h.keys[pos + 1], &leaf->h.keys[pos],
+            (leaf->h.n - pos) * sizeof(key_t));
+    memmove(&leaf->vals[pos + 1], &leaf->vals[pos],
+            (leaf->h.n - pos) * sizeof(node_t *));
+    leaf->h.keys[pos] = key;
+    leaf->vals[pos] = node;
+    leaf->h.n++;
+    node->parent = (node_t *)leaf;
+    return 0;
+  }
+
+  // 가득 찬 조상 수만큼(루트까지 가득 차면 새 루트 하나 더) 내부 노드를 미리 잡는다.
+  bt_inner *spare[64];
+  int need = 0;
+  bt_inner *p = leaf->h.parent;
+  while (p && p->h.n == BT_MAX) {
+    need++;
+    p = p->h.parent;
+  }
+  if (!p) need++;
+  bt_leaf *r = bt_alloc(sizeof(bt_leaf));
+  int got = 0;
+  while (r && got < need && (spare[got] = bt_alloc(sizeof(bt_inner)))) got++;
+  if (!r || got < need) {
+    while (got > 0) free(spare[--got]);
+    free(r);
+    return -1;
+  }
+
+  key_t keys[BT_MAX + 1];
+  node_t *vals[BT_MAX + 1];
+  memcpy(keys, leaf->h.keys, pos * sizeof(key_t));
+  keys[pos] = key;
+  memcpy(&keys[pos + 1], &leaf->h.keys[pos], (BT_MAX - pos) * sizeof(key_t));
+  memcpy(vals, leaf->vals, pos * sizeof(node_t *));
+  vals[pos] = node;
+  memcpy(&vals[pos + 1], &leaf->vals[pos], (BT_MAX - pos) * sizeof(node_t *));
+
+  const int half = (BT_MAX + 1) / 2;
+  leaf->h.n = half;
+  memcpy(leaf->h.keys, keys, half * sizeof(key_t));
+  memcpy(leaf->vals, vals, half * sizeof(node_t *));
+  bt_pad(&leaf->h);
+  r->h.n = BT_MAX + 1 - half;
+  memcpy(r->h.keys, &keys[half], r->h.n * sizeof(key_t));
+  memcpy(r->vals, &vals[half], r->h.n * sizeof(node_t *));
+  if (pos < half) node->parent = (node_t *)leaf;
+  bt_adopt_vals(r, 0);
+
+  r->prev = leaf;
+  r->next = leaf->next;
+  if (r->next) {
+    r->next->prev = r;
+  } else {
+    b->last = r;
+  }
+  leaf->next = r;
+  bt_insert_parent(b, &leaf->h, r->h.keys[0], &r->h, spare);
+  return 0;
+}
+
+// 내부 노드 p에서 keys[ki]와 child[ki + 1]을 뺀다.
+static void bt_inner_remove(bt_inner *p, int ki) {
+  memmove(&p->h.keys[ki], &p->h.keys[ki + 1],
+          (p->h.n - ki - 1) * sizeof(key_t));
+  memmove(&p->child[ki + 1], &p->child[ki + 2],
+          (p->h.n - ki - 1) * sizeof(bt_node *));
+  p->h.n--;
+  p->h.keys[p->h.n] = INT_MAX;
+}
+
+// 내부 노드 x가 BT_MIN보다 작아졌으면 이웃에서 하나 빌리거나 이웃과 합친다.
+static void bt_inner_fix(struct rbtree_btree *b, bt_inner *x) {
+  bt_inner *p = x->h.parent;
+  if (!p) {
+    // 루트에 자식이 하나만 남으면 그 자식이 새 루트
+    if (x->h.n == 0) {
+      b->root = x->child[0];
+      b->root->parent = NULL;
+      b->height--;
+      free(x);
+    }
+    return;
+  }
+  if (x->h.n >= BT_MIN) return;
+
+  int idx = bt_child_index(p, &x->h);
+  bt_inner *l = idx > 0 ? (bt_inner *)p->child[idx - 1] : NULL;
+  bt_inner *r = idx < p->h.n ? (bt_inner *)p->child[idx + 1] : NULL;
+  if (l && l->h.n > BT_MIN) {
+    // 왼쪽 형제의 마지막 자식을 부모 경계와 함께 돌려받는다.
+    memmove(&x->h.keys[1], x->h.keys, x->h.n * sizeof(key_t));
+    memmove(&x->child[1], x->child, (x->h.n + 1) * sizeof(bt_node *));
+    x->h.keys[0] = p->h.keys[idx - 1];
+    x->child[0] = l->child[l->h.n];
+    x->child[0]->parent = x;
+    x->h.n++;
+    p->h.keys[idx - 1] = l->h.keys[l->h.n - 1];
+    l->h.n--;
+    l->h.keys[l->h.n] = INT_MAX;
+    return;
+  }
+  if (r && r->h.n > BT_MIN) {
+    x->h.keys[x->h.n] = p->h.keys[idx];
+    x->child[x->h.n + 1] = r->child[0];
+    x->child[x->h.n + 1]->parent = x;
+    x->h.n++;
+    p->h.keys[idx] = r->h.keys[0];
+    memmove(r->h.keys, &r->h.keys[1], (r->h.n - 1) * sizeof(key_t));
+    memmove(r->child, &r->child[1], r->h.n * sizeof(bt_node *));
+    r->h.n--;
+    r->h.keys[r->h.n] = INT_MAX;
+    return;
+  }
+
+  // 빌릴 수 없으면 왼쪽(없으면 오른쪽) 형제와 부모 경계를 사이에 두고 합친다.
+  if (!l) {
+    l = x;
+    x = r;
+    idx++;
+  }
+  const int base = l->h.n + 1;
+  l->h.keys[l->h.n] = p->h.keys[idx - 1];
+  memcpy(&l->h.keys[base], x->h.keys, x->h.n * sizeof(key_t));
+  memcpy(&l->child[base], x->child, (x->h.n + 1) * sizeof(bt_node *));
+  l->h.n = base + x->h.n;
+  bt_adopt_children(l, base);
+  free(x);
+  bt_inner_remove(p, idx - 1);
+  bt_inner_fix(b, p);
+}
+
+// leaf의 pos 자리를 빼고, leaf가 BT_MIN보다 작아졌으면 이웃에서 빌리거나 합친다.
+static void bt_leaf_remove(struct rbtree_btree *b, bt_leaf *leaf, int pos) {
+  memmove(&leaf->h.keys[pos], &leaf->h.keys[pos + 1],
+          (leaf->h.n - pos - 1) * sizeof(key_t));
+  memmove(&leaf->vals[pos], &leaf->vals[pos + 1],
+          (leaf->h.n - pos - 1) * sizeof(node_t *));
+  leaf->h.n--;
+  leaf->h.keys[leaf->h.n] = INT_MAX;
+
+  bt_inner *p = leaf->h.parent;
+  if (!p || leaf->h.n >= BT_MIN) return;
+
+  int idx = bt_child_index(p, &leaf->h);
+  bt_leaf *l = idx > 0 ? (bt_leaf *)p->child[idx - 1] : NULL;
+  bt_leaf *r = idx < p->h.n ? (bt_leaf *)p->child[idx + 1] : NULL;
+  if (l && l->h.n > BT_MIN) {
+    memmove(&leaf->h.keys[1], leaf->h.keys, leaf->h.n * sizeof(key_t));
+    memmove(&leaf->vals[1], leaf->vals, leaf->h.n * sizeof(node_t *));
+    l->h.n--;
+    leaf->h.keys[0] = l->h.keys[l->h.n];
+    leaf->vals[0] = l->vals[l->h.n];
+    leaf->vals[0]->parent = (node_t *)leaf;
+    leaf->h.n++;
+    l->h.keys[l->h.n] = INT_MAX;
+    p->h.keys[idx - 1] = leaf->h.keys[0];
+    return;
+  }
+  if (r && r->h.n > BT_MIN) {
+    leaf->h.keys[leaf->h.n] = r->h.keys[0];
+    leaf->vals[leaf->h.n] = r->vals[0];
+    leaf->vals[leaf->h.n]->parent = (node_t *)leaf;
+    leaf->h.n++;
+    memmove(r->h.keys, &r->h.keys[1], (r->h.n - 1) * sizeof(key_t));
+    memmove(r->vals, &r->vals[1], (r->h.n - 1) * sizeof(node_t *));
+    r->h.n--;
+    r->h.keys[r->h.n] = INT_MAX;
+    p->h.keys[idx] = r->h.keys[0];
+    return;
+  }
+
+  // 왼쪽(없으면 오른쪽) 형제와 합친다. 오른쪽 leaf를 왼쪽 leaf에 붙이고 해제
+  if (!l) {
+    l = leaf;
+    leaf = r;
+    idx++;
+  }
+  const int base = l->h.n;
+  memcpy(&l->h.keys[base], leaf->h.keys, leaf->h.n * sizeof(key_t));
+  memcpy(&l->vals[base], leaf->vals, leaf->h.n * sizeof(node_t *));
+  l->h.n += leaf->h.n;
+  bt_adopt_vals(l, base);
+  l->next = leaf->next;
+  if (l->next) {
+    l->next->prev = l;
+  } else {
+    b->last = l;
+  }
+  free(leaf);
+  bt_inner_remove(p, idx - 1);
+  bt_inner_fix(b, p);
+}
+
+// unique면 같은 key가 있을 때 그 노드를 반환, counted 모드면 count만 올린다.
+static node_t *bt_insert(rbtree *t, const key_t key, int unique, int *existed) {
+  if (unique || (t->flags & RBTREE_COUNTED)) {
+    node_t *dup = bt_find(t, key);
+    if (dup) {
+      if (existed) *existed = 1;
+      if (!unique) NODE_COUNT(dup)++;
+      return dup;
+    }
+  }
+  if (existed) *existed = 0;
+
+  node_t *node = node_alloc(t);
+  if (!node) return NULL;
+  node->key = key;
+  node_count_init(t, node);
+  node->color = RBTREE_BLACK;
+  node->left = node->right = t->nil;
+
+  bt_leaf *leaf = bt_descend(t->btree, key);
+  if (bt_leaf_insert(t->btree, leaf, bt_rank(leaf->h.keys, key), key,
+                     node) != 0) {
+    node_free(t, node);
+    return NULL;
+  }
+  t->size++;
+  if (t->filter) filter_add(t, key);
+  return node;
+}
+
+static void bt_erase(rbtree *t, node_t *z) {
+  bt_leaf *leaf = (bt_leaf *)z->parent;
+  int pos = 0;
+  while (leaf->vals[pos] != z) pos++;
+  bt_leaf_remove(t->btree, leaf, pos);
+  t->size--;
+  if (t->filter) filter_remove(t, z->key);
+  node_free(t, z);
+  next_gen(t);
+}
+
+// 중위 순서로 x 다음(dir > 0) 또는 이전(dir < 0) 노드
+static node_t *bt_step(const node_t *x, int dir) {
+  bt_leaf *leaf = (bt_leaf *)x->parent;
+  int pos = 0;
+  while (leaf->vals[pos] != x) pos++;
+  pos += dir;
+  if (pos < 0) {
+    leaf = leaf->prev;
+    return leaf ? leaf->vals[leaf->h.n - 1] : NULL;
+  }
+  if (pos >= leaf->h.n) {
+    leaf = leaf->next;
+    return leaf ? leaf->vals[0] : NULL;
+  }
+  return leaf->vals[pos];
+}
+
+static size_t bt_to_array(const rbtree *t, key_t *arr, const size_t n) {
+  size_t idx = 0;
+  for (bt_leaf *leaf = t->btree->first; leaf && idx < n; leaf = leaf->next) {
+    if (!(t->flags & RBTREE_COUNTED)) {
+      size_t m = (size_t)leaf->h.n < n - idx ? (size_t)leaf->h.n : n - idx;
+      memcpy(&arr[idx], leaf->h.keys, m * sizeof(key_t));
+      idx += m;
+      continue;
+    }
+    for (int i = 0; i < leaf->h.n && idx < n; i++) {
+      for (size_t c = 0; c < NODE_COUNT(leaf->vals[i]) && idx < n; c++) {
+        arr[idx++] = leaf->h.keys[i];
+      }
+    }
+  }
+  return idx;
+}
+
+/*
+동시성 트리 (RBTREE_CONCURRENT)
+
+여러 스레드가 외부 락 없이 같은 트리에 insert/erase/find를 호출할 수 있는 모드. chromatic tree를 따른다.
+- key는 leaf에만 있고(leaf-oriented) 내부 노드는 길 안내용 key만 가진다. (key < 안내 key면 왼쪽)
+- 색 대신 weight(0 = 빨강, 1 = 검정, 2 이상 = 과체중)를 쓰고, 루트에서 모든 leaf까지의 weight 합이
+  같다는 것만 항상 지킨다. 빨강-빨강과 과체중은 잠시 허용하는 위반이고, 위반을 만든 스레드가
+  자기 key로 가는 경로를 다시 내려가며 작은 재균형 단계(BLK, RB1, RB2, PUSH, W)로 하나씩 고친다.
+- 노드의 key와 weight는 만든 뒤 바뀌지 않는다. 갱신이나 재균형 단계는 바뀔 노드들을 새로 만들어
+  부모의 자식 포인터 하나만 바꿔 끼우므로, 탐색은 락 없이 내려가도 항상 온전한 트리를 본다.
+- 갱신은 부모와 바뀔 노드들의 lock을 위에서부터 trylock으로 잡는다. 하나라도 실패하거나 이미 빠진(marked)
+  노드를 만나면 모두 풀고 처음부터 다시 하므로 교착이 없다.
+- 빠진 노드는 epoch 기반 회수(EBR)로, 그 노드를 보고 있을 수 있는 스레드가 모두 빠져나간 뒤 해제한다.
+같은 key는 leaf 하나의 count로 모은다. (RBTREE_COUNTED와 같은 의미)
+돌려주는 노드는 그 순간의 사본이라 다른 스레드가 같은 key를 바꾸면 해제될 수 있다.
+그래서 돌려받은 노드는 rbtree_read_lock ~ rbtree_read_unlock 사이에서 얻고 읽어야 하며, 그 밖으로 가지고 나가지 않는다.
+(read_lock은 EBR 구간에 들어가 있는 것이라 그동안 빠진 노드는 해제되지 않는다. 구간이 길면 회수가 밀리므로 짧게 쓴다)
+to_array/next/prev는 락 없이 훑으므로 동시에 바뀌는 중이면 한 시점의 스냅샷은 아니다.
+*/
+
+#define CN_PATH_MAX 256  // 재균형 때 기록하는 경로 길이 (균형이 잡히면 높이는 2 log n 이내)
+#define EBR_SLOTS 256    // 동시에 트리를 쓰는 스레드 수 상한
+#define EBR_BATCH 64     // 이만큼 회수 대기 노드가 쌓일 때마다 epoch 전진을 시도
+
+typedef struct cnode {
+  rbtree_counted_node n;  // 호출한 쪽에 돌려주는 부분 (leaf의 key, count). 맨 앞에 있어야 한다
+  _Atomic(struct cnode *) child[2];  // 0: 왼쪽, 1: 오른쪽 (leaf는 NULL)
+  int weight;
+  unsigned char leaf;
+  unsigned char inf;   // 어떤 key보다도 큰 sentinel key
+  struct cnode *retired_next;  // EBR 회수 대기 목록
+  // 바뀌지 않는 위 필드와 같은 word에 두지 않는다. (합쳐 읽는 load가 lock과 겹치지 않게)
+  atomic_bool marked;  // 트리에서 빠짐 (lock을 잡은 채로만 설정)
+  atomic_flag lock;
+} cnode;
+
+struct rbtree_conc {
+  cnode *entry;  // 안내 key가 inf인 맨 위 노드. 왼쪽이 실제 트리, 오른쪽은 inf leaf
+  atomic_size_t size;          // 서로 다른 key 수
+  atomic_ulong rotations;
+};
+
+// 스레드별 EBR 상태. 빠진 노드는 빠질 때의 epoch별로 3개 목록에 모아두고
+// 전역 epoch가 2 이상 앞서면 해제한다. (그 사이에 모든 스레드가 한 번씩 빠져나갔다는 뜻)
+typedef struct {
+  atomic_ulong state;  // 0이면 트리 밖, 아니면 (들어올 때 본 epoch << 1) | 1
+  atomic_int used;
+  cnode *limbo[3];
+  unsigned long limbo_epoch[3];
+  unsigned retired;
+  unsigned depth;      // 겹쳐 들어온 횟수 (rbtree_read_lock 안에서 다시 enter할 수 있다)
+} ebr_slot;
+
+static atomic_ulong ebr_epoch = 1;
+static ebr_slot ebr_slots[EBR_SLOTS];
+static atomic_int ebr_nslots;  // 한 번이라도 쓰인 slot 수
+static _Thread_local ebr_slot *ebr_self;
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+// 스레드가 끝나면 slot을 돌려준다. 회수 대기 목록은 다음 주인이 이어받아 해제한다.
+static void ebr_release_slot(void *arg) {
+  ebr_slot *s = arg;
+  s->depth = 0;
+  atomic_store(&s->state, 0);
+  atomic_store(&s->used, 0);
+}
+
+static void ebr_key_init(void) {
+  pthread_key_create(&ebr_key, ebr_release_slot);
+}
+
+static ebr_slot *ebr_register(void) {
+  pthread_once(&ebr_once, ebr_key_init);
+  for (;;) {
+    for (int i = 0; i < EBR_SLOTS; i++) {
+      int expected = 0;
+      if (atomic_compare_exchange_strong(&ebr_slots[i].used, &expected, 1)) {
+        int n = atomic_load(&ebr_nslots);
+        while (n < i + 1 &&
+               !atomic_compare_exchange_weak(&ebr_nslots, &n, i + 1)) {
+        }
+        pthread_setspecific(ebr_key, &ebr_slots[i]);
+        return ebr_self = &ebr_slots[i];
+      }
+    }
+    sched_yield(); // slot이 모두 쓰이는 중이면 누가 끝날 때까지 기다린다.
+  }
+}
+
+static void ebr_free_list(ebr_slot *s, int b) {
+  while (s->limbo[b]) {
+    cnode *x = s->limbo[b];
+    s->limbo[b] = x->retired_next;
+    free(x);
+  }
+}
+
+// 트리 안에 있는 모든 스레드가 현재 epoch를 보고 들어왔으면 epoch를 하나 올린다.
+static void ebr_advance(void) {
+  unsigned long e = atomic_load(&ebr_epoch);
+  const int n = atomic_load(&ebr_nslots);
+  for (int i = 0; i < n; i++) {
+    unsigned long st = atomic_load(&ebr_slots[i].state);
+    if ((st & 1) && (st >> 1) != e) return;
+  }
+  atomic_compare_exchange_strong(&ebr_epoch, &e, e + 1);
+}
+
+// 이미 구간 안이면 처음 들어올 때의 epoch를 유지해야 그때 본 노드들이 계속 보호된다.
+static ebr_slot *ebr_enter(void) {
+  ebr_slot *s = ebr_self ? ebr_self : ebr_register();
+  if (s->depth++ > 0) return s;
+  const unsigned long e = atomic_load(&ebr_epoch);
+  atomic_store(&s->state, e << 1 | 1);
+  atomic_thread_fence(memory_order_seq_cst); // 이후의 노드 읽기가 공표보다 앞서지 않도록
+  for (int b = 0; b < 3; b++) {
+    if (s->limbo[b] && s->limbo_epoch[b] + 2 <= e) ebr_free_list(s, b);
+  }
+  return s;
+}
+
+static void ebr_exit(ebr_slot *s) {
+  if (--s->depth > 0) return;
+  atomic_store_explicit(&s->state, 0, memory_order_release);
+}
+
+// 이미 트리에서 떼어낸 노드를 회수 대기 목록에 넣는다.
+static void ebr_retire(ebr_slot *s, cnode *x) {
+  const unsigned long e = atomic_load(&ebr_epoch);
+  const int b = e % 3;
+  // 같은 칸의 예전 목록은 3 epoch 이상 지난 것이므로 바로 해제해도 된다.
+  if (s->limbo[b] && s->limbo_epoch[b] != e) ebr_free_list(s, b);
+  s->limbo_epoch[b] = e;
+  x->retired_next = s->limbo[b];
+  s->limbo[b] = x;
+  if (++s->retired % EBR_BATCH == 0) ebr_advance();
+}
+
+static inline cnode *cn_child(const cnode *x, int d) {
+  return atomic_load_explicit(&x->child[d], memory_order_acquire);
+}
+
+// key가 x에서 내려갈 방향 (0: 왼쪽, 1: 오른쪽)
+static inline int cn_dir(const cnode *x, const key_t key) {
+  return !(x->inf || key < x->n.node.key);
+}
+
+// 갱신 한 번에 잡은 lock과 새로 만든 노드. held[0]은 자식 포인터가 바뀌는 부모이고
+// held[1..]은 새 노드로 바뀌어 트리에서 빠질 노드들이다. (held[1]이 바뀌는 서브트리의 맨 위)
+typedef struct {
+  struct rbtree_conc *c;
+  cnode *held[6];
+  int nheld;
+  cnode *made[4];
+  int nmade;
+  int oom;
+} cn_op;
+
+// x의 lock을 잡는다. 못 잡았거나 x가 이미 트리에서 빠졌으면 0
+static int cn_lock(cn_op *op, cnode *x) {
+  if (atomic_flag_test_and_set_explicit(&x->lock, memory_order_acquire)) return 0;
+  op->held[op->nheld++] = x;
+  return !atomic_load_explicit(&x->marked, memory_order_relaxed);
+}
+
+static void cn_unlock_all(cn_op *op) {
+  while (op->nheld > 0) {
+    atomic_flag_clear_explicit(&op->held[--op->nheld]->lock, memory_order_release);
+  }
+}
+
+// 실패: 만든 노드는 아직 아무도 못 봤으므로 바로 해제하고 lock을 푼다.
+static int cn_abort(cn_op *op, int ret) {
+  while (op->nmade > 0) free(op->made[--op->nmade]);
+  cn_unlock_all(op);
+  return ret;
+}
+
+// like의 key(와 leaf면 count)를 가진 새 노드. 내부 노드면 자식은 child[d] = a, child[!d] = b
+static cnode *cn_make(cn_op *op, const cnode *like, int weight, int d,
+  cnode *a, cnode *b) {
+  cnode *x = calloc(1, sizeof(*x));
+  if (!x) {
+    op->oom = 1;
+    return NULL;
+  }
+  x->n.node.key = like->n.node.key;
+  x->n.count = like->n.count;
+  x->n.node.color = RBTREE_BLACK;
+  x->weight = weight;
+  x->leaf = like->leaf;
+  x->inf = like->inf;
+  atomic_flag_clear(&x->lock);
+  if (!x->leaf) {
+    atomic_init(&x->child[d], a);
+    atomic_init(&x->child[!d], b);
+  }
+  op->made[op->nmade++] = x;
+  return x;
+}
+
+// 자식과 key는 그대로 두고 weight만 바꾼 사본
+static cnode *cn_copy(cn_op *op, const cnode *x, int weight) {
+  return cn_make(op, x, weight, 0, x->leaf ? NULL : cn_child(x, 0),
+                 x->leaf ? NULL : cn_child(x, 1));
+}
+
+// 바뀌는 서브트리의 새 맨 위 노드 weight. 실제 트리의 루트(entry 바로 아래)는 모든 경로에
+// 똑같이 들어가므로 항상 1로 둔다. (그래서 루트에서는 빨강-빨강도 과체중도 생기지 않는다)
+static int cn_top(const cn_op *op, int weight) {
+  return op->held[0] == op->c->entry ? 1 : weight;
+}
+
+// held[1]을 nw로 바꿔 끼우고 held[1..]을 트리에서 뺀다. 1, 메모리가 모자라면 -1
+static int cn_commit(cn_op *op, cnode *nw) {
+  if (op->oom) return cn_abort(op, -1);
+  cnode *par = op->held[0];
+  const int d = cn_child(par, 0) != op->held[1];
+  atomic_store_explicit(&par->child[d], nw, memory_order_release);
+  for (int i = 1; i < op->nheld; i++) {
+    atomic_store_explicit(&op->held[i]->marked, 1, memory_order_relaxed);
+  }
+  for (int i = 1; i < op->nheld; i++) ebr_retire(ebr_self, op->held[i]);
+  op->nmade = 0;
+  cn_unlock_all(op);
+  return 1;
+}
+
+// par가 x를 자식으로 가지면 그 방향, 아니면 -1
+static int cn_side(const cnode *par, const cnode *x) {
+  if (cn_child(par, 0) == x) return 0;
+  if (cn_child(par, 1) == x) return 1;
+  return -1;
+}
+
+// 빨강-빨강: x와 부모 p가 빨강, g는 p의 부모, par는 g의 부모
+// 1이면 한 단계 진행, 0이면 구조가 바뀌었거나 lock 경합이므로 다시 탐색, -1은 메모리 부족
+static int cn_fix_red(struct rbtree_conc *c, cnode *par, cnode *g, cnode *p,
+  cnode *x) {
+  cn_op op = {.c = c};
+  if (!cn_lock(&op, par) || cn_side(par, g) < 0) return cn_abort(&op, 0);
+  if (!cn_lock(&op, g) || g->weight == 0) return cn_abort(&op, 0);
+  const int dp = cn_side(g, p);
+  if (dp < 0 || !cn_lock(&op, p) || p->weight != 0) return cn_abort(&op, 0);
+  const int dx = cn_side(p, x);
+  if (dx < 0 || x->weight != 0) return cn_abort(&op, 0);
+  cnode *s = cn_child(g, !dp);
+
+  if (s->weight == 0) {
+    // BLK: p의 형제 s도 빨강이면 둘을 검게 하고 g에서 weight를 하나 뺀다.
+    if (!cn_lock(&op, s)) return cn_abort(&op, 0);
+    cnode *p2 = cn_copy(&op, p, 1);
+    cnode *s2 = cn_copy(&op, s, 1);
+    return cn_commit(&op, cn_make(&op, g, cn_top(&op, g->weight - 1), dp, p2, s2));
+  }
+  atomic_fetch_add_explicit(&c->rotations, dx == dp ? 1 : 2, memory_order_relaxed);
+  if (dx == dp) {
+    // RB1: x가 바깥쪽 손자이면 g에서 한 번 회전
+    cnode *g2 = cn_make(&op, g, 0, dp, cn_child(p, !dp), s);
+    return cn_commit(&op, cn_make(&op, p, cn_top(&op, g->weight), dp, x, g2));
+  }
+  // RB2: x가 안쪽 손자이면 두 번 회전해서 x가 맨 위로
+  if (!cn_lock(&op, x)) return cn_abort(&op, 0);
+  cnode *p2 = cn_make(&op, p, 0, dp, cn_child(p, dp), cn_child(x, dp));
+  cnode *g2 = cn_make(&op, g, 0, dp, cn_child(x, !dp), s);
+  return cn_commit(&op, cn_make(&op, x, cn_top(&op, g->weight), dp, p2, g2));
+}
+
+// 과체중: path[v]의 weight가 2 이상 (v >= 2, 반환값은 cn_fix_red와 같음)
+static int cn_fix_heavy(struct rbtree_conc *c, cnode **path, int v) {
+  cnode *x = path[v], *p = path[v - 1], *par = path[v - 2];
+  cn_op op = {.c = c};
+  if (!cn_lock(&op, par) || cn_side(par, p) < 0) return cn_abort(&op, 0);
+  if (!cn_lock(&op, p)) return cn_abort(&op, 0);
+  const int d = cn_side(p, x);
+  if (d < 0) return cn_abort(&op, 0);
+  cnode *s = cn_child(p, !d);
+  if (!cn_lock(&op, s)) return cn_abort(&op, 0);
+
+  if (s->weight == 0) {
+    // 형제가 빨강이면 회전해서 검은 형제를 만든다. 근처에 빨강-빨강이 있으면 그것부터 고친다.
+    cnode *near = cn_child(s, d), *far = cn_child(s, !d);
+    if (p->weight == 0) {
+      cn_abort(&op, 0);
+      return cn_fix_red(c, path[v - 3], par, p, s);
+    }
+    if (near->weight == 0 || far->weight == 0) {
+      cn_abort(&op, 0);
+      return cn_fix_red(c, par, p, s, near->weight == 0 ? near : far);
+    }
+    atomic_fetch_add_explicit(&c->rotations, 1, memory_order_relaxed);
+    cnode *p2 = cn_make(&op, p, 0, d, x, near);
+    return cn_commit(&op, cn_make(&op, s, cn_top(&op, p->weight), d, p2, far));
+  }
+
+  if (!cn_lock(&op, x)) return cn_abort(&op, 0);
+  // x가 과체중이면 s 쪽 경로 합도 2 이상이어야 하므로 leaf인 s는 weight가 2 이상
+  assert(!s->leaf || s->weight >= 2);
+  if (!s->leaf && s->weight == 1) {
+    cnode *near = cn_child(s, d), *far = cn_child(s, !d);
+    if (far->weight == 0) {
+      // W(바깥): 검은 형제의 바깥쪽 자식이 빨강이면 p에서 한 번 회전
+      if (!cn_lock(&op, far)) return cn_abort(&op, 0);
+      atomic_fetch_add_explicit(&c->rotations, 1, memory_order_relaxed);
+      cnode *x2 = cn_copy(&op, x, x->weight - 1);
+      cnode *p2 = cn_make(&op, p, 1, d, x2, near);
+      cnode *far2 = cn_copy(&op, far, 1);
+      return cn_commit(&op, cn_make(&op, s, cn_top(&op, p->weight), d, p2, far2));
+    }
+    if (near->weight == 0) {
+      // W(안쪽): 안쪽 자식이 빨강이면 두 번 회전해서 near가 맨 위로
+      if (!cn_lock(&op, near)) return cn_abort(&op, 0);
+      atomic_fetch_add_explicit(&c->rotations, 2, memory_order_relaxed);
+      cnode *x2 = cn_copy(&op, x, x->weight - 1);
+      cnode *p2 = cn_make(&op, p, 1, d, x2, cn_child(near, d));
+      cnode *s2 = cn_make(&op, s, 1, d, cn_child(near, !d), far);
+      return cn_commit(&op, cn_make(&op, near, cn_top(&op, p->weight), d, p2, s2));
+    }
+  }
+  // PUSH: x와 s에서 weight를 하나씩 빼서 p에 올린다. (과체중이 위로 올라감)
+  cnode *x2 = cn_copy(&op, x, x->weight - 1);
+  cnode *s2 = cn_copy(&op, s, s->weight - 1);
+  return cn_commit(&op, cn_make(&op, p, cn_top(&op, p->weight + 1), d, x2, s2));
+}
+
+// key로 가는 경로에 위반이 없어질 때까지 맨 위의 위반부터 하나씩 고친다.
+// 위반은 그것을 만든 갱신의 key 경로 위에 생기고, 고쳐도 그 경로를 따라 위로만 옮겨가므로
+// 갱신마다 자기 key 경로만 정리하면 모든 갱신이 끝났을 때 트리는 레드-블랙 트리가 된다.
+static void cn_fix(struct rbtree_conc *c, const key_t key) {
+  cnode *path[CN_PATH_MAX];
+  for (;;) {
+    int depth = 0, v = -1;
+    cnode *x = c->entry;
+    path[0] = x;
+    while (!x->leaf && depth + 1 < CN_PATH_MAX) {
+      x = cn_child(x, cn_dir(x, key));
+      path[++depth] = x;
+      if (x->weight > 1 || (x->weight == 0 && path[depth - 1]->weight == 0)) {
+        v = depth;
+        break;
+      }
+    }
+    if (v < 0) return;
+
+    // 실제 트리의 루트는 weight가 1이므로 빨강-빨강은 v >= 3, 과체중은 v >= 2에서만 생긴다.
+    int r = path[v]->weight == 0
+              ? cn_fix_red(c, path[v - 3], path[v - 2], path[v - 1], path[v])
+              : cn_fix_heavy(c, path, v);
+    if (r < 0) return; // 메모리 부족: 균형만 덜 맞을 뿐 트리는 올바르다.
+    if (r == 0) sched_yield();
+  }
+}
+
+static int conc_init(rbtree *t) {
+  struct rbtree_conc *c = calloc(1, sizeof(*c));
+  cnode *entry = calloc(1, sizeof(*entry));
+  cnode *lo = calloc(1, sizeof(*lo)), *hi = calloc(1, sizeof(*hi));
+  if (!c || !entry || !lo || !hi) {
+    free(c);
+    free(entry);
+    free(lo);
+    free(hi);
+    return -1;
+  }
+  lo->leaf = hi->leaf = 1;
+  entry->inf = lo->inf = hi->inf = 1;
+  entry->weight = lo->weight = hi->weight = 1;
+  atomic_flag_clear(&entry->lock);
+  atomic_flag_clear(&lo->lock);
+  atomic_flag_clear(&hi->lock);
+  atomic_init(&entry->child[0], lo);
+  atomic_init(&entry->child[1], hi);
+  c->entry = entry;
+  t->conc = c;
+  return 0;
+}
+
+static void cn_free_subtree(cnode *x) {
+  if (!x->leaf) {
+    cn_free_subtree(cn_child(x, 0));
+    cn_free_subtree(cn_child(x, 1));
+  }
+  free(x);
+}
+
+// 다른 스레드가 더 이상 쓰지 않을 때 호출. 회수 대기 중인 노드는 EBR이 따로 해제한다.
+static void conc_destroy(rbtree *t) {
+  cn_free_subtree(t->conc->entry);
+  free(t->conc);
+  t->conc = NULL;
+}
+
+static node_t *cn_find(const rbtree *t, const key_t key) {
+  ebr_slot *s = ebr_enter();
+  cnode *x = cn_child(t->conc->entry, 0);
+  while (!x->leaf) x = cn_child(x, cn_dir(x, key));
+  node_t *found = (!x->inf && x->n.node.key == key) ? &x->n.node : NULL;
+  ebr_exit(s);
+  return found;
+}
+
+// key의 leaf를 넣거나 count를 올린 사본으로 바꾼다. unique면 기존 leaf를 그대로 돌려준다.
+static node_t *cn_insert(rbtree *t, const key_t key, int unique, int *existed) {
+  struct rbtree_conc *c = t->conc;
+  ebr_slot *s = ebr_enter();
+  node_t *res = NULL;
+  int r = 0, dup = 0, red = 0;
+  while (r == 0) {
+    cnode *p = c->entry, *l = cn_child(p, 0);
+    while (!l->leaf) {
+      p = l;
+      l = cn_child(l, cn_dir(l, key));
+    }
+    dup = !l->inf && l->n.node.key == key;
+    if (dup && unique) {
+      res = &l->n.node;
+      break;
+    }
+
+    cn_op op = {.c = c};
+    if (!cn_lock(&op, p) || cn_child(p, cn_dir(p, key)) != l ||
+        !cn_lock(&op, l)) {
+      r = cn_abort(&op, 0);
+      sched_yield();
+      continue;
+    }
+    cnode *nw, *leaf;
+    if (dup) {
+      nw = leaf = cn_copy(&op, l, l->weight);
+      if (leaf) leaf->n.count++;
+    } else {
+      // l 자리에 내부 노드를 두고 l의 사본과 새 leaf를 자식으로 단다. (안내 key는 둘 중 큰 쪽)
+      const int right = !(l->inf || key < l->n.node.key);
+      const cnode fresh = {.n = {.node = {.key = key}, .count = 1}, .leaf = 1};
+      const cnode router = {.n = {.node = {.key = right ? key : l->n.node.key}},
+                            .inf = !right && l->inf};
+      leaf = cn_make(&op, &fresh, 1, 0, NULL, NULL);
+      cnode *old = cn_copy(&op, l, 1);
+      nw = cn_make(&op, &router, cn_top(&op, l->weight - 1), right, leaf, old);
+      red = nw && nw->weight == 0 && p->weight == 0;
+    }
+    r = cn_commit(&op, nw);
+    if (r > 0) res = &leaf->n.node;
+  }
+  if (r > 0 && !dup) {
+    atomic_fetch_add_explicit(&c->size, 1, memory_order_relaxed);
+    if (red) cn_fix(c, key);
+  }
+  ebr_exit(s);
+  if (existed) *existed = dup;
+  return res;
+}
+
+// key 하나를 지운다. count가 2 이상이면 count를 줄인 사본으로 바꾸고,
+// 아니면 leaf와 부모를 빼고 형제를 부모 자리로 올린다. (형제 weight에 부모 weight를 더함)
+static int cn_erase(rbtree *t, const key_t key) {
+  struct rbtree_conc *c = t->conc;
+  ebr_slot *s = ebr_enter();
+  int r = 0, heavy = 0, removed = 0;
+  while (r == 0) {
+    cnode *gp = NULL, *p = c->entry, *l = cn_child(p, 0);
+    while (!l->leaf) {
+      gp = p;
+      p = l;
+      l = cn_child(l, cn_dir(l, key));
+    }
+    if (l->inf || l->n.node.key != key) break;
+
+    cn_op op = {.c = c};
+    if (l->n.count > 1) {
+      if (!cn_lock(&op, p) || cn_child(p, cn_dir(p, key)) != l ||
+          !cn_lock(&op, l)) {
+        r = cn_abort(&op, 0);
+        sched_yield();
+        continue;
+      }
+      cnode *nw = cn_copy(&op, l, l->weight);
+      if (nw) nw->n.count--;
+      r = cn_commit(&op, nw);
+      continue;
+    }
+
+    // 실제 key의 leaf는 inf leaf 왼쪽에 있으므로 p는 내부 노드이고 gp도 있다.
+    const int d = cn_dir(p, key);
+    if (!cn_lock(&op, gp) || cn_child(gp, cn_dir(gp, key)) != p ||
+        !cn_lock(&op, p) || cn_child(p, d) != l || !cn_lock(&op, l)) {
+      r = cn_abort(&op, 0);
+      sched_yield();
+      continue;
+    }
+    cnode *sib = cn_child(p, !d);
+    if (!cn_lock(&op, sib)) {
+      r = cn_abort(&op, 0);
+      sched_yield();
+      continue;
+    }
+    cnode *nw = cn_copy(&op, sib, cn_top(&op, p->weight + sib->weight));
+    heavy = nw && (nw->weight > 1 || (nw->weight == 0 && gp->weight == 0));
+    r = cn_commit(&op, nw);
+    removed = r > 0;
+  }
+  if (removed) {
+    atomic_fetch_sub_explicit(&c->size, 1, memory_order_relaxed);
+    if (heavy) cn_fix(c, key);
+  }
+  ebr_exit(s);
+  return r > 0;
+}
+
+// key보다 큰 것 중 가장 작은 key의 leaf (없으면 NULL)
+static node_t *cn_next(const rbtree *t, const key_t key) {
+  ebr_slot *s = ebr_enter();
+  cnode *x = cn_child(t->conc->entry, 0), *cand = NULL;
+  while (!x->leaf) {
+    // key < 안내 key면 오른쪽 서브트리 전체가 key보다 크므로 후보로 두고 왼쪽으로
+    if (!cn_dir(x, key)) cand = x;
+    x = cn_child(x, cn_dir(x, key));
+  }
+  if ((x->inf || x->n.node.key <= key) && cand) {
+    x = cn_child(cand, 1);
+    while (!x->leaf) x = cn_child(x, 0);
+  }
+  node_t *res = (!x->inf && x->n.node.key > key) ? &x->n.node : NULL;
+  ebr_exit(s);
+  return res;
+}
+
+// key보다 작은 것 중 가장 큰 key의 leaf. top이면 key 대신 무한대 기준 (rbtree_max)
+static node_t *cn_prev(const rbtree *t, const key_t key, int top) {
+  ebr_slot *s = ebr_enter();
+  cnode *x = cn_child(t->conc->entry, 0), *cand = NULL;
+  while (!x->leaf) {
+    // 안내 key < key면 왼쪽 서브트리 전체가 key보다 작으므로 후보로 두고 오른쪽으로
+    const int right = !x->inf && (top || x->n.node.key < key);
+    if (right) cand = x;
+    x = cn_child(x, right);
+  }
+  if ((x->inf || (!top && x->n.node.key >= key)) && cand) {
+    x = cn_child(cand, 0);
+    while (!x->leaf) x = cn_child(x, 1);
+  }
+  node_t *res = (!x->inf && (top || x->n.node.key < key)) ? &x->n.node : NULL;
+  ebr_exit(s);
+  return res;
+}
+
+static node_t *cn_min(const rbtree *t) {
+  ebr_slot *s = ebr_enter();
+  cnode *x = cn_child(t->conc->entry, 0);
+  while (!x->leaf) x = cn_child(x, 0);
+  node_t *res = x->inf ? NULL : &x->n.node;
+  ebr_exit(s);
+  return res;
+}
+
+// RBTREE_CONCURRENT 트리에서 돌려받은 노드를 읽는 동안 해제되지 않게 한다. (겹쳐 불러도 된다)
+// 다른 트리는 읽기와 쓰기를 호출한 쪽이 직렬화하므로 아무 일도 하지 않는다.
+void rbtree_read_lock(const rbtree *t) {
+  if (t && t->conc) ebr_enter();
+}
+
+void rbtree_read_unlock(const rbtree *t) {
+  if (t && t->conc) ebr_exit(ebr_self);
+}
+
+static void cn_inorder(const cnode *x, key_t *arr, const size_t n, size_t *idx) {
+  if (*idx >= n) return;
+  if (!x->leaf) {
+    cn_inorder(cn_child(x, 0), arr, n, idx);
+    cn_inorder(cn_child(x, 1), arr, n, idx);
+    return;
+  }
+  for (size_t c = 0; !x->inf && c < x->n.count && *idx < n; c++) {
+    arr[(*idx)++] = x->n.node.key;
+  }
+}
+
+static size_t cn_to_array(const rbtree *t, key_t *arr, const size_t n) {
+  ebr_slot *s = ebr_enter();
+  size_t idx = 0;
+  cn_inorder(cn_child(t->conc->entry, 0), arr, n, &idx);
+  ebr_exit(s);
+  return idx;
+}
+
+// 실제 트리 루트에서 가장 깊은 leaf까지의 노드 수
+static size_t cn_height(const cnode *x) {
+  if (x->leaf) return 1;
+  size_t l = cn_height(cn_child(x, 0)), r = cn_height(cn_child(x, 1));
+  return 1 + (l > r ? l : r);
+}
+
+/*
+부정 탐색 필터 (RBTREE_FILTER)
+
+rbtree_find가 트리를 내려가기 전에 보는 blocked counting Bloom filter.
+key 하나는 64바이트 블록(캐시 라인) 하나 안의 4비트 카운터 FILTER_K개로 표현하므로
+"확실히 없음" 판정은 캐시 라인 하나만 읽고 끝난다.
+카운터라서 erase 때 줄일 수 있고, 15에 도달한 카운터는 정확한 값을 모르므로 더 이상 줄이지 않는다.
+노드 수가 capacity를 넘으면 두 배 크기로 트리를 다시 훑어 새로 만든다.
+*/
+
+#define FILTER_K 4                 // key 하나가 올리는 카운터 수
+#define FILTER_COUNTERS_PER_KEY 12 // 크기 계산용 key당 카운터 수 (FPR 약 1% 미만)
+#define FILTER_MIN_CAPACITY 1024
+
+typedef struct {
+  uint64_t w[8];  // 4비트 카운터 128개
+} filter_block_t;
+
+struct rbtree_filter {
+  filter_block_t *blocks;
+  size_t nblocks;
+  size_t capacity;            // 이 노드 수를 넘으면 크기를 두 배로 다시 만든다
+  atomic_size_t negatives;    // filter가 바로 없다고 답한 탐색 수
+  atomic_size_t false_pos;    // filter는 통과했지만 트리에 없던 탐색 수
+};
+
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// key가 쓰는 블록과 블록 안의 카운터 번호들
+static filter_block_t *filter_slots(const struct rbtree_filter *f,
+  const key_t key, unsigned idx[FILTER_K]) {
+  uint64_t h = mix64((uint64_t)(uint32_t)key);
+  for (int i = 0; i < FILTER_K; i++) {
+    idx[i] = (h >> (7 * i)) & 127;
+  }
+  size_t b = (size_t)(((unsigned __int128)(h >> 28) * f->nblocks) >> 36);
+  return &f->blocks[b];
+}
+
+static unsigned counter_get(const filter_block_t *b, unsigned i) {
+  return (b->w[i >> 4] >> ((i & 15) * 4)) & 15;
+}
+
+static void counter_add(filter_block_t *b, unsigned i, int delta) {
+  unsigned c = counter_get(b, i);
+  if (c == 15 || (delta < 0 && c == 0)) return; // 포화된 카운터는 고정
+  uint64_t unit = (uint64_t)1 << ((i & 15) * 4);
+  b->w[i >> 4] = delta > 0 ? b->w[i >> 4] + unit : b->w[i >> 4] - unit;
+}
+
+static void filter_put(struct rbtree_filter *f, const key_t key) {
+  unsigned idx[FILTER_K];
+  filter_block_t *b = filter_slots(f, key, idx);
+  for (int i = 0; i < FILTER_K; i++) counter_add(b, idx[i], 1);
+}
+
+static void filter_fill(rbtree *t, node_t *x) {
+  while (x != t->nil) {
+    filter_fill(t, x->left);
+    filter_put(t->filter, x->key);
+    x = x->right;
+  }
+}
+
+// capacity개의 노드를 담을 크기로 filter를 (다시) 만들고 현재 노드들을 채운다.
+static int filter_init(rbtree *t, size_t capacity) {
+  if (capacity < FILTER_MIN_CAPACITY) capacity = FILTER_MIN_CAPACITY;
+  size_t nblocks = (capacity * FILTER_COUNTERS_PER_KEY + 127) / 128;
+  filter_block_t *blocks = aligned_alloc(64, nblocks * sizeof(filter_block_t));
+  if (!blocks) return -1;
+  memset(blocks, 0, nblocks * sizeof(filter_block_t));
+
+  if (!t->filter) {
+    t->filter = calloc(1, sizeof(*t->filter));
+    if (!t->filter) {
+      free(blocks);
+      return -1;
+    }
+  }
+  free(t->filter->blocks);
+  t->filter->blocks = blocks;
+  t->filter->nblocks = nblocks;
+  t->filter->capacity = capacity;
+  if (t->btree) {
+    for (bt_leaf *leaf = t->btree->first; leaf; leaf = leaf->next) {
+      for (int i = 0; i < leaf->h.n; i++) filter_put(t->filter, leaf->h.keys[i]);
+    }
+  } else {
+    filter_fill(t, t->root);
+  }
+  return 0;
+}
+
+static void filter_destroy(rbtree *t) {
+  free(t->filter->blocks);
+  free(t->filter);
+  t->filter = NULL;
+}
+
+// 노드가 새로 생길 때 호출 (노드 수는 이미 반영된 상태)
+static void filter_add(rbtree *t, const key_t key) {
+  struct rbtree_filter *f = t->filter;
+  if (t->size > f->capacity) {
+    // 트리가 커졌으면 두 배 크기로 다시 만든다. 실패하면 기존 filter에 그냥 추가 (FPR만 나빠짐)
+    if (filter_init(t, f->capacity * 2) == 0) return;
+  }
+  filter_put(f, key);
+}
+
+// 노드가 트리에서 빠질 때 호출
+static void filter_remove(rbtree *t, const key_t key) {
+  unsigned idx[FILTER_K];
+  filter_block_t *b = filter_slots(t->filter, key, idx);
+  for (int i = 0; i < FILTER_K; i++) counter_add(b, idx[i], -1);
+}
+
+// 0이면 key는 트리에 확실히 없다.
+static int filter_maybe(const rbtree *t, const key_t key) {
+  unsigned idx[FILTER_K];
+  const filter_block_t *b = filter_slots(t->filter, key, idx);
+  for (int i = 0; i < FILTER_K; i++) {
+    if (counter_get(b, idx[i]) == 0) {
+      atomic_fetch_add_explicit(&t->filter->negatives, 1, memory_order_relaxed);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// 루트에서 가장 깊은 노드까지의 노드 수
+static size_t subtree_height(const rbtree *t, const node_t *x) {
+  if (x == t->nil) return 0;
+  size_t l = subtree_height(t, x->left), r = subtree_height(t, x->right);
+  return 1 + (l > r ? l : r);
+}
+
+// 트리 상태와 filter 통계를 st에 채운다. (height는 트리 전체를 훑는다)
+void rbtree_get_stats(const rbtree *t, rbtree_stats *st) {
+  if (!t || !st) return;
+  memset(st, 0, sizeof(*st));
+  st->nodes = t->size;
+  if (t->conc) {
+    st->nodes = atomic_load(&t->conc->size);
+    st->height = cn_height(cn_child(t->conc->entry, 0));
+    st->rotations = atomic_load(&t->conc->rotations);
+    return;
+  }
+  if (t->btree) {
+    st->height = t->size ? (size_t)t->btree->height + 1 : 0; // 덩어리 단계 수
+  } else {
+    st->height = small_inline(t) ? 0 : subtree_height(t, t->root);
+  }
+  st->rotations = t->rotations;
+  st->nodes = t->size - t->tombstones;
+  st->tombstones = t->tombstones;
+  st->buffered = wbuf_size(t);
+  st->nodes += st->buffered;
+  if (t->filter) {
+    st->filter_bytes = t->filter->nblocks * sizeof(filter_block_t);
+    st->filter_negatives = atomic_load(&t->filter->negatives);
+    st->filter_false_pos = atomic_load(&t->filter->false_pos);
+    size_t misses = st->filter_negatives + st->filter_false_pos;
+    st->filter_fpr = misses ? (double)st->filter_false_pos / misses : 0.0;
+  }
+}
+
+/*
+메모리 사용량 (rbtree_memory_usage, rbtree_shrink)
+
+테넌트별 메모리 예산을 잡을 수 있도록 트리가 쥐고 있는 바이트(reserved)와 실제로 쓰는 바이트(in_use)를 센다.
+트리 구조체, sentinel, 노드 저장소, filter, B-tree 덩어리를 포함하고 malloc 자체의 머리 공간은 세지 않는다.
+arena 노드 저장소는 chunk 크기로, 노드를 하나씩 할당하는 트리는 노드 수 × 노드 크기로 센다.
+persistent 트리는 현재 버전의 노드만 세고, 동시성 트리는 노드 수를 (leaf + 내부 노드 = key 수의 2배)로 어림한다.
+context 트리의 노드는 여러 트리가 나눠 쓰는 풀에 있으므로 살아있는 노드만 센다.
+rbtree_shrink는 살아있는 노드가 하나도 없는 chunk를 OS에 돌려준다.
+(노드가 chunk마다 조금씩 남아있으면 먼저 rbtree_compact로 모은다. 재배치가 끝나면 옛 chunk는 이미 해제되어 있다)
+*/
+
+static size_t chunk_bytes(const node_chunk *c) {
+  return c->mapped ? c->mapped : sizeof(*c) + c->cap * c->stride;
+}
+
+static int chunk_addr_cmp(const void *a, const void *b) {
+  const node_chunk *x = *(node_chunk *const *)a, *y = *(node_chunk *const *)b;
+  return (x > y) - (x < y);
+}
+
+// n이 든 chunk의 번호 (cs는 주소 순으로 정렬). 어느 chunk에도 없으면 nc
+static size_t chunk_index(node_chunk *const *cs, size_t nc, const node_t *n) {
+  size_t lo = 0, hi = nc;
+  while (hi - lo > 1) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if ((const void *)cs[mid] <= (const void *)n) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return (nc && chunk_owns(cs[lo], n)) ? lo : nc;
+}
+
+// chunk를 주소 순으로 *cs에, chunk별 빈 자리 수를 *free_slots에 담고 chunk 수를 반환
+// (할당 실패면 0이고 두 배열은 NULL. 호출한 쪽이 두 배열을 free)
+static size_t arena_scan(const struct rbtree_arena *a, node_chunk ***cs,
+  size_t **free_slots) {
+  size_t nc = 0;
+  for (node_chunk *c = a->chunks; c; c = c->next) nc++;
+  *cs = malloc((nc + 1) * sizeof(**cs));
+  *free_slots = malloc((nc + 1) * sizeof(**free_slots));
+  if (!*cs || !*free_slots) {
+    free(*cs);
+    free(*free_slots);
+    *cs = NULL;
+    *free_slots = NULL;
+    return 0;
+  }
+  size_t i = 0;
+  for (node_chunk *c = a->chunks; c; c = c->next) (*cs)[i++] = c;
+  qsort(*cs, nc, sizeof(**cs), chunk_addr_cmp);
+  for (i = 0; i < nc; i++) (*free_slots)[i] = (*cs)[i]->cap - (*cs)[i]->used;
+  for (const node_t *n = a->free_list; n; n = n->right) {
+    const size_t k = chunk_index(*cs, nc, n);
+    if (k < nc) (*free_slots)[k]++;
+  }
+  return nc;
+}
+
+static size_t bt_bytes(const bt_node *x, int height) {
+  if (height == 0) return (sizeof(bt_leaf) + 63) & ~(size_t)63;
+  size_t b = (sizeof(bt_inner) + 63) & ~(size_t)63;
+  for (int i = 0; i <= x->n; i++) {
+    b += bt_bytes(((const bt_inner *)x)->child[i], height - 1);
+  }
+  return b;
+}
+
+// 트리의 메모리 사용량을 m에 채운다. (arena의 free list와 B-tree 덩어리를 훑는다)
+void rbtree_memory_usage(const rbtree *t, rbtree_memory *m) {
+  memset(m, 0, sizeof(*m));
+  if (!t) return;
+  size_t fixed = sizeof(*t);
+  if (t->small) {
+    // sentinel과 노드 자리 포함
+    fixed += sizeof(struct rbtree_small) + SMALL_MAX * t->small->stride;
+  } else if (!t->ctx) {
+    fixed += sizeof(node_t); // sentinel
+  }
+  if (t->filter) {
+    fixed += sizeof(*t->filter) + t->filter->nblocks * sizeof(filter_block_t);
+  }
+  if (t->btree) {
+    fixed += sizeof(*t->btree) + bt_bytes(t->btree->root, t->btree->height);
+  }
+  if (t->wbuf) fixed += wbuf_bytes();
+
+  size_t live = t->size + wbuf_size(t); // 버퍼의 노드도 할당되어 있다.
+  size_t node_size = node_bytes(t);
+  if (t->conc) {
+    fixed += sizeof(*t->conc);
+    live = 2 * atomic_load(&t->conc->size) + 3; // entry와 sentinel leaf 포함
+    node_size = sizeof(cnode);
+  } else if (t->small) {
+    live -= __builtin_popcount(t->small->used); // 구조체 안의 자리에 든 노드
+  }
+  m->node_reserved = live * node_size;
+
+  if (t->arena) {
+    node_chunk **cs;
+    size_t *free_slots;
+    const size_t nc = arena_scan(t->arena, &cs, &free_slots);
+    if (cs) m->node_reserved = 0;
+    for (size_t i = 0; i < nc; i++) {
+      m->node_reserved += chunk_bytes(cs[i]);
+      if (cs[i]->huge) m->huge_bytes += chunk_bytes(cs[i]);
+      m->empty_chunks += free_slots[i] == cs[i]->cap;
+    }
+    m->chunks = nc;
+    free(cs);
+    free(free_slots);
+  }
+  // 재배치 중이면 옛 arena도 아직 잡고 있다.
+  if (compact_old(t)) {
+    for (node_chunk *c = compact_old(t)->chunks; c; c = c->next) {
+      m->node_reserved += chunk_bytes(c);
+      m->chunks++;
+    }
+  }
+
+  const size_t node_in_use = live * node_size;
+  m->in_use = fixed + node_in_use;
+  m->reserved = fixed + m->node_reserved;
+  m->fragmentation = m->node_reserved > node_in_use
+    ? 1.0 - (double)node_in_use / m->node_reserved : 0.0;
+}
+
+// 살아있는 노드가 없는 arena chunk를 해제하고 돌려준 바이트 수를 반환
+size_t rbtree_shrink(rbtree *t) {
+  if (!t || !t->arena || t->compact) return 0;
+  struct rbtree_arena *a = t->arena;
+  node_chunk **cs;
+  size_t *free_slots;
+  const size_t nc = arena_scan(a, &cs, &free_slots);
+  size_t empty = 0;
+  for (size_t i = 0; i < nc; i++) empty += free_slots[i] == cs[i]->cap;
+  if (empty == 0) {
+    free(cs);
+    free(free_slots);
+    return 0;
+  }
+
+  // 해제할 chunk에 든 빈 자리를 free list에서 뺀다.
+  node_t *keep = NULL;
+  for (node_t *n = a->free_list, *next; n; n = next) {
+    next = n->right;
+    const size_t k = chunk_index(cs, nc, n);
+    if (k < nc && free_slots[k] == cs[k]->cap) continue;
+    n->right = keep;
+    keep = n;
+  }
+  a->free_list = keep;
+
+  size_t released = 0;
+  node_chunk **link = &a->chunks;
+  while (*link) {
+    node_chunk *c = *link;
+    const size_t k = chunk_index(cs, nc, c->nodes);
+    if (free_slots[k] == c->cap) {
+      *link = c->next;
+      released += chunk_bytes(c);
+      chunk_release(c);
+    } else {
+      link = &c->next;
+    }
+  }
+  free(cs);
+  free(free_slots);
+  return released;
+}
+
+// 노드가 해제되거나 옮겨질 때마다 호출: 이전 세대의 finger를 모두 무효화
+static void next_gen(rbtree *t) {
+  t->gen = atomic_fetch_add_explicit(&gen_counter, 1, memory_order_relaxed);
+}
+
+// 트리 전체 해제
+void delete_rbtree(rbtree *t) {
+  if (!t) return;
+  rbtree_log_close(t); // 남은 로그 레코드를 디스크에 쓰고 뗀다. (오류를 알려면 먼저 직접 닫는다)
+  if (t->wbuf) wbuf_destroy(t); // 트리에 달리지 않은 노드
+  if (t->compact) {
+    // 옛 자리의 노드는 node_free가 compact_release로 보내므로 여기서 모두 떼어낸다.
+    free_subtree(t, t->root);
+    t->root = t->nil;
+    compact_finish(t);
+  }
+  if (t->btree) btree_destroy(t); // 덩어리와 그 안의 노드들 (arena 노드는 아래에서 한꺼번에)
+  if (t->conc) conc_destroy(t);
+  if (t->arena) {
+    arena_destroy(t); // arena 노드는 chunk 단위로 한꺼번에 해제
+  } else if (t->ctx) {
+    ctx_reclaim(t); // context 풀로 반납 (sentinel은 공유이므로 free하지 않음)
+    free(t);
+    return;
+  } else if (!(t->flags & RBTREE_INTRUSIVE)) { // intrusive 노드는 호출한 쪽 소유
+    free_subtree(t, t->root);
+  } else if (is_str(t)) { // 문자열 key 노드는 트리가 할당한 것
+    str_free_subtree(t, t->root);
+  }
+  if (t->pstate) pstate_destroy(t); // 예전 버전에만 남아있던 노드들까지 해제
+  if (t->filter) filter_destroy(t);
+  if (!t->small) free(t->nil); // sentinel은 마지막에 1번만 free (small 트리는 구조체에 포함)
+  free(t);
+}
+
+// 오른쪽에 nil이 아닌 자식 y가 있는 노드 x에 대한 좌회전 함수
+// y가 x의 부모로 올라가며 x는 y의 왼쪽 자식이 되고 
+// 기존에 있던 y의 왼쪽 자식은 x의 오른쪽 자식으로 붙는다.
+RB_INLINE void rotate_left(rbtree *t, node_t *x, const rbtree_augment_t *aug) {
+  // 전제: x에 nil이 아닌 오른쪽 자식 y가 존재해야 함
+  assert(x != t->nil);
+  assert(x->right != t->nil);
+
+  node_t *y = x->right;
+
+  // 최종 목표는 x를 y의 자식으로 옮기고 y를 x의 부모로 바꾸는 것이지만
+  // 실제로 포인터가 가리키는 대상을 바꾸기 전에 y의 기존 자식, x의 기존 부모에 대한 처리를 먼저 해줘야 한다.
+
+  // y의 기존 자식(왼쪽 자식) 처리
+  // y의 왼쪽 자식은 이제 x의 오른쪽에 붙는다.
+  x->right = y->left;
+  if (y->left != t->nil)
+  {
+    y->left->parent = x;
+  }
+
+  // x의 기존 부모(y의 할아버지) 처리
+  // x의 부모에게도 이제 x대신 y를 자식으로 등록해주기
+  y->parent = x->parent; // 이제 y의 부모 포인터는 x가 아닌 x의 부모를 가리키게 됨
+  if (x->parent == t->nil) { // 부모가 없다는건 루트였다는 뜻이므로 y를 새로운 루트로 등록
+    t->root = y;
+  } 
+  else if (x == x->parent->left) { // y를 x가 있던 정확한 위치로 옮김(x가 왼쪽 자식이었는지 오른쪽 자식이었는지)
+    x->parent->left = y;
+  } 
+  else {
+    x->parent->right = y;
+  }
+
+  // 기존 부모 자식들에 대한 처리가 끝나면 그제서야 x와 y의 부모자식관계 바꾸기
+  y->left = x;
+  x->parent = y;
+  t->rotations++;
+
+  // 회전은 x, y 두 노드의 서브트리만 바꾸므로 아래쪽(x)부터 요약을 다시 계산
+  if (aug) {
+    aug->update(x, t->nil);
+    aug->update(y, t->nil);
+  }
+}
+
+// 좌회전 함수와 대칭
+RB_INLINE void rotate_right(rbtree *t, node_t *x, const rbtree_augment_t *aug) {
+  assert(x != t->nil);
+  assert(x->left != t->nil);
+
+  node_t *y = x->left;
+
+  x->left = y->right;
+  if (y->right != t->nil)
+  {
+    y->right->parent = x;
+  }
+
+  y->parent = x->parent;
+  if (x->parent == t->nil) {
+    t->root = y;
+  } 
+  else if (x == x->parent->right) {
+    x->parent->right = y;
+  } 
+  else {
+    x->parent->left = y;
+  }
+
+  y->right = x;
+  x->parent = y;
+  t->rotations++;
+
+  if (aug) {
+    aug->update(x, t->nil);
+    aug->update(y, t->nil);
+  }
+}
+
+RB_INLINE void insert_fixup(rbtree *t, node_t *z, const rbtree_augment_t *aug) {
+  // 부모가 최종적으로 검은색이어야 하므로 부모가 빨간색인 동안 fixup 반복
+  while (z->parent->color == RBTREE_RED)
+  {
+    node_t *p = z->parent;
+    node_t *g = p->parent;
+    if (p == g->left) // z의 부모가 왼쪽 자식일 때
+    {
+      node_t *u = g->right; // u는 z의 삼촌
+      if (u->color == RBTREE_RED) { // case 1: 삼촌 빨간색
+        g->color = RBTREE_RED;
+        p->color = RBTREE_BLACK;
+        u->color = RBTREE_BLACK;
+        z = g;
+      } else {
+        if (z == p->right) {// case 2: g-p-z 꺾임
+          z = p;
+          rotate_left(t, z, aug);
+          // 회전이 끝나면 부모 조부모 관계가 바뀌므로 포인터 갱신 필요
+          p = z->parent;
+          g = p->parent;
+        }
+        // case 3: g-p-z 선형
+        p->color = RBTREE_BLACK;
+        g->color = RBTREE_RED;
+        rotate_right(t, g, aug);
+      }
+    }
+    else // z의 부모가 오른쪽 자식일 때
+    {
+      node_t *u = g->left; // u는 z의 삼촌
+      if (u->color == RBTREE_RED) { // case 1: 삼촌 빨간색
+        g->color = RBTREE_RED;
+        p->color = RBTREE_BLACK;
+        u->color = RBTREE_BLACK;
+        z = g;
+      } else {
+        if (z == p->left) {// case 2: g-p-z 꺾임
+          z = p;
+          rotate_right(t, z, aug);
+          p = z->parent;
+          g = p->parent;
+        }
+        // case 3: g-p-z 선형
+        p->color = RBTREE_BLACK;
+        g->color = RBTREE_RED;
+        rotate_left(t, g, aug);
+      }
+    }
+  }
+
+  t->root->color = RBTREE_BLACK;
+}
+
+// 탐색으로 정해진 parent 아래에 새 노드를 매달고 fixup까지 수행
+// parent가 nil이면 빈 트리이므로 새 노드가 루트가 된다.
+static node_t *insert_at(rbtree *t, node_t *parent, const key_t key) {
+  // node 초기 설정
+  node_t *node = node_alloc(t);
+  if (!node) return NULL;
+  node->key = key;
+  node_count_init(t, node);
+  link_at(t, parent, node, parent != t->nil && key < parent->key);
+  return node;
+}
+
+// x부터 루트까지 요약을 다시 계산 (구조가 바뀐 지점 위의 조상들)
+RB_INLINE void aug_propagate(rbtree *t, node_t *x, const rbtree_augment_t *aug) {
+  if (!aug) return;
+  for (; x != t->nil; x = x->parent) {
+    aug->update(x, t->nil);
+  }
+}
+
+// 이미 준비된 node를 parent의 왼쪽(left != 0) 또는 오른쪽 자식으로 매달고 fixup
+RB_INLINE void link_at_aug(rbtree *t, node_t *parent, node_t *node, int left,
+  const rbtree_augment_t *aug) {
+  node->left = node->right = node->parent = t->nil;
+  balance_leaf(t, node);
+
+  // 최대 노드는 오른쪽 자식이 없으므로 그 오른쪽에 붙는 노드가 새로운 최대 노드
+  if (parent == t->nil || (parent == t->max && !left)) {
+    t->max = node;
+  }
+
+  // 트리가 비어있으면 바로 루트로 삼고 함수 종료
+  if (parent == t->nil)
+  {
+    t->root = node;
+    aug_propagate(t, node, aug);
+    return;
+  }
+
+  node->parent = parent;
+  if (left) {
+    parent->left = node;
+  } else {
+    parent->right = node;
+  }
+  // 새 노드가 들어간 경로의 요약을 먼저 맞춰두면 fixup의 회전은 국소적으로만 갱신하면 된다.
+  aug_propagate(t, node, aug);
+
+  // BST 규칙 삽입이 끝나면 insert_fixup 함수를 실행시켜 색상 규칙 위반안되도록 트리 수정
+  balance_insert(t, node, aug);
+}
+
+static void link_at(rbtree *t, node_t *parent, node_t *node, int left) {
+  if (t->aug) {
+    link_at_aug(t, parent, node, left, t->aug);
+  } else {
+    link_at_aug(t, parent, node, left, NULL);
+  }
+  t->size++;
+  if (t->filter) filter_add(t, node->key);
+}
+
+// from 서브트리에서 key가 들어갈 부모를 *parent에 기록 (빈 자리까지 하강)
+// counted 모드에서 같은 key를 만나면 그 노드를 반환하고, 아니면 NULL 반환
+static node_t *descend(const rbtree *t, node_t *from, const key_t key,
+  node_t **parent) {
+  *parent = from->parent;
+  node_t *tmp = from;
+  while (tmp != t->nil) {
+    if ((t->flags & RBTREE_COUNTED) && key == tmp->key) {
+      return tmp;
+    }
+    *parent = tmp;
+    tmp = (key < tmp->key) ? tmp->left : tmp->right;
+  }
+  return NULL;
+}
+
+// 연산 로그에 남기는 삽입은 성공한 뒤에 기록한다. (실제 삽입은 insert_key)
+node_t *rbtree_insert(rbtree *t, const key_t key) {
+  // TODO: implement insert
+  node_t *p = insert_key(t, key);
+  if (p && t->log) log_append(t, LOG_INSERT, key);
+  return p;
+}
+
+static node_t *insert_key(rbtree *t, const key_t key) {
+  if (!t || (t->flags & RBTREE_INTRUSIVE)) return NULL; // intrusive 트리는 rbtree_link 사용
+  if (t->wbuf) return wbuf_put(t, key);
+  if (t->pstate) return pinsert(t, key);
+  if (t->conc) return cn_insert(t, key, 0, NULL);
+  if (t->btree) return bt_insert(t, key, 0, NULL);
+  if (small_inline(t)) {
+    node_t *p = small_insert(t, key, 0, NULL);
+    if (p) return p;
+  }
+
+  node_t *parent = t->nil;
+  node_t *dup = NULL;
+
+  // 빠른 경로: 현재 최대값 이상인 key는 최대 노드의 오른쪽 자리로 바로 들어간다.
+  // (최대 노드는 오른쪽 자식이 없으므로 하강할 필요가 없음)
+  if (t->max != t->nil && key >= t->max->key) {
+    if ((t->flags & RBTREE_COUNTED) && key == t->max->key) {
+      dup = t->max;
+    }
+    parent = t->max;
+  }
+  else {
+    // BST 규칙으로 들어갈 자리(부모)부터 찾는다.
+    // counted 모드에서는 내려가는 길에 같은 key를 만나면 새 노드 대신 count만 올린다.
+    dup = descend(t, t->root, key, &parent);
+  }
+
+  if (dup) return count_up(t, dup);
+  return insert_at(t, parent, key);
+}
+
+// hint 근처에서 시작하는 삽입. hint에서 key를 포함하는 서브트리까지만 올라간 뒤 하강한다.
+// 결과 위치는 rbtree_insert와 완전히 같고, hint가 key와 가까울수록 빨라진다.
+node_t *rbtree_insert_hint(rbtree *t, node_t *hint, const key_t key) {
+  if (!t || (t->flags & RBTREE_INTRUSIVE)) return NULL;
+  // 쓰기 버퍼가 있으면 어차피 버퍼로 간다. (hint가 아직 트리에 없는 노드일 수도 있다)
+  if (!hint || hint == t->nil || t->root == t->nil || t->pstate || t->wbuf ||
+      (t->max != t->nil && key >= t->max->key)) {
+    return rbtree_insert(t, key);
+  }
+
+  // c의 서브트리 key 범위가 key를 포함할 때까지 부모로 올라간다.
+  // - key >= hint: c가 왼쪽 자식이고 key < 부모이면 부모가 상한이 되므로 멈춤
+  // - key <  hint: c가 오른쪽 자식이고 key >= 부모이면 부모가 하한이 되므로 멈춤
+  node_t *c = hint;
+  if (key >= hint->key) {
+    while (c->parent != t->nil &&
+           !(c == c->parent->left && key < c->parent->key)) {
+      c = c->parent;
+    }
+  }
+  else {
+    while (c->parent != t->nil &&
+           !(c == c->parent->right && key >= c->parent->key)) {
+      c = c->parent;
+    }
+    // counted 모드에서 멈춘 부모가 같은 key면 그 노드가 중복 대상이다. (c 서브트리에는 없다)
+    if ((t->flags & RBTREE_COUNTED) && c->parent != t->nil &&
+        c->parent->key == key) {
+      c = c->parent;
+    }
+  }
+
+  node_t *parent;
+  node_t *dup = descend(t, c, key, &parent);
+  node_t *p = dup ? count_up(t, dup) : insert_at(t, parent, key);
+  if (p && t->log) log_append(t, LOG_INSERT, key);
+  return p;
+}
+
+// key가 이미 있으면 그 노드를, 없으면 새로 넣은 노드를 반환 (한 번의 하강으로 처리)
+// existed가 NULL이 아니면 기존 노드였는지(1) 새 노드인지(0)를 기록한다.
+// counted 모드여도 기존 노드의 count는 건드리지 않는다.
+node_t *rbtree_insert_unique(rbtree *t, const key_t key, int *existed) {
+  int had = 0;
+  node_t *p = insert_unique_key(t, key, &had);
+  if (p && !had && t->log) log_append(t, LOG_INSERT, key);
+  if (existed) *existed = had;
+  return p;
+}
+
+static node_t *insert_unique_key(rbtree *t, const key_t key, int *existed) {
+  if (!t || (t->flags & RBTREE_INTRUSIVE)) return NULL;
+  if (t->pstate) {
+    node_t *p = rbtree_find(t, key);
+    if (existed) *existed = (p != NULL);
+    return p ? p : pinsert(t, key);
+  }
+  if (t->conc) return cn_insert(t, key, 1, existed);
+  if (t->btree) return bt_insert(t, key, 1, existed);
+  if (small_inline(t)) {
+    node_t *p = small_insert(t, key, 1, existed);
+    if (p) return p;
+  }
+  // 쓰기 버퍼가 있어도 트리를 찾아봐야 하므로, 없던 key는 찾은 자리에 바로 단다.
+  node_t *staged = t->wbuf ? wbuf_find(t, key) : NULL;
+  if (staged) {
+    if (existed) *existed = 1;
+    return staged;
+  }
+
+  node_t *parent = t->nil;
+  node_t *tmp = t->root;
+  while (tmp != t->nil) {
+    if (key == tmp->key) {
+      if (existed) *existed = !node_dead(t, tmp); // tombstone은 새로 넣은 것으로 본다.
+      return node_dead(t, tmp) ? count_up(t, tmp) : tmp;
+    }
+    parent = tmp;
+    tmp = (key < tmp->key) ? tmp->left : tmp->right;
+  }
+
+  if (existed) *existed = 0;
+  return insert_at(t, parent, key);
+}
+
+// from 서브트리 안에서 key를 찾는다. 못 찾으면 NULL
+// last에는 마지막으로 방문한 노드(다음 finger 후보)를 기록
+static node_t *find_below(const rbtree *t, node_t *from, const key_t key,
+  node_t **last) {
+  node_t *tmp = from;
+  while(tmp != t->nil)
+  {
+    *last = tmp;
+    if (tmp->key < key) {
+      tmp = tmp->right;
+    } else if (tmp->key > key) {
+      tmp = tmp->left;
+    } else {
+      return tmp;
+    }
+  }
+  return NULL;
+}
+
+node_t *rbtree_find(const rbtree *t, const key_t key) {
+  // TODO: implement find
+  if (!t) return NULL;
+  if (t->conc) return cn_find(t, key);
+  if (t->wbuf) {
+    node_t *s = wbuf_find(t, key); // 버퍼의 key는 아직 filter에 없다.
+    if (s) return s;
+  }
+
+  // filter가 없다고 하면 트리를 내려갈 필요가 없다.
+  if (t->filter && !filter_maybe(t, key)) return NULL;
+
+  node_t *found;
+  if (t->btree) {
+    found = bt_find(t, key);
+  } else if (small_inline(t)) {
+    found = small_find(t, key);
+  } else if (t->flags & RBTREE_FINGER) {
+    // 같은 스레드가 직전에 이 트리에서 찾은 위치가 아직 유효하면 거기서부터 탐색
+    node_t *finger = t->root;
+    if (last_finger.tree == t && last_finger.gen == t->gen) {
+      finger = last_finger.node;
+    }
+    found = rbtree_find_from(t, finger, key);
+  } else {
+    node_t *last = t->nil;
+    found = find_below(t, t->root, key, &last);
+  }
+  if (found && node_dead(t, found)) found = NULL; // tombstone (RBTREE_LAZY)
+
+  if (t->filter && !found) {
+    atomic_fetch_add_explicit(&t->filter->false_pos, 1, memory_order_relaxed);
+  }
+  return found;
+}
+
+// p가 나타내는 key의 개수 (counted 트리가 아니면 1)
+size_t rbtree_count(const rbtree *t, const node_t *p) {
+  if (!t || !p) return 0;
+  return node_count(t, p);
+}
+
+// finger에서 부모 방향으로 key를 포함하는 서브트리까지만 올라간 뒤 하강하는 탐색
+// finger와 key의 순위 차이가 d일 때 O(log d)로 끝난다.
+node_t *rbtree_find_from(const rbtree *t, node_t *finger, const key_t key) {
+  if (!t) return NULL;
+  if (t->conc) return cn_find(t, key);
+  if (t->btree) return bt_find(t, key);
+  if (small_inline(t)) return small_find(t, key);
+  if (t->wbuf) {
+    node_t *s = wbuf_find(t, key);
+    if (s) return s;
+    if (finger && finger->parent == NULL) finger = NULL; // 트리에 아직 없는 노드
+  }
+  if (!finger || finger == t->nil || (t->flags & RBTREE_PERSISTENT)) {
+    finger = t->root;
+  }
+
+  node_t *found = NULL;
+  node_t *last = finger;
+  node_t *c = finger;
+  if (c == t->nil || key == c->key) {
+    found = (c == t->nil) ? NULL : c;
+  }
+  else {
+    // 올라가는 도중에 지나치는 조상이 key와 같으면 그 조상이 답
+    // key > finger: c가 왼쪽 자식이고 key < 부모이면 부모가 상한이 되므로 멈춤
+    // key < finger: c가 오른쪽 자식이고 key > 부모이면 부모가 하한이 되므로 멈춤
+    const int go_right = key > c->key;
+    while (c->parent != t->nil) {
+      node_t *p = c->parent;
+      if (p->key == key) {
+        found = p;
+        break;
+      }
+      if (go_right ? (c == p->left && key < p->key)
+                   : (c == p->right && key > p->key)) {
+        break;
+      }
+      c = p;
+    }
+    if (!found) {
+      found = find_below(t, c, key, &last);
+    }
+  }
+
+  if (t->flags & RBTREE_FINGER) {
+    last_finger.tree = t;
+    last_finger.gen = t->gen;
+    last_finger.node = found ? found : last;
+  }
+  return (found && !node_dead(t, found)) ? found : NULL;
+}
+
+node_t *rbtree_min(const rbtree *t) {
+  if (t && t->conc) return cn_min(t);
+  if (t && t->btree) return t->size ? t->btree->first->vals[0] : NULL;
+  if (t && small_inline(t)) return small_step(t, NULL, 1);
+  if (!t) return NULL;
+  node_t *tmp = NULL;
+  if (t->root != t->nil) {
+    tmp = t->root;
+    while(tmp->left != t->nil)
+    {
+      tmp = tmp->left;
+    }
+    while (tmp && node_dead(t, tmp)) tmp = tree_next(t, tmp); // tombstone은 건너뜀
+  }
+  return wbuf_end(t, tmp, 1);
+}
+
+// 최대 노드는 insert/erase에서 캐시해두므로 O(1)
+node_t *rbtree_max(const rbtree *t) {
+  if (t && t->conc) return cn_prev(t, 0, 1);
+  if (t && t->btree) {
+    return t->size ? t->btree->last->vals[t->btree->last->h.n - 1] : NULL;
+  }
+  if (t && small_inline(t)) return small_step(t, NULL, -1);
+  if (!t) return NULL;
+  node_t *m = t->root == t->nil ? NULL : t->max;
+  while (m && node_dead(t, m)) m = tree_prev(t, m); // tombstone은 건너뜀
+  return wbuf_end(t, m, -1);
+}
+
+// 노드 u 자리에 v 서브트리를 이식
+static void rbtree_transplant(rbtree *t, node_t *u, node_t *v) {
+  if (u->parent == t->nil) {
+    t->root = v;
+  } else if (u == u->parent->left) {
+    u->parent->left = v;
+  } else {
+    u->parent->right = v;
+  }
+  if (v != t->nil) v->parent = u->parent; // sentinel은 여러 트리가 공유할 수 있으므로 쓰지 않는다.
+}
+
+// xp는 x의 부모. x가 nil일 수 있고 sentinel에는 쓰지 않으므로 부모를 따로 넘겨받는다.
+// (x가 nil이어도 형제는 nil이 아니므로 x == xp->left로 방향을 가릴 수 있다)
+RB_INLINE void rbtree_erase_fixup(rbtree *t, node_t *x, node_t *xp,
+  const rbtree_augment_t *aug) {
+  while (x != t->root && x->color == RBTREE_BLACK)
+  {
+    if (x == xp->left) // x가 왼쪽 자식일 때
+    {
+      node_t *w = xp->right; // w는 x의 형제
+      // case 1: 형제가 적색일 경우 회전과 색 교환을 통해 형제가 흑색인 형태로(새로운 형제) 트리 구조를 조작
+      // => case 2,3,4(형제가 흑색인 case들) 중 하나로 변환되어 이중 흑색 처리를 이어나감
+      if (w->color == RBTREE_RED) {
+        // x.p, w 색 바꾸기
+        w->color = RBTREE_BLACK;
+        xp->color = RBTREE_RED;
+        // x.p 기준 좌회전
+        rotate_left(t, xp, aug);
+        // new w 설정
+        w = xp->right;
+      }
+      // case 2: 형제가 흑색이면서 형제의 자식들이 모두 흑색일 경우
+      // => 재색칠을 통해 문제를 한 단계 위로 밀어올림(이중 흑색을 부모에게 전파) 
+      if (w->left->color == RBTREE_BLACK && w->right->color == RBTREE_BLACK) 
+      {
+        // x, w 흑색을 x.p로 전파
+        w->color = RBTREE_RED;
+        // x.p를 new x로 설정 (new x는 nil이 아니므로 부모는 parent로 읽는다)
+        x = xp;
+        xp = x->parent;
+      }
+      // case 3 & case 4
+      else
+      {
+        // case 3: 형제가 흑색이면서 형제의 왼쪽 자식이 적색, 오른쪽 자식이 흑색인 경우
+        // => 재색칠과 회전을 통해 적색 노드를 오른쪽 자식으로 갖는 새로운 흑색 형제 만듬
+        // => case 4로 변환 완료!
+        if (w->left->color == RBTREE_RED && w->right->color == RBTREE_BLACK) 
+        {
+          // w, w.left 색 바꾸기
+          w->color = RBTREE_RED;
+          w->left->color = RBTREE_BLACK;
+          // w 기준 우회전
+          rotate_right(t, w, aug);
+          // new w 설정
+          w = w->parent;
+        }
+        // case 4: 형제가 흑색이면서 형제의 오른쪽 자식(x에서 멀리 떨어져있는 조카)이 적색인 경우(최종 해결 단계)
+        if (w->right->color == RBTREE_RED) 
         {
           // case4의 목표 두 가지
           // 1. x의 이중 흑색이라는 빚을 청산함과 동시에
           // 2. 그 과정에서 새로운 불균형이 생기면 안된다.
           // 그래야만 이 케이스안에서 최종 해결이 된다.
 
-          // x.p 기준으로 회전을 하기전 미리 필요한 색들을 예치해준다.
-          // 1. 회전으로 w가 새로운 서브트리 루트가 될테니, 위쪽에서 보던 색을 그대로 유지하려고 p의 색을 w에 이식
-          // => 조부모 관점의 bh/속성 보존
-          w->color = x->parent->color;
-          // 2. 회전을 하면 x.p가 x의 경로에 새로 추가되므로 x.p에 흑색을 미리 예치해두면,
-          // 회전 후에 x경로에 흑색을 하나 보태주는것이 되어 균형이 맞게 되고 드디어 이중 흑색이라는 빚이 청산된다.
-          x->parent->color = RBTREE_BLACK;
-          // 3. 회전을 하면 w가 서브트리 루트가 되면서 bh 계산에서 제외되기 때문에, 오른쪽 경로에서도 흑색 하나를 손해보게된다.
-          // => w.r에도 흑색을 예치해두면 회전 후에도 다시 균형이 맞게된다.
-          w->right->color = RBTREE_BLACK;
-          // 위에서 색들을 미리 예치해두었기때문에 회전을 하면 곧바로 이중 흑색이 해소되고 모든 불균형이 사라진다.
-          rotate_left(t, x->parent);
-          // 이중 흑색 문제 해결! 포인터 x를 루트로 옮겨 루프 강제 종료
-          x = t->root;
+          // x.p 기준으로 회전을 하기전 미리 필요한 색들을 예치해준다.
+          // 1. 회전으로 w가 새로운 서브트리 루트가 될테니, 위쪽에서 보던 색을 그대로 유지하려고 p의 색을 w에 이식
+          // => 조부모 관점의 bh/속성 보존
+          w->color = xp->color;
+          // 2. 회전을 하면 x.p가 x의 경로에 새로 추가되므로 x.p에 흑색을 미리 예치해두면,
+          // 회전 후에 x경로에 흑색을 하나 보태주는것이 되어 균형이 맞게 되고 드디어 이중 흑색이라는 빚이 청산된다.
+          xp->color = RBTREE_BLACK;
+          // 3. 회전을 하면 w가 서브트리 루트가 되면서 bh 계산에서 제외되기 때문에, 오른쪽 경로에서도 흑색 하나를 손해보게된다.
+          // => w.r에도 흑색을 예치해두면 회전 후에도 다시 균형이 맞게된다.
+          w->right->color = RBTREE_BLACK;
+          // 위에서 색들을 미리 예치해두었기때문에 회전을 하면 곧바로 이중 흑색이 해소되고 모든 불균형이 사라진다.
+          rotate_left(t, xp, aug);
+          // 이중 흑색 문제 해결! 포인터 x를 루트로 옮겨 루프 강제 종료
+          x = t->root;
+        }
+      }
+    }
+    else
+    {
+      node_t *w = xp->left;
+      if (w->color == RBTREE_RED) {
+        w->color = RBTREE_BLACK;
+        xp->color = RBTREE_RED;
+        rotate_right(t, xp, aug);
+        w = xp->left;
+      }
+      if (w->right->color == RBTREE_BLACK && w->left->color == RBTREE_BLACK) 
+      {
+        w->color = RBTREE_RED;
+        x = xp;
+        xp = x->parent;
+      }
+      else
+      {
+        if (w->right->color == RBTREE_RED && w->left->color == RBTREE_BLACK) 
+        {
+          w->color = RBTREE_RED;
+          w->right->color = RBTREE_BLACK;
+          rotate_left(t, w, aug);
+          w = w->parent;
+        }
+        if (w->left->color == RBTREE_RED) 
+        {
+          w->color = xp->color;
+          xp->color = RBTREE_BLACK;
+          w->left->color = RBTREE_BLACK;
+          rotate_right(t, xp, aug);
+          x = t->root;
+        }
+      }
+    }
+  }
+  if (x != t->nil) x->color = RBTREE_BLACK;
+}
+
+/*
+균형 정책
+
+어떤 균형 규칙을 쓸지는 컴파일할 때 RBTREE_BALANCE로 고른다. (rbtree.h 참고)
+- RBTREE_BALANCE_RB: 레드-블랙 (insert_fixup / rbtree_erase_fixup)
+- RBTREE_BALANCE_AVL: 서브트리 높이 차 1 이하. 트리가 더 낮아서 탐색이 빠르지만 erase 회전이 많다.
+- RBTREE_BALANCE_WAVL: weak AVL. insert만 하면 AVL과 같은 모양이고, erase는 회전 2번 이내로 끝난다.
+AVL/WAVL은 노드 구조를 바꾸지 않고 color 자리에 rank(높이)를 둔다.
+sentinel의 RBTREE_BLACK이 rank 0, 새 leaf가 rank 1이 되도록 RBTREE_BLACK만큼 옮겨서 저장한다.
+persistent 트리는 경로 복사용 fixup이 따로 있으므로 정책과 관계없이 레드-블랙이다.
+*/
+
+RB_INLINE int rank_of(const node_t *x) {
+  return (int)x->color - RBTREE_BLACK;
+}
+
+RB_INLINE void set_rank(node_t *x, int r) {
+  x->color = (color_t)(r + RBTREE_BLACK);
+}
+
+#if RBTREE_BALANCE == RBTREE_BALANCE_AVL
+
+// 자식들의 높이로 x의 높이를 다시 계산
+RB_INLINE void avl_update(node_t *x) {
+  int l = rank_of(x->left), r = rank_of(x->right);
+  set_rank(x, 1 + (l > r ? l : r));
+}
+
+// 두 서브트리 높이 차가 2인 x를 회전으로 맞추고 새 서브트리 루트를 반환
+RB_INLINE node_t *avl_rotate(rbtree *t, node_t *x, const rbtree_augment_t *aug) {
+  if (rank_of(x->left) > rank_of(x->right)) {
+    node_t *y = x->left;
+    if (rank_of(y->left) < rank_of(y->right)) { // 꺾인 모양이면 이중 회전
+      rotate_left(t, y, aug);
+      avl_update(y);
+    }
+    rotate_right(t, x, aug);
+  } else {
+    node_t *y = x->right;
+    if (rank_of(y->right) < rank_of(y->left)) {
+      rotate_right(t, y, aug);
+      avl_update(y);
+    }
+    rotate_left(t, x, aug);
+  }
+  avl_update(x);
+  avl_update(x->parent);
+  return x->parent;
+}
+
+// 새 leaf의 부모부터 높이를 고친다. 회전이 한 번 일어나면 삽입 전 높이로 돌아오므로 끝
+RB_INLINE void avl_insert_fixup(rbtree *t, node_t *x,
+  const rbtree_augment_t *aug) {
+  for (node_t *p = x->parent; p != t->nil; p = p->parent) {
+    int l = rank_of(p->left), r = rank_of(p->right);
+    if (l - r == 2 || r - l == 2) {
+      avl_rotate(t, p, aug);
+      return;
+    }
+    int h = 1 + (l > r ? l : r);
+    if (h == rank_of(p)) return;
+    set_rank(p, h);
+  }
+}
+
+// 노드가 빠진 자리의 부모 p부터 높이가 그대로인 조상을 만날 때까지 고친다.
+RB_INLINE void avl_erase_fixup(rbtree *t, node_t *p,
+  const rbtree_augment_t *aug) {
+  while (p != t->nil) {
+    int l = rank_of(p->left), r = rank_of(p->right);
+    int old = rank_of(p);
+    if (l - r == 2 || r - l == 2) {
+      p = avl_rotate(t, p, aug);
+    } else {
+      set_rank(p, 1 + (l > r ? l : r));
+    }
+    if (rank_of(p) == old) return;
+    p = p->parent;
+  }
+}
+
+#elif RBTREE_BALANCE == RBTREE_BALANCE_WAVL
+
+// rank 차이가 1 또는 2인 규칙을 지킨다. (leaf는 rank 1, 2,2 leaf는 허용 안 함)
+// x가 부모와 rank가 같은(0-child) 동안 위반을 위로 올린다.
+RB_INLINE void wavl_insert_fixup(rbtree *t, node_t *x,
+  const rbtree_augment_t *aug) {
+  node_t *p = x->parent;
+  while (p != t->nil && rank_of(p) == rank_of(x)) {
+    const int left = (x == p->left);
+    node_t *s = left ? p->right : p->left;
+    if (rank_of(p) - rank_of(s) == 1) { // p가 0,1 노드면 p를 올리고 위로
+      set_rank(p, rank_of(p) + 1);
+      x = p;
+      p = p->parent;
+      continue;
+    }
+    // p가 0,2 노드: 회전으로 끝난다.
+    node_t *z = left ? x->right : x->left; // x의 안쪽 자식
+    if (rank_of(x) - rank_of(z) == 2) {
+      if (left) {
+        rotate_right(t, p, aug);
+      } else {
+        rotate_left(t, p, aug);
+      }
+      set_rank(p, rank_of(p) - 1);
+    } else {
+      if (left) {
+        rotate_left(t, x, aug);
+        rotate_right(t, p, aug);
+      } else {
+        rotate_right(t, x, aug);
+        rotate_left(t, p, aug);
+      }
+      set_rank(z, rank_of(z) + 1);
+      set_rank(x, rank_of(x) - 1);
+      set_rank(p, rank_of(p) - 1);
+    }
+    return;
+  }
+}
+
+// x가 빠진 자리에 올라온 노드(nil일 수 있음), p는 그 부모
+RB_INLINE void wavl_erase_fixup(rbtree *t, node_t *x, node_t *p,
+  const rbtree_augment_t *aug) {
+  if (p == t->nil) return;
+  // leaf가 빠져서 p가 2,2 leaf가 되면 p를 내린다.
+  if (p->left == t->nil && p->right == t->nil && rank_of(p) == 2) {
+    set_rank(p, 1);
+    x = p;
+    p = p->parent;
+  }
+  // x가 3-child인 동안 내리거나 회전한다.
+  while (p != t->nil && rank_of(p) - rank_of(x) == 3) {
+    const int left = (x == p->left); // x가 nil이어도 형제는 nil이 아니다.
+    node_t *s = left ? p->right : p->left;
+    if (rank_of(p) - rank_of(s) == 2) { // 형제가 2-child면 p만 내린다.
+      set_rank(p, rank_of(p) - 1);
+    } else if (rank_of(s) - rank_of(s->left) == 2 &&
+               rank_of(s) - rank_of(s->right) == 2) { // 형제가 2,2면 둘 다 내린다.
+      set_rank(s, rank_of(s) - 1);
+      set_rank(p, rank_of(p) - 1);
+    } else {
+      node_t *v = left ? s->right : s->left; // 형제의 바깥쪽 자식
+      if (rank_of(s) - rank_of(v) == 1) {
+        if (left) {
+          rotate_left(t, p, aug);
+        } else {
+          rotate_right(t, p, aug);
+        }
+        set_rank(s, rank_of(s) + 1);
+        // 회전 후 p가 leaf면 2,2 leaf가 되지 않도록 한 번 더 내린다.
+        int leaf = (p->left == t->nil && p->right == t->nil);
+        set_rank(p, rank_of(p) - (leaf ? 2 : 1));
+      } else {
+        node_t *u = left ? s->left : s->right; // 안쪽 자식 (1-child)
+        if (left) {
+          rotate_right(t, s, aug);
+          rotate_left(t, p, aug);
+        } else {
+          rotate_left(t, s, aug);
+          rotate_right(t, p, aug);
+        }
+        set_rank(u, rank_of(u) + 2);
+        set_rank(s, rank_of(s) - 1);
+        set_rank(p, rank_of(p) - 2);
+      }
+      return;
+    }
+    x = p;
+    p = p->parent;
+  }
+}
+
+#endif
+
+// 새 노드의 초기 색(또는 rank)
+RB_INLINE void balance_leaf(rbtree *t, node_t *node) {
+#if RBTREE_BALANCE == RBTREE_BALANCE_RB
+  node->color = (t->root == t->nil ? RBTREE_BLACK : RBTREE_RED);
+#else
+  (void)t;
+  set_rank(node, 1);
+#endif
+}
+
+// 부모 아래에 매단 새 노드에서 시작하는 삽입 후 균형 복구
+RB_INLINE void balance_insert(rbtree *t, node_t *node,
+  const rbtree_augment_t *aug) {
+#if RBTREE_BALANCE == RBTREE_BALANCE_AVL
+  avl_insert_fixup(t, node, aug);
+#elif RBTREE_BALANCE == RBTREE_BALANCE_WAVL
+  wavl_insert_fixup(t, node, aug);
+#else
+  insert_fixup(t, node, aug);
+#endif
+}
+
+// 노드가 빠진 뒤 균형 복구. x는 빠진 자리에 올라온 노드, xp는 그 부모
+RB_INLINE void balance_erase(rbtree *t, node_t *x, node_t *xp,
+  color_t y_origin_color, const rbtree_augment_t *aug) {
+#if RBTREE_BALANCE == RBTREE_BALANCE_AVL
+  (void)x;
+  (void)y_origin_color;
+  avl_erase_fixup(t, xp, aug);
+#elif RBTREE_BALANCE == RBTREE_BALANCE_WAVL
+  (void)y_origin_color;
+  wavl_erase_fixup(t, x, xp, aug);
+#else
+  if (y_origin_color == RBTREE_BLACK) {
+    rbtree_erase_fixup(t, x, xp, aug);
+  }
+#endif
+}
+
+/*
+rbtree_erase 함수에서는 x,y,z 3가지 포인터가 등장한다.
+
+1. z: 삭제 대상
+2. y: 트리에서 실제로 제거되는 노드 (z 또는 z의 successor)
+    - z의 자식이 1개 이하일 경우: y는 z 자신.
+    - z의 자식이 2개일 경우: y는 z의 후임자(successor).
+3. x: y의 유일한 자식(없으면 nil)
+    - y가 빠져나간 빈자리를 메꾸기 위해 y의 원래 위치로 이동하게 됨
+    - 이 때 제거된 y의 색이 흑색일 경우 RB-tree의 5번 속성(bh 보존)이 꺠지게 된다.
+    - x가 nil이어도 sentinel의 parent에 쓰지 않도록 x의 부모는 xp로 따로 기억한다.
+    
+
+절차
+1. BST 규칙에 따라 z를 트리에서 제거한다. 이 과정에서 y와 x 포인터가 결정된다.
+2. 제거된 노드 y의 원래 색이 BLACK이었다면, 트리 속성이 깨졌을 수 있다.
+   이때 rbtree_erase_fixup(t, x, xp)를 호출하여 속성을 복구한다.
+*/ 
+int rbtree_erase(rbtree *t, node_t *z) {
+  if (!t || z == t->nil) return 0;
+  if (t->pstate) {
+    // 할당에 실패하면 지우지 않았으므로 로그에도 남기지 않는다.
+    const key_t key = z->key;
+    if (perase(t, z, key) < 0) return -1;
+    if (t->log) log_append(t, LOG_ERASE, key);
+    return 0;
+  }
+  if (t->log) log_append(t, LOG_ERASE, z->key);
+  if (t->conc) {
+    cn_erase(t, z->key); // leaf는 바뀌지 않으므로 z의 key로 지운다.
+    return 0;
+  }
+
+  // counted 모드: 중복이 남아있으면 count만 줄이고 노드는 그대로 둔다.
+  if (node_count(t, z) > 1) {
+    NODE_COUNT(z)--;
+    return 0;
+  }
+  if (t->wbuf && z->parent == NULL) {
+    wbuf_remove(t, z); // 아직 트리에 달리지 않은 노드
+    return 0;
+  }
+  if (t->flags & RBTREE_LAZY) {
+    lazy_erase(t, z);
+    return 0;
+  }
+  if (t->btree) {
+    bt_erase(t, z);
+    return 0;
+  }
+  if (small_inline(t)) {
+    small_remove(t, z);
+    return 0;
+  }
+
+  erase_unlink(t, z);
+  // intrusive 트리의 노드는 호출한 쪽 소유이므로 떼어내기만 한다.
+  if (!(t->flags & RBTREE_INTRUSIVE)) {
+    node_free(t, z); // 삭제된 노드 z의 메모리를 해제해야 메모리 누수가 발생하지 않음
+  } else if (is_str(t)) {
+    free(rbtree_entry(z, rbtree_str, link)); // 문자열 key 노드는 트리가 할당한 것
+  }
+  return 0;
+}
+
+// z를 트리에서 떼어내고 색 규칙을 복구한다. (z의 메모리는 건드리지 않음)
+static void erase_unlink(rbtree *t, node_t *z) {
+  if (t->aug) {
+    erase_unlink_aug(t, z, t->aug);
+  } else {
+    erase_unlink_aug(t, z, NULL);
+  }
+  t->size--;
+  if (t->filter) filter_remove(t, z->key);
+}
+
+RB_INLINE void erase_unlink_aug(rbtree *t, node_t *z,
+  const rbtree_augment_t *aug) {
+  // 최대 노드를 지우면 그 직전 노드(predecessor)가 새 최대 노드가 된다.
+  // 최대 노드는 오른쪽 자식이 없으므로 왼쪽 서브트리의 최댓값, 없으면 부모.
+  if (z == t->max) {
+    node_t *pred = z->parent;
+    if (z->left != t->nil) {
+      pred = z->left;
+      while (pred->right != t->nil) {
+        pred = pred->right;
+      }
+    }
+    t->max = pred;
+  }
+
+  node_t *y = z;
+  node_t *x = t->nil;
+  node_t *xp = z->parent; // x의 부모 (x가 nil이면 nil->parent 대신 이 값을 쓴다)
+  color_t y_origin_color = y->color;
+
+  // case 1: z의 왼쪽이 NIL → 오른쪽으로 교체
+  if (z->left == t->nil) {
+    x = z->right;
+    rbtree_transplant(t,z,z->right);
+  } 
+  // case 2: z의 오른쪽이 NIL → 왼쪽으로 교체
+  else if (z->right == t->nil) {
+    x = z->left;
+    rbtree_transplant(t,z,z->left);
+  } 
+  // 위 처리 결과 노드 z는 직접 제거되며 x는 z의 위치로 올라온 노드가 된다.(z에 자식이 없었다면 NIL)
+
+  // case 3: 양쪽 자식 존재 → 후임 노드로 대체
+  else {
+    // 후임 노드 찾기(y가 가리키게 만듬)
+    y = z->right;                              
+    while (y->left != t->nil) {
+      y = y->left;
+    }
+    y_origin_color = y->color;          // 트리에서 빠져나올 y의 색을 미리 저장
+    x = y->right;                       // x는 y의 유일한 자식 (successor는 왼쪽 자식이 없으므로)
+
+    // y를 원래 위치에서 제거하기
+    if (y->parent == z) {
+      // y가 z의 바로 오른쪽 자식인 경우, y가 z 자리로 올라가도 x는 그대로 y의 자식
+      xp = y;
+    } else {
+      xp = y->parent;
+      // y가 z의 오른쪽 서브트리 깊숙이 있는 경우,
+      // 1. y의 원래 위치를 x로 대체하여 y를 트리에서 분리
+      rbtree_transplant(t, y, x);
+      // 2. y가 z의 자리를 차지할 준비: z의 오른쪽 서브트리를 y에게 넘김
+      y->right = z->right;
+      y->right->parent = y;
+    }
+
+    // 공통 후처리: z 자리에 y 올리고, z의 왼쪽 서브트리를 y.left로, 색은 z의 색 유지
+    rbtree_transplant(t,z,y);
+    y->left = z->left;
+    y->left->parent = y;
+    y->color = z->color;
+  }
+
+  // 구조가 바뀐 가장 아래 지점(x의 부모 xp)부터 루트까지 요약 갱신
+  aug_propagate(t, xp, aug);
+
+  // 빠진 y 자리부터 균형 복구 (레드-블랙이면 y가 흑색이었을 때만 높이 위반 가능)
+  balance_erase(t, x, xp, y_origin_color, aug);
+
+  next_gen(t); // z를 가리키던 finger 무효화
+}
+
+// key를 가진 노드 하나를 찾아 바로 삭제 (find + erase를 한 번의 하강으로 처리)
+// 삭제했으면 1, 해당 key가 없으면 0을 반환한다.
+int rbtree_erase_key(rbtree *t, const key_t key) {
+  if (!t) return 0;
+  node_t *staged = t->wbuf ? wbuf_find(t, key) : NULL;
+  if (staged) {
+    rbtree_erase(t, staged); // 버퍼에 있으면 버퍼에서 뺀다.
+    return 1;
+  }
+  if (t->filter && !filter_maybe(t, key)) return 0;
+  if (t->pstate) {
+    const int r = perase(t, NULL, key);
+    if (r > 0 && t->log) log_append(t, LOG_ERASE, key);
+    return r;
+  }
+  if (t->conc) return cn_erase(t, key);
+
+  node_t *z = t->root;
+  if (t->btree || small_inline(t)) {
+    z = t->btree ? bt_find(t, key) : small_find(t, key);
+    if (!z) return 0;
+  }
+  while (z != t->nil && z->key != key) {
+    z = (key < z->key) ? z->left : z->right;
+  }
+  if (z == t->nil || node_dead(t, z)) return 0;
+
+  rbtree_erase(t, z);
+  return 1;
+}
+
+// 이진 트리에서 중위 순서의 다음 노드 (tombstone 포함, 없으면 NULL)
+static node_t *tree_next(const rbtree *t, const node_t *x) {
+  if (x->right != t->nil) {
+    x = x->right;
+    while (x->left != t->nil) x = x->left;
+    return (node_t *)x;
+  }
+  node_t *p = x->parent;
+  while (p != t->nil && x == p->right) {
+    x = p;
+    p = p->parent;
+  }
+  return p == t->nil ? NULL : p;
+}
+
+// 이진 트리에서 중위 순서의 이전 노드 (tombstone 포함, 없으면 NULL)
+static node_t *tree_prev(const rbtree *t, const node_t *x) {
+  if (x->left != t->nil) {
+    x = x->left;
+    while (x->right != t->nil) x = x->right;
+    return (node_t *)x;
+  }
+  node_t *p = x->parent;
+  while (p != t->nil && x == p->left) {
+    x = p;
+    p = p->parent;
+  }
+  return p == t->nil ? NULL : p;
+}
+
+// 중위 순서의 다음 노드 (없으면 NULL). RBTREE_LAZY의 tombstone은 건너뛴다.
+node_t *rbtree_next(const rbtree *t, const node_t *x) {
+  if (!t || !x || x == t->nil) return NULL;
+  if (t->conc) return cn_next(t, x->key);
+  if (t->btree) return bt_step(x, 1);
+  if (small_inline(t)) return small_step(t, x, 1);
+  if (t->flags & RBTREE_PERSISTENT) return pstep(t, x, 1);
+  if (t->wbuf) return wbuf_step(t, x, 1);
+  node_t *y = tree_next(t, x);
+  while (y && node_dead(t, y)) y = tree_next(t, y);
+  return y;
+}
+
+// 중위 순서의 이전 노드 (없으면 NULL)
+node_t *rbtree_prev(const rbtree *t, const node_t *x) {
+  if (!t || !x || x == t->nil) return NULL;
+  if (t->conc) return cn_prev(t, x->key, 0);
+  if (t->btree) return bt_step(x, -1);
+  if (small_inline(t)) return small_step(t, x, -1);
+  if (t->flags & RBTREE_PERSISTENT) return pstep(t, x, -1);
+  if (t->wbuf) return wbuf_step(t, x, -1);
+  node_t *y = tree_prev(t, x);
+  while (y && node_dead(t, y)) y = tree_prev(t, y);
+  return y;
+}
+
+/*
+intrusive 트리
+
+호출한 쪽이 자기 구조체 안에 node_t를 넣어두고 rbtree_link/rbtree_unlink로 트리에 붙였다 뗀다.
+트리는 노드를 할당하거나 해제하지 않으므로 (delete_rbtree도 노드는 건드리지 않음)
+사용자 정의 allocator나 고정 크기 풀에 든 객체도 그대로 넣을 수 있다.
+바깥 구조체는 rbtree_entry(node, type, member)로 얻는다.
+cmp가 NULL이면 node->key로 정렬하므로 rbtree_find 등 key 기반 함수도 그대로 쓸 수 있다.
+*/
+rbtree *new_rbtree_intrusive(rbtree_cmp_t cmp) {
+  rbtree *t = new_rbtree_flags(RBTREE_INTRUSIVE);
+  if (t) t->cmp = cmp;
+  return t;
+}
+
+// intrusive 트리의 순서 비교 (a < b이면 참)
+static int node_less(const rbtree *t, const node_t *a, const node_t *b) {
+  return t->cmp ? t->cmp(a, b) < 0 : a->key < b->key;
+}
+
+// node를 트리에 붙인다. 같은 값은 기존 노드들의 오른쪽으로 들어간다. (multiset)
+void rbtree_link(rbtree *t, node_t *node) {
+  if (!t || !node) return;
+  node_t *parent = t->nil;
+  node_t *tmp = t->root;
+  int left = 0;
+  while (tmp != t->nil) {
+    parent = tmp;
+    left = node_less(t, node, tmp);
+    tmp = left ? tmp->left : tmp->right;
+  }
+  link_at(t, parent, node, left);
+}
+
+// node를 트리에서 떼어낸다. node의 메모리는 호출한 쪽이 관리한다.
+void rbtree_unlink(rbtree *t, node_t *node) {
+  if (!t || !node || node == t->nil) return;
+  erase_unlink(t, node);
+}
+
+// probe와 같은 순서 값을 가진 노드를 찾는다. (없으면 NULL)
+node_t *rbtree_lookup(const rbtree *t, const node_t *probe) {
+  if (!t || !probe) return NULL;
+  node_t *tmp = t->root;
+  while (tmp != t->nil) {
+    if (node_less(t, tmp, probe)) {
+      tmp = tmp->right;
+    } else if (node_less(t, probe, tmp)) {
+      tmp = tmp->left;
+    } else {
+      return tmp;
+    }
+  }
+  return NULL;
+}
+
+// 서브트리 요약을 아래에서부터 다시 계산 (후위순회)
+static void aug_rebuild(rbtree *t, node_t *x) {
+  if (x == t->nil) return;
+  aug_rebuild(t, x->left);
+  aug_rebuild(t, x->right);
+  t->aug->update(x, t->nil);
+}
+
+// intrusive 트리에 증강 콜백을 등록하고 현재 노드들의 요약을 모두 계산한다.
+// 이후 link/unlink의 회전, 이식, fixup을 거쳐도 요약이 항상 맞게 유지된다.
+// intrusive 트리가 아니면 -1 (요약을 둘 곳이 없음)
+int rbtree_set_augment(rbtree *t, const rbtree_augment_t *aug) {
+  if (!t || !(t->flags & RBTREE_INTRUSIVE)) return -1;
+  t->aug = aug;
+  if (aug) aug_rebuild(t, t->root);
+  return 0;
+}
+
+// lo <= 노드 <= hi인 노드들의 요약을 acc에 누적한다. (O(log n))
+// acc는 호출한 쪽이 항등원으로 초기화해서 넘긴다.
+void rbtree_range_aggregate(const rbtree *t, const node_t *lo, const node_t *hi,
+  void *acc) {
+  if (!t || !t->aug || !lo || !hi) return;
+  const rbtree_augment_t *aug = t->aug;
+
+  // 1) 범위 안에 들어오는 가장 위의 노드(경로가 갈라지는 지점) 찾기
+  node_t *x = t->root;
+  while (x != t->nil) {
+    if (node_less(t, x, lo)) {
+      x = x->right;
+    } else if (node_less(t, hi, x)) {
+      x = x->left;
+    } else {
+      break;
+    }
+  }
+  if (x == t->nil) return;
+  aug->add_node(acc, x);
+
+  // 2) 왼쪽 경계: lo 이상인 노드를 만나면 그 오른쪽 서브트리는 통째로 범위 안
+  for (node_t *y = x->left; y != t->nil;) {
+    if (node_less(t, y, lo)) {
+      y = y->right;
+    } else {
+      aug->add_node(acc, y);
+      if (y->right != t->nil) aug->add_subtree(acc, y->right);
+      y = y->left;
+    }
+  }
+  // 3) 오른쪽 경계: hi 이하인 노드를 만나면 그 왼쪽 서브트리는 통째로 범위 안
+  for (node_t *y = x->right; y != t->nil;) {
+    if (node_less(t, hi, y)) {
+      y = y->left;
+    } else {
+      aug->add_node(acc, y);
+      if (y->left != t->nil) aug->add_subtree(acc, y->left);
+      y = y->right;
+    }
+  }
+}
+
+/*
+interval 트리
+
+시작점(link.key)으로 정렬한 intrusive 트리에 증강 콜백으로 서브트리의 최대 끝점(max_end)을 유지한다.
+구간은 rbtree_interval을 바깥 구조체에 넣고 rbtree_link/rbtree_unlink로 넣고 뺀다.
+[lo, hi]와 겹치는 구간 찾기는 max_end < lo인 서브트리와 시작점 > hi인 오른쪽 서브트리를
+건너뛰므로, 내려가는 서브트리에는 항상 답이 있거나 경계 경로 위에 있다. (출력 크기에 비례)
+*/
+static key_t iv_max_end(const node_t *n) {
+  return rbtree_entry(n, rbtree_interval, link)->max_end;
+}
+
+static void iv_update(node_t *n, const node_t *nil) {
+  rbtree_interval *iv = rbtree_entry(n, rbtree_interval, link);
+  key_t m = iv->end;
+  if (n->left != nil && iv_max_end(n->left) > m) m = iv_max_end(n->left);
+  if (n->right != nil && iv_max_end(n->right) > m) m = iv_max_end(n->right);
+  iv->max_end = m;
+}
+
+// rbtree_range_aggregate에서는 시작점이 [lo, hi]인 구간들의 최대 끝점을 구한다. (acc는 key_t)
+static void iv_add_node(void *acc, const node_t *n) {
+  key_t end = rbtree_entry(n, rbtree_interval, link)->end;
+  if (end > *(key_t *)acc) *(key_t *)acc = end;
+}
+
+static void iv_add_subtree(void *acc, const node_t *n) {
+  key_t m = rbtree_entry(n, rbtree_interval, link)->max_end;
+  if (m > *(key_t *)acc) *(key_t *)acc = m;
+}
+
+static const rbtree_augment_t interval_aug = {
+  iv_update, iv_add_node, iv_add_subtree,
+};
+
+rbtree *new_rbtree_interval(void) {
+  rbtree *t = new_rbtree_intrusive(NULL);
+  if (t) rbtree_set_augment(t, &interval_aug);
+  return t;
+}
+
+void rbtree_interval_init(rbtree_interval *iv, key_t start, key_t end) {
+  iv->link.key = start;
+  iv->end = end;
+  iv->max_end = end;
+}
+
+static void iv_collect(const rbtree *t, node_t *x, key_t lo, key_t hi,
+  rbtree_interval **out, size_t max, size_t *cnt) {
+  // 서브트리의 모든 끝점이 lo보다 작으면 겹칠 수 없다.
+  while (x != t->nil && *cnt < max && iv_max_end(x) >= lo) {
+    iv_collect(t, x->left, lo, hi, out, max, cnt);
+    if (x->key > hi || *cnt >= max) return; // 오른쪽은 시작점이 더 크므로 볼 필요 없음
+    rbtree_interval *iv = rbtree_entry(x, rbtree_interval, link);
+    if (iv->end >= lo) out[(*cnt)++] = iv;
+    x = x->right;
+  }
+}
+
+// [lo, hi]와 겹치는 구간을 시작점 순서로 최대 max개까지 out에 담고 개수를 반환
+size_t rbtree_interval_overlaps(const rbtree *t, key_t lo, key_t hi,
+  rbtree_interval **out, size_t max) {
+  if (!t || t->aug != &interval_aug || !out || lo > hi) return 0;
+  size_t cnt = 0;
+  iv_collect(t, t->root, lo, hi, out, max, &cnt);
+  return cnt;
+}
+
+// point를 포함하는 구간들 (stabbing query)
+size_t rbtree_interval_stab(const rbtree *t, key_t point,
+  rbtree_interval **out, size_t max) {
+  return rbtree_interval_overlaps(t, point, point, out, max);
+}
+
+/*
+바이트 문자열 key 트리
+
+key_t 대신 길이가 제각각인 바이트 문자열(경로, tenant ID 등)을 memcmp 순서로 정렬한다. (앞부분이 같으면 짧은 쪽이 작다)
+노드(rbtree_str)는 key 앞 8바이트를 big-endian 정수로 읽은 prefix를 들고 있어서
+하강 중 비교는 대부분 정수 비교 하나로 끝나고, prefix가 같고 두 key가 모두 8바이트보다 길 때만 9번째 바이트부터 memcmp 한다.
+8바이트 이하 key는 노드 안에 통째로 들어가고, 더 긴 key는 노드와 한 번에 할당한 꼬리에 복사한다. (노드 하나가 64바이트)
+순서를 cmp로 정하는 intrusive 트리 위에 얹었으므로 rbtree_min/max/next/prev가 그대로 동작하고,
+노드는 트리가 할당하므로 delete_rbtree가 함께 해제한다.
+*/
+
+#define STR(n) rbtree_entry(n, rbtree_str, link)
+
+static uint64_t str_prefix(const unsigned char *b, size_t len) {
+  uint64_t p = 0;
+  if (len >= 8) {
+    memcpy(&p, b, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    p = __builtin_bswap64(p);
+#endif
+    return p;
+  }
+  for (size_t i = 0; i < 8; i++) {
+    p = (p << 8) | (i < len ? b[i] : 0); // 모자란 바이트는 0으로 채운다.
+  }
+  return p;
+}
+
+// (prefix, len, a)인 key와 노드 b의 순서: a < b이면 음수, 같으면 0, a > b이면 양수
+RB_INLINE int str_order(uint64_t prefix, size_t len, const unsigned char *a,
+  const rbtree_str *b) {
+  if (prefix != b->prefix) return prefix < b->prefix ? -1 : 1;
+  // 앞 8바이트가 같으므로 짧은 key가 8바이트 이하이면 길이만 비교하면 된다.
+  const size_t m = len < b->len ? len : b->len;
+  if (m > RBTREE_STR_INLINE) {
+    const int c = memcmp(a + 8, b->bytes.ptr + 8, m - 8);
+    if (c) return c;
+  }
+  return (len > b->len) - (len < b->len);
+}
+
+static int str_node_cmp(const node_t *a, const node_t *b) {
+  const rbtree_str *x = STR(a);
+  return str_order(x->prefix, x->len, rbtree_str_bytes(x), STR(b));
+}
+
+static int is_str(const rbtree *t) {
+  return t && t->cmp == str_node_cmp;
+}
+
+static void str_free_subtree(rbtree *t, node_t *n) {
+  if (n == t->nil) return;
+  str_free_subtree(t, n->left);
+  str_free_subtree(t, n->right);
+  free(STR(n));
+}
+
+rbtree *new_rbtree_str(void) {
+  return new_rbtree_intrusive(str_node_cmp);
+}
+
+// key와 같은 노드 (없으면 NULL)
+rbtree_str *rbtree_str_find(const rbtree *t, const void *key, size_t len) {
+  if (!is_str(t) || (!key && len)) return NULL;
+  const uint64_t prefix = str_prefix(key, len);
+  node_t *x = t->root;
+  while (x != t->nil) {
+    const int c = str_order(prefix, len, key, STR(x));
+    if (c == 0) return STR(x);
+    x = (c < 0) ? x->left : x->right;
+  }
+  return NULL;
+}
+
+// key를 복사한 노드를 넣는다. 이미 있으면 그 노드를 반환하고 *existed = 1 (집합)
+rbtree_str *rbtree_str_insert(rbtree *t, const void *key, size_t len,
+  int *existed) {
+  if (existed) *existed = 0;
+  if (!is_str(t) || (!key && len)) return NULL;
+  const uint64_t prefix = str_prefix(key, len);
+  node_t *parent = t->nil;
+  node_t *x = t->root;
+  int c = 0;
+  while (x != t->nil) {
+    c = str_order(prefix, len, key, STR(x));
+    if (c == 0) {
+      if (existed) *existed = 1;
+      return STR(x);
+    }
+    parent = x;
+    x = (c < 0) ? x->left : x->right;
+  }
+
+  const size_t tail = len > RBTREE_STR_INLINE ? len : 0;
+  rbtree_str *s = malloc(sizeof(*s) + tail);
+  if (!s) return NULL;
+  s->prefix = prefix;
+  s->len = len;
+  if (tail) {
+    memcpy(s + 1, key, len);
+    s->bytes.ptr = (const unsigned char *)(s + 1);
+  } else {
+    memset(s->bytes.inl, 0, sizeof(s->bytes.inl));
+    if (len) memcpy(s->bytes.inl, key, len);
+  }
+  s->link.key = 0;
+  link_at(t, parent, &s->link, c < 0);
+  return s;
+}
+
+// key를 가진 노드를 지우고 해제한다. 지웠으면 1, 없으면 0
+int rbtree_str_erase(rbtree *t, const void *key, size_t len) {
+  rbtree_str *s = rbtree_str_find(t, key, len);
+  if (!s) return 0;
+  erase_unlink(t, &s->link);
+  free(s);
+  return 1;
+}
+
+static void inorder(const rbtree *t, const node_t *x, 
+  key_t *arr, const size_t n, size_t *idx) {
+  if (x == t->nil || *idx >= n) return;
+
+  inorder(t, x->left, arr, n, idx);
+  // counted 노드는 count만큼 펼쳐서 기록
+  for (size_t c = 0; c < node_count(t, x) && *idx < n; c++) {
+    arr[*idx] = x->key;
+    (*idx)++;
+  }
+  inorder(t, x->right, arr, n, idx);
+}
+
+// 서브트리가 나타내는 key 개수 (counted 노드는 count만큼)
+// limit개 이상인 것이 확인되면 더 세지 않으므로 O(limit + 높이)
+static size_t subtree_keys(const rbtree *t, const node_t *x, const size_t limit) {
+  size_t cnt = 0;
+  while (x != t->nil && cnt < limit) {
+    cnt += subtree_keys(t, x->left, limit - cnt) + node_count(t, x);
+    x = x->right;
+  }
+  return cnt;
+}
+
+// 트리 크기와 n 중 작은 쪽이 이보다 작으면 스레드를 띄우는 비용이 더 커서 순차로 처리
+#define PAR_EXPORT_MIN (1u << 16)
+// 스레드당 잘라낼 서브트리 수 (부하 분산용)
+#define PAR_PIECES_PER_THREAD 4
+#define PAR_MAX_THREADS 64
+
+// 병렬 export에서 잘라낸 조각: 위쪽 노드 하나(subtree == 0) 또는 서브트리 전체
+typedef struct {
+  const node_t *x;
+  int subtree;
+  size_t keys;  // 조각의 key 수
+  size_t off;   // 출력 배열에서의 시작 위치
+} export_piece_t;
+
+typedef struct {
+  const rbtree *t;
+  key_t *arr;
+  size_t n;
+  export_piece_t *pieces;
+  size_t npieces;
+  atomic_size_t next;  // 다음에 처리할 조각 번호
+  int fill;            // 0: 개수 세기 단계, 1: 채우기 단계
+} export_job_t;
+
+// 위쪽 depth 단계의 노드는 단일 노드 조각으로, 그 아래는 서브트리 조각으로 중위 순서대로 자른다.
+static void export_split(const rbtree *t, const node_t *x, int depth,
+  export_piece_t *pieces, size_t *np) {
+  if (x == t->nil) return;
+  if (depth == 0) {
+    pieces[(*np)++] = (export_piece_t){x, 1, 0, 0};
+    return;
+  }
+  export_split(t, x->left, depth - 1, pieces, np);
+  pieces[(*np)++] = (export_piece_t){x, 0, node_count(t, x), 0};
+  export_split(t, x->right, depth - 1, pieces, np);
+}
+
+static void *export_worker(void *arg) {
+  export_job_t *job = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->npieces) {
+    export_piece_t *pc = &job->pieces[i];
+    if (!pc->subtree) continue;
+    if (!job->fill) {
+      pc->keys = subtree_keys(job->t, pc->x, SIZE_MAX);
+    } else if (pc->off < job->n) {
+      size_t idx = pc->off;
+      inorder(job->t, pc->x, job->arr, job->n, &idx);
+    }
+  }
+  return NULL;
+}
+
+// fn을 nthreads개 스레드(0번은 호출 스레드)에서 실행하고 모두 끝날 때까지 기다린다.
+// i번 스레드는 args + i * stride를 인자로 받는다. (stride가 0이면 모두 같은 인자)
+static void par_run(int nthreads, void *(*fn)(void *), void *args,
+  size_t stride) {
+  pthread_t tid[PAR_MAX_THREADS];
+  int started[PAR_MAX_THREADS] = {0};
+  for (int i = 1; i < nthreads; i++) {
+    started[i] = pthread_create(&tid[i], NULL, fn, (char *)args + i * stride) == 0;
+  }
+  fn(args);
+  for (int i = 1; i < nthreads; i++) {
+    if (started[i]) {
+      pthread_join(tid[i], NULL);
+    } else {
+      fn((char *)args + i * stride);  // 스레드를 못 띄웠으면 직접 처리
+    }
+  }
+}
+
+// nthreads <= 0이면 온라인 코어 수로 바꾸고 상한을 적용
+static int par_threads(int nthreads) {
+  if (nthreads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus > 0 ? (int)cpus : 1;
+  }
+  return nthreads > PAR_MAX_THREADS ? PAR_MAX_THREADS : nthreads;
+}
+
+// 작업자 nthreads개(호출 스레드 포함)로 모든 조각을 한 번 처리
+static void export_run(export_job_t *job, int nthreads) {
+  atomic_store(&job->next, 0);
+  par_run(nthreads, export_worker, job, 0);
+}
+
+// 트리를 서로 겹치지 않는 서브트리들로 잘라 여러 스레드가 동시에 배열을 채운다.
+// 1) 서브트리별 key 수를 병렬로 세고 2) prefix sum으로 출력 위치를 정한 뒤 3) 병렬로 채움
+// n보다 뒤에 놓일 조각은 건너뛰므로 n개까지만 쓰는 기존 의미를 그대로 지킨다.
+// 트리보다 짧은 앞부분만 원하면 조각을 순서대로 세다가 n개에 닿으면 멈춘다. (O(n + 조각 수 * 높이))
+// nthreads <= 0이면 온라인 코어 수를 쓰고, 작은 입력은 순차로 처리한다. 기록한 key 수를 반환
+// (쓰기 버퍼가 있으면 트리 쪽을 채운 뒤 버퍼의 key를 합쳐 넣는다)
+size_t rbtree_to_array_parallel(const rbtree *t, key_t *arr, const size_t n,
+  int nthreads) {
+  if (t == NULL || arr == NULL || n == 0) return 0;
+  const size_t len = tree_to_array(t, arr, n, nthreads);
+  return t->wbuf ? wbuf_merge_array(t, arr, n, len) : len;
+}
+
+static size_t tree_to_array(const rbtree *t, key_t *arr, const size_t n,
+  int nthreads) {
+
+  if (t->btree) return bt_to_array(t, arr, n);
+  if (t->conc) return cn_to_array(t, arr, n);
+
+  size_t idx = 0;
+  if (small_inline(t)) {
+    for (int i = 0; i < t->small->n; i++) {
+      for (size_t c = 0; c < node_count(t, small_at(t, i)) && idx < n; c++) {
+        arr[idx++] = t->small->keys[i];
+      }
+    }
+    return idx;
+  }
+
+  nthreads = par_threads(nthreads);
+  if (nthreads == 1 || (n < t->size ? n : t->size) < PAR_EXPORT_MIN) {
+    inorder(t, t->root, arr, n, &idx);
+    return idx;
+  }
+
+  // 조각 수가 스레드 수 * PAR_PIECES_PER_THREAD 이상이 되는 깊이에서 자른다.
+  int depth = 0;
+  while ((1u << depth) < (unsigned)nthreads * PAR_PIECES_PER_THREAD) depth++;
+  export_piece_t *pieces = malloc(sizeof(*pieces) << (depth + 1));
+  if (!pieces) {
+    inorder(t, t->root, arr, n, &idx);
+    return idx;
+  }
+
+  export_job_t job = {.t = t, .arr = arr, .n = n, .pieces = pieces};
+  export_split(t, t->root, depth, pieces, &job.npieces);
+
+  // 트리 전체가 들어가면 모든 조각을 병렬로 세고, 앞부분만이면 아래에서 필요한 조각만 센다.
+  const int whole = t->size <= n;
+  if (whole) {
+    job.fill = 0;
+    export_run(&job, nthreads);
+  }
+
+  size_t off = 0;
+  for (size_t i = 0; i < job.npieces; i++) {
+    pieces[i].off = off;
+    if (off >= n) continue; // 채우기 단계에서도 건너뛴다.
+    if (!whole && pieces[i].subtree) {
+      pieces[i].keys = subtree_keys(t, pieces[i].x, n - off);
+    }
+    off += pieces[i].keys;
+    // 위쪽 노드 조각은 개수가 적으므로 호출 스레드가 직접 기록
+    if (!pieces[i].subtree) {
+      for (size_t c = pieces[i].off; c < off && c < n; c++) {
+        arr[c] = pieces[i].x->key;
+      }
+    }
+  }
+
+  job.fill = 1;
+  export_run(&job, nthreads);
+
+  free(pieces);
+  return off < n ? off : n;
+}
+
+// 기록한 key 수를 반환 (호출 스레드에서 순차로 채운다. 여러 스레드는 rbtree_to_array_parallel)
+int rbtree_to_array(const rbtree *t, key_t *arr, const size_t n) {
+  return (int)rbtree_to_array_parallel(t, arr, n, 1);
+}
+
+/*
+병렬 bulk build
+
+rbtree_build_parallel은 정렬되지 않은 key 배열로 트리를 한 번에 만든다.
+1) key를 병렬 LSD radix sort로 정렬 (8비트씩 4번, 스레드별 히스토그램 → prefix sum → 분산)
+2) 정렬된 배열의 가운데를 루트로 재귀적으로 나누어 균형 트리를 만든다.
+   노드는 하나의 chunk에 정렬 순서대로 놓이므로(i번째 key → nodes[i]) 각 스레드는
+   자기 구간의 노드만 채우면 되고 할당 경합이 없다.
+가운데로 나누면 nil까지의 깊이가 D 또는 D+1 (D = floor(log2(n+1)))뿐이므로
+깊이 D의 노드만 빨간색, 나머지는 검은색으로 칠하면 모든 경로의 흑색 높이가 D로 같아진다.
+*/
+
+// 입력이 이보다 작으면 정렬/구성을 순차로 처리
+#define PAR_BUILD_MIN (1u << 15)
+
+typedef struct {
+  const uint32_t *src;
+  uint32_t *dst;
+  size_t lo, hi;       // 이 스레드가 맡은 구간
+  int shift;           // 이번 pass의 자리 (0, 8, 16, 24)
+  size_t hist[256];    // 구간 안의 자리값별 개수 → 분산 단계에선 시작 위치
+} radix_part_t;
+
+static void *radix_count(void *arg) {
+  radix_part_t *p = arg;
+  memset(p->hist, 0, sizeof(p->hist));
+  for (size_t i = p->lo; i < p->hi; i++) {
+    p->hist[(p->src[i] >> p->shift) & 0xff]++;
+  }
+  return NULL;
+}
+
+static void *radix_scatter(void *arg) {
+  radix_part_t *p = arg;
+  for (size_t i = p->lo; i < p->hi; i++) {
+    uint32_t v = p->src[i];
+    p->dst[p->hist[(v >> p->shift) & 0xff]++] = v;
+  }
+  return NULL;
+}
+
+// buf[0..n)을 정렬한다. tmp는 같은 크기의 작업 공간. 결과는 buf에 남는다.
+static void radix_sort_parallel(uint32_t *buf, uint32_t *tmp, size_t n,
+  int nthreads) {
+  radix_part_t one;
+  radix_part_t *parts = (nthreads > 1) ? malloc(sizeof(*parts) * nthreads) : NULL;
+  if (!parts) {
+    nthreads = 1;
+    parts = &one;
+  }
+
+  uint32_t *src = buf, *dst = tmp;
+  for (int shift = 0; shift < 32; shift += 8) {
+    for (int i = 0; i < nthreads; i++) {
+      parts[i].src = src;
+      parts[i].dst = dst;
+      parts[i].lo = n * i / nthreads;
+      parts[i].hi = n * (i + 1) / nthreads;
+      parts[i].shift = shift;
+    }
+    par_run(nthreads, radix_count, parts, sizeof(*parts));
+
+    // 자리값 순서 → 스레드 순서로 시작 위치를 매겨야 안정 정렬이 된다.
+    size_t off = 0;
+    for (int d = 0; d < 256; d++) {
+      for (int i = 0; i < nthreads; i++) {
+        size_t cnt = parts[i].hist[d];
+        parts[i].hist[d] = off;
+        off += cnt;
+      }
+    }
+    par_run(nthreads, radix_scatter, parts, sizeof(*parts));
+
+    uint32_t *sw = src;
+    src = dst;
+    dst = sw;
+  }
+  // pass가 짝수 번이므로 결과는 다시 buf에 있다.
+
+  if (parts != &one) free(parts);
+}
+
+typedef struct {
+  const rbtree *t;
+  node_t *nodes;       // 정렬 순서대로 놓인 노드 배열
+  const uint32_t *keys;
+  int red_depth;       // 이 깊이의 노드만 빨간색 (없으면 -1)
+} build_ctx_t;
+
+typedef struct {
+  const build_ctx_t *ctx;
+  size_t lo, hi;
+  int depth;
+  node_t *parent;
+} build_task_t;
+
+// 구간 [lo, hi)의 가운데 노드를 서브트리 루트로 (빈 구간이면 nil)
+// 구간 [lo, hi)의 가운데 노드 색. rank 정책이면 구간 크기로 정해지는 서브트리 높이
+static color_t build_color(const build_ctx_t *ctx, int depth, size_t size) {
+#if RBTREE_BALANCE == RBTREE_BALANCE_RB
+  (void)size;
+  return (depth == ctx->red_depth) ? RBTREE_RED : RBTREE_BLACK;
+#else
+  (void)ctx;
+  (void)depth;
+  return (color_t)(RBTREE_BLACK + 64 - __builtin_clzll(size));
+#endif
+}
+
+static node_t *build_root(const build_ctx_t *ctx, size_t lo, size_t hi) {
+  return lo < hi ? &ctx->nodes[lo + (hi - lo) / 2] : ctx->t->nil;
+}
+
+static void build_range(const build_ctx_t *ctx, size_t lo, size_t hi,
+  int depth, node_t *parent) {
+  if (lo >= hi) return;
+  size_t mid = lo + (hi - lo) / 2;
+  node_t *x = &ctx->nodes[mid];
+  x->key = (key_t)(ctx->keys[mid] ^ 0x80000000u);
+  x->color = build_color(ctx, depth, hi - lo);
+  x->parent = parent;
+  x->left = build_root(ctx, lo, mid);
+  x->right = build_root(ctx, mid + 1, hi);
+  build_range(ctx, lo, mid, depth + 1, x);
+  build_range(ctx, mid + 1, hi, depth + 1, x);
+}
+
+typedef struct {
+  build_task_t *tasks;
+  size_t ntasks;
+  atomic_size_t next;
+} build_job_t;
+
+static void *build_worker(void *arg) {
+  build_job_t *job = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->ntasks) {
+    build_task_t *tk = &job->tasks[i];
+    build_range(tk->ctx, tk->lo, tk->hi, tk->depth, tk->parent);
+  }
+  return NULL;
+}
+
+// 위쪽 split_depth 단계까지는 직접 만들고, 그 아래 서브트리는 작업으로 넘긴다.
+static void build_split(const build_ctx_t *ctx, size_t lo, size_t hi,
+  int depth, int split_depth, node_t *parent, build_job_t *job) {
+  if (lo >= hi) return;
+  if (depth == split_depth) {
+    job->tasks[job->ntasks++] = (build_task_t){ctx, lo, hi, depth, parent};
+    return;
+  }
+  size_t mid = lo + (hi - lo) / 2;
+  node_t *x = &ctx->nodes[mid];
+  x->key = (key_t)(ctx->keys[mid] ^ 0x80000000u);
+  x->color = build_color(ctx, depth, hi - lo);
+  x->parent = parent;
+  x->left = build_root(ctx, lo, mid);
+  x->right = build_root(ctx, mid + 1, hi);
+  build_split(ctx, lo, mid, depth + 1, split_depth, x, job);
+  build_split(ctx, mid + 1, hi, depth + 1, split_depth, x, job);
+}
+
+// 정렬되지 않은 keys[0..n)으로 트리를 만든다. (multiset, 중복 key는 각각 노드가 됨)
+// nthreads <= 0이면 온라인 코어 수를 쓴다. 노드는 arena chunk 하나에 정렬 순서대로 놓인다.
+rbtree *rbtree_build_parallel(const key_t *keys, size_t n, int nthreads) {
+  rbtree *t = new_rbtree();
+  if (!t || n == 0) return t;
+  if (!keys) {
+    delete_rbtree(t);
+    return NULL;
+  }
+  nthreads = par_threads(nthreads);
+  if (n < PAR_BUILD_MIN) nthreads = 1;
+
+  uint32_t *buf = malloc(n * sizeof(*buf));
+  uint32_t *tmp = malloc(n * sizeof(*tmp));
+  node_chunk *c = (buf && tmp) ? arena_reserve(t, n) : NULL;
+  if (!c) {
+    free(buf);
+    free(tmp);
+    delete_rbtree(t);
+    return NULL;
+  }
+  c->used = n;
+
+  // 부호 비트를 뒤집으면 int 순서와 unsigned 순서가 같아진다.
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = (uint32_t)keys[i] ^ 0x80000000u;
+  }
+  radix_sort_parallel(buf, tmp, n, nthreads);
+  free(tmp);
+
+  int full_depth = 0;  // floor(log2(n+1))
+  while (((size_t)2 << full_depth) <= n + 1) full_depth++;
+  build_ctx_t ctx = {
+    .t = t,
+    .nodes = c->nodes,
+    .keys = buf,
+    .red_depth = (((n + 1) & n) == 0) ? -1 : full_depth,
+  };
+
+  if (nthreads == 1) {
+    build_range(&ctx, 0, n, 0, t->nil);
+  } else {
+    int split_depth = 0;
+    while ((1u << split_depth) < (unsigned)nthreads * PAR_PIECES_PER_THREAD) {
+      split_depth++;
+    }
+    build_job_t job = {.tasks = malloc(sizeof(build_task_t) << split_depth)};
+    if (!job.tasks) {
+      build_range(&ctx, 0, n, 0, t->nil);
+    } else {
+      build_split(&ctx, 0, n, 0, split_depth, t->nil, &job);
+      atomic_store(&job.next, 0);
+      par_run(nthreads, build_worker, &job, 0);
+      free(job.tasks);
+    }
+  }
+  free(buf);
+
+  t->root = build_root(&ctx, 0, n);
+  t->max = &c->nodes[n - 1];
+  t->size = n;
+  return t;
+}
+
+/*
+지연 삭제 (RBTREE_LAZY)
+
+erase는 노드의 count를 0으로 만들어 tombstone으로 표시만 하고 회전이나 fixup은 하지 않는다.
+find/min/max/next/prev/to_array는 tombstone을 건너뛰고, 같은 key를 다시 넣으면 그 노드가 되살아난다.
+(그래서 RBTREE_LAZY는 항상 RBTREE_COUNTED로 동작한다)
+정리는 기본으로 호출한 쪽이 원하는 때에 한다. (erase가 정리하느라 멈추는 일은 없다)
+- rbtree_purge는 살아있는 노드를 중위 순서로 엮은 뒤 병렬 build와 같은 모양의 균형 트리로 다시 건다.
+  O(n)이라 큰 트리에서는 한 번의 멈춤이 길다.
+- rbtree_purge_step(t, budget)은 지난번에 멈춘 key부터 노드를 budget개만 보며 tombstone을 하나씩 떼어낸다.
+  (보통 erase와 같은 O(log n) 제거) 요청 사이사이나 쉬는 시간에 조금씩 돌리면 된다.
+- rbtree_set_purge_share로 기준(tombstone이 노드의 percent%)을 주면 그 기준을 넘긴 erase가 rbtree_purge를 부른다.
+  O(n)이지만 tombstone 수에 비례하는 만큼만 일어나므로 erase 하나당 상수 비용이다. (대신 그 erase는 오래 걸린다)
+어느 쪽이든 노드를 새로 할당하지 않으므로 살아있는 노드의 포인터는 그대로 유효하다.
+*/
+
+// x 서브트리의 살아있는 노드를 right로 엮어 *tail 뒤에 붙이고 tombstone은 해제한다.
+static void purge_flatten(rbtree *t, node_t *x, node_t **tail, size_t *freed) {
+  while (x != t->nil) {
+    node_t *r = x->right;
+    purge_flatten(t, x->left, tail, freed);
+    if (NODE_COUNT(x)) {
+      (*tail)->right = x;
+      *tail = x;
+    } else {
+      if (t->filter) filter_remove(t, x->key);
+      node_free(t, x);
+      (*freed)++;
+    }
+    x = r;
+  }
+}
+
+// 목록 앞의 m개 노드로 build_range와 같은 모양(가운데가 루트)의 서브트리를 만든다.
+static node_t *purge_build(rbtree *t, const build_ctx_t *ctx, node_t **list,
+  size_t m, int depth, node_t *parent) {
+  if (m == 0) return t->nil;
+  node_t *left = purge_build(t, ctx, list, m / 2, depth + 1, NULL);
+  node_t *x = *list;
+  *list = x->right;
+  x->parent = parent;
+  x->left = left;
+  if (left != t->nil) left->parent = x;
+  x->right = purge_build(t, ctx, list, m - m / 2 - 1, depth + 1, x);
+  x->color = build_color(ctx, depth, m);
+  return x;
+}
+
+// tombstone을 모두 빼고 트리를 다시 균형 있게 만든다. 뺀 노드 수를 반환
+size_t rbtree_purge(rbtree *t) {
+  if (!t || t->tombstones == 0) return 0;
+  node_t head = {.right = t->nil};
+  node_t *tail = &head;
+  size_t freed = 0;
+  purge_flatten(t, t->root, &tail, &freed);
+  tail->right = t->nil;
+
+  const size_t m = t->size - freed;
+  int full_depth = 0;  // floor(log2(m+1))
+  while (((size_t)2 << full_depth) <= m + 1) full_depth++;
+  const build_ctx_t ctx = {
+    .t = t,
+    .red_depth = (((m + 1) & m) == 0) ? -1 : full_depth,
+  };
+  node_t *list = head.right;
+  t->root = purge_build(t, &ctx, &list, m, 0, t->nil);
+  t->max = (tail == &head) ? t->nil : tail;
+  t->size = m;
+  t->tombstones = 0;
+  next_gen(t); // tombstone을 가리키던 finger 무효화
+  return freed;
+}
+
+// 노드를 최대 budget개 보고 그중 tombstone을 떼어낸다. tombstone이 남았으면 1, 없으면 0
+int rbtree_purge_step(rbtree *t, size_t budget) {
+  if (!t || t->tombstones == 0) return 0;
+  // 지난번에 본 key 다음부터 (처음이거나 끝까지 봤으면 최소 노드부터)
+  node_t *x = t->root, *from = NULL;
+  while (x != t->nil) {
+    if (!t->purge_resume || x->key > t->purge_from) {
+      from = x;
+      x = x->left;
+    } else {
+      x = x->right;
+    }
+  }
+  size_t freed = 0;
+  for (size_t i = 0; from && i < budget; i++) {
+    node_t *next = tree_next(t, from); // 떼어내도 다른 노드의 주소는 그대로다.
+    t->purge_from = from->key;
+    if (NODE_COUNT(from) == 0) {
+      erase_unlink(t, from);
+      node_free(t, from);
+      freed++;
+    }
+    from = next;
+  }
+  t->purge_resume = from != NULL;
+  t->tombstones -= freed;
+  if (freed) next_gen(t); // tombstone을 가리키던 finger 무효화
+  return t->tombstones > 0;
+}
+
+// 자동 정리 기준 (tombstone이 노드의 percent%를 넘으면). 기본은 0으로, 자동 정리를 하지 않는다.
+void rbtree_set_purge_share(rbtree *t, unsigned percent) {
+  if (t) t->purge_share = percent;
+}
+
+static void lazy_erase(rbtree *t, node_t *z) {
+  if (NODE_COUNT(z) == 0) return; // 이미 지운 노드
+  NODE_COUNT(z) = 0;
+  t->tombstones++;
+  if (t->purge_share && t->tombstones * 100 > t->size * t->purge_share) {
+    rbtree_purge(t);
+  }
+}
+
+// counted 모드에서 이미 있는 key를 다시 넣을 때. tombstone이면 되살린다.
+static node_t *count_up(rbtree *t, node_t *dup) {
+  if (NODE_COUNT(dup)++ == 0) t->tombstones--;
+  return dup;
+}
+
+/*
+persistent(경로 복사) 모드
+
+RBTREE_PERSISTENT 트리에서는 한 번 공개된 노드를 절대 수정하지 않는다.
+insert/erase는 루트에서 바뀌는 노드까지의 경로(그리고 fixup에서 색이나 자식이 바뀌는 형제/조카)만
+새 노드로 복사해서 새 루트를 만들고, 이 루트를 새 버전으로 공개한다.
+바뀌지 않은 서브트리는 이전 버전과 그대로 공유된다.
+
+- 여러 버전이 한 노드를 공유하므로 parent 포인터는 의미가 없다. (공개된 노드는 항상 nil)
+  대신 연산 중에는 아직 공개하지 않은 노드의 parent를 "이번 연산에서 새로 만든 노드" 표시로 쓴다.
+  공개된 노드는 어떤 필드도 다시 쓰지 않으므로, 버전에서 빠진 노드(retired)는 버전의 배열에 모은다.
+- fixup은 parent 대신 루트부터 내려온 경로 스택을 따라 올라간다.
+- 각 버전은 참조 카운트를 가진다. 어떤 버전 v에서 다음 버전으로 넘어가며 빠진 노드는
+  v 이하의 버전에서만 보이므로, 가장 오래된 버전부터 차례로 참조가 0이 되면 함께 해제한다.
+- 쓰기(insert/erase)는 한 번에 하나의 스레드만 해야 한다.
+  rbtree_snapshot으로 얻은 뷰는 불변이므로 락 없이 rbtree_find/min/max/next/prev/to_array로 읽을 수 있다.
+- 현재 버전은 atomic으로 공개하고 참조 카운트도 atomic으로 올리고 내리므로 rbtree_snapshot은 락을 잡지 않는다.
+  스냅샷을 얻는 중인 스레드 수(entering)가 0일 때만 버전을 해제해서, 현재 버전을 읽은 직후
+  참조를 올리기 전에 그 버전이 해제되는 일이 없게 한다. 락은 버전 목록을 회수하는 쪽(쓰기, 마지막 반납)만 잡는다.
+*/
+
+// 경로 스택 크기: RB 트리 높이는 2*log2(n+1) 이하
+#define PPATH_MAX 128
+// 한 연산에서 새로 만드는 노드 수의 상한 (경로 + fixup의 형제/조카)
+#define PFRESH_MAX (PPATH_MAX * 3)
+
+typedef struct pversion {
+  rbtree view;            // 이 버전의 읽기 전용 뷰 (반드시 첫 멤버)
+  atomic_long refs;       // 트리(최신 버전일 때) + 스냅샷 보유자 수
+  node_t **retired;       // 이 버전에는 있지만 다음 버전에는 없는 노드들
+  size_t nretired;
+  struct pversion *next;  // 다음(더 새로운) 버전
+  struct rbtree_pstate *owner;
+} pversion;
+
+struct rbtree_pstate {
+  pthread_mutex_t lock;   // 버전 목록 회수 보호
+  pversion *oldest;
+  _Atomic(pversion *) current;
+  atomic_int entering;    // rbtree_snapshot에서 current를 읽고 참조를 올리는 중인 스레드 수
+  node_t *spare;          // pop_begin이 미리 할당해 둔 노드 (left로 연결, 쓰기 스레드만 접근)
+  size_t nspare;
+};
+
+// 쓰기 연산 하나의 작업 상태
+typedef struct {
+  rbtree *t;
+  node_t *root;                 // 새 버전의 루트
+  node_t **retired;             // 이번 연산으로 빠지는 기존 노드들 (pop_begin에서 need개 확보)
+  size_t nretired;
+  node_t *fresh[PFRESH_MAX];    // 이번 연산에서 만든 노드들 (표시 해제용)
+  size_t nfresh;
+  pversion *v;                  // 공개할 새 버전 (pop_begin에서 미리 할당)
+} pop_t;
+
+// 이번 연산에서 만든 노드의 parent에 넣어두는 표시
+#define PMARK(op) ((node_t *)(op))
+
+static void pversion_init(pversion *v, struct rbtree_pstate *ps,
+  const rbtree *t, node_t *root) {
+  v->view.root = root;
+  v->view.nil = t->nil;
+  v->view.max = t->nil;
+  if (root != t->nil) {
+    node_t *m = root;
+    while (m->right != t->nil) m = m->right;
+    v->view.max = m;
+  }
+  v->view.flags = t->flags & ~RBTREE_FINGER;
+  v->view.gen = t->gen;
+  atomic_init(&v->refs, 1);
+  v->owner = ps;
+}
+
+static pversion *pversion_new(struct rbtree_pstate *ps, const rbtree *t,
+  node_t *root) {
+  pversion *v = calloc(1, sizeof(*v));
+  if (!v) return NULL;
+  pversion_init(v, ps, t, root);
+  return v;
+}
+
+static int pstate_init(rbtree *t) {
+  struct rbtree_pstate *ps = calloc(1, sizeof(*ps));
+  if (!ps) return -1;
+  pversion *v = pversion_new(ps, t, t->root);
+  if (!v) {
+    free(ps);
+    return -1;
+  }
+  pthread_mutex_init(&ps->lock, NULL);
+  ps->oldest = v;
+  atomic_init(&ps->current, v);
+  t->pstate = ps;
+  return 0;
+}
+
+static void free_retired(pversion *v) {
+  for (size_t i = 0; i < v->nretired; i++) free(v->retired[i]);
+  free(v->retired);
+}
+
+// 가장 오래된 버전부터 참조가 0인 버전을 해제 (lock을 잡은 상태에서 호출)
+// 스냅샷을 얻는 중인 스레드가 있으면 옛 current를 읽었을 수 있으므로 다음 기회로 미룬다.
+static void pstate_collect(struct rbtree_pstate *ps) {
+  while (ps->oldest != atomic_load(&ps->current) &&
+         atomic_load(&ps->oldest->refs) == 0 && atomic_load(&ps->entering) == 0) {
+    pversion *v = ps->oldest;
+    ps->oldest = v->next;
+    free_retired(v);
+    free(v);
+  }
+}
+
+static void pstate_destroy(rbtree *t) {
+  struct rbtree_pstate *ps = t->pstate;
+  pversion *v = ps->oldest;
+  while (v) {
+    pversion *next = v->next;
+    free_retired(v);
+    free(v);
+    v = next;
+  }
+  while (ps->spare) {
+    node_t *next = ps->spare->left;
+    free(ps->spare);
+    ps->spare = next;
+  }
+  pthread_mutex_destroy(&ps->lock);
+  free(ps);
+  t->pstate = NULL;
+}
+
+// 쓰기 연산 시작: 새 노드 need개와 새 버전을 트리를 건드리기 전에 미리 확보한다.
+// 할당에 실패하면 -1을 반환하고 트리와 현재 버전은 그대로다. (확보한 노드는 spare에 남겨 다음에 쓴다)
+static int pop_begin(pop_t *op, rbtree *t, size_t need) {
+  struct rbtree_pstate *ps = t->pstate;
+  assert(need <= PFRESH_MAX);
+  while (ps->nspare < need) {
+    node_t *n = malloc(node_bytes(t));
+    if (!n) return -1;
+    n->left = ps->spare;
+    ps->spare = n;
+    ps->nspare++;
+  }
+  // 빠지는 노드는 복사본 하나당 하나뿐이므로 need개면 충분하다.
+  op->v = calloc(1, sizeof(*op->v));
+  op->retired = malloc(need * sizeof(node_t *));
+  if (!op->v || !op->retired) {
+    free(op->v);
+    free(op->retired);
+    return -1;
+  }
+  op->t = t;
+  op->root = t->root;
+  op->nretired = 0;
+  op->nfresh = 0;
+  return 0;
+}
+
+// pop_begin에서 확보한 노드를 꺼내므로 실패하지 않는다.
+static node_t *pnew(pop_t *op) {
+  struct rbtree_pstate *ps = op->t->pstate;
+  assert(op->nfresh < PFRESH_MAX && ps->spare);
+  node_t *c = ps->spare;
+  ps->spare = c->left;
+  ps->nspare--;
+  c->parent = PMARK(op);
+  op->fresh[op->nfresh++] = c;
+  return c;
+}
+
+// n을 수정하기 전에 호출: 이번 연산에서 만든 노드면 그대로, 아니면 복사본을 반환
+// 호출한 쪽에서 복사본을 부모(또는 op->root)에 다시 연결해야 한다.
+static node_t *pcow(pop_t *op, node_t *n) {
+  assert(n != op->t->nil);
+  if (n->parent == PMARK(op)) return n;
+  node_t *c = pnew(op);
+  c->color = n->color;
+  c->key = n->key;
+  c->left = n->left;
+  c->right = n->right;
+  if (op->t->flags & RBTREE_COUNTED) NODE_COUNT(c) = NODE_COUNT(n);
+  op->retired[op->nretired++] = n; // 공유 노드 자체는 건드리지 않는다.
+  return c;
+}
+
+// xp의 자식 old를 nw로 교체 (xp가 nil이면 루트 교체)
+static void preplace(pop_t *op, node_t *xp, node_t *old, node_t *nw) {
+  if (xp == op->t->nil) {
+    op->root = nw;
+  } else if (xp->left == old) {
+    xp->left = nw;
+  } else {
+    xp->right = nw;
+  }
+}
+
+// 경로 path[0..d-1]의 노드들을 모두 복사하고 서로 연결
+static void pcopy_path(pop_t *op, node_t **path, int d) {
+  node_t *nil = op->t->nil;
+  for (int i = 0; i < d; i++) {
+    node_t *c = pcow(op, path[i]);
+    preplace(op, i > 0 ? path[i - 1] : nil, path[i], c);
+    path[i] = c;
+  }
+}
+
+// 이번 연산에서 만든 노드만 대상으로 하는 회전 (xp는 x의 부모, 루트면 nil)
+static void prot_left(pop_t *op, node_t *x, node_t *xp) {
+  node_t *y = x->right;
+  x->right = y->left;
+  y->left = x;
+  preplace(op, xp, x, y);
+  op->t->rotations++;
+}
+
+static void prot_right(pop_t *op, node_t *x, node_t *xp) {
+  node_t *y = x->left;
+  x->left = y->right;
+  y->right = x;
+  preplace(op, xp, x, y);
+  op->t->rotations++;
+}
+
+// 새 루트를 새 버전으로 공개하고 빠진 노드들을 이전 버전에 넘긴다.
+// 버전은 pop_begin에서 미리 할당했으므로 실패하지 않는다.
+static void pop_publish(pop_t *op) {
+  rbtree *t = op->t;
+  struct rbtree_pstate *ps = t->pstate;
+
+  for (size_t i = 0; i < op->nfresh; i++) {
+    op->fresh[i]->parent = t->nil;
+  }
+  t->root = op->root;
+  pversion *v = op->v;
+  pversion_init(v, ps, t, t->root);
+  t->max = v->view.max;
+
+  // current는 쓰기 스레드만 바꾸므로 lock 없이 읽어도 된다.
+  pversion *old = atomic_load(&ps->current);
+  old->retired = op->retired;
+  old->nretired = op->nretired;
+  old->next = v;
+  atomic_store(&ps->current, v);
+  atomic_fetch_sub(&old->refs, 1);  // 트리가 들고 있던 참조를 새 버전으로 옮김
+  pthread_mutex_lock(&ps->lock);
+  pstate_collect(ps);
+  pthread_mutex_unlock(&ps->lock);
+}
+
+static void pinsert_fixup(pop_t *op, node_t **path, int k) {
+  node_t *nil = op->t->nil;
+  // path[k]가 z, path[k-1]이 부모, path[k-2]가 조부모
+  while (k >= 2 && path[k - 1]->color == RBTREE_RED) {
+    node_t *z = path[k];
+    node_t *p = path[k - 1];
+    node_t *g = path[k - 2];
+    node_t *gp = (k >= 3) ? path[k - 3] : nil;
+    if (p == g->left) {
+      if (g->right->color == RBTREE_RED) { // case 1: 삼촌 빨간색 → 삼촌도 복사해서 색 변경
+        node_t *u = pcow(op, g->right);
+        g->right = u;
+        g->color = RBTREE_RED;
+        p->color = RBTREE_BLACK;
+        u->color = RBTREE_BLACK;
+        k -= 2;
+      } else {
+        if (z == p->right) { // case 2: g-p-z 꺾임
+          prot_left(op, p, g);
+          p = z;
+        }
+        // case 3: g-p-z 선형
+        p->color = RBTREE_BLACK;
+        g->color = RBTREE_RED;
+        prot_right(op, g, gp);
+        break;
+      }
+    } else {
+      if (g->left->color == RBTREE_RED) {
+        node_t *u = pcow(op, g->left);
+        g->left = u;
+        g->color = RBTREE_RED;
+        p->color = RBTREE_BLACK;
+        u->color = RBTREE_BLACK;
+        k -= 2;
+      } else {
+        if (z == p->left) {
+          prot_right(op, p, g);
+          p = z;
         }
+        p->color = RBTREE_BLACK;
+        g->color = RBTREE_RED;
+        prot_left(op, g, gp);
+        break;
       }
     }
-    else
-    {
-      node_t *w = x->parent->left;
-      if (w->color == RBTREE_RED) {
+  }
+  // 루트는 경로의 첫 노드이므로 항상 이번 연산에서 만든 노드
+  op->root->color = RBTREE_BLACK;
+}
+
+// 할당에 실패하면 NULL (트리는 그대로)
+static node_t *pinsert(rbtree *t, const key_t key) {
+  pop_t op;
+  node_t *path[PPATH_MAX + 2];
+  int d = 0;
+  node_t *cur = t->root;
+  while (cur != t->nil) {
+    path[d++] = cur;
+    if ((t->flags & RBTREE_COUNTED) && key == cur->key) {
+      if (pop_begin(&op, t, d) != 0) return NULL;
+      pcopy_path(&op, path, d);
+      NODE_COUNT(path[d - 1])++;
+      pop_publish(&op);
+      return path[d - 1];
+    }
+    cur = (key < cur->key) ? cur->left : cur->right;
+  }
+  // 경로 d개 + 새 노드 + fixup case 1에서 복사하는 삼촌 (두 단계마다 하나)
+  if (pop_begin(&op, t, d + d / 2 + 2) != 0) return NULL;
+  pcopy_path(&op, path, d);
+
+  node_t *z = pnew(&op);
+  z->key = key;
+  node_count_init(t, z);
+  z->left = z->right = t->nil;
+  z->color = RBTREE_RED;
+  if (d == 0) {
+    op.root = z;
+  } else if (key < path[d - 1]->key) {
+    path[d - 1]->left = z;
+  } else {
+    path[d - 1]->right = z;
+  }
+  path[d] = z;
+  pinsert_fixup(&op, path, d);
+  t->size++;
+  if (t->filter) filter_add(t, key);
+
+  pop_publish(&op);
+  return z;
+}
+
+// 루트에서 target 노드까지의 경로를 찾는다. (중복 key가 양쪽에 있을 수 있으므로 같은 key면 양쪽 탐색)
+static int ppath_to(const rbtree *t, node_t *cur, const node_t *target,
+  node_t **path, int *d) {
+  if (cur == t->nil) return 0;
+  path[(*d)++] = cur;
+  if (cur == target) return 1;
+  if (target->key <= cur->key && ppath_to(t, cur->left, target, path, d)) return 1;
+  if (target->key >= cur->key && ppath_to(t, cur->right, target, path, d)) return 1;
+  (*d)--;
+  return 0;
+}
+
+// persistent 트리와 스냅샷의 rbtree_next(dir > 0) / rbtree_prev(dir < 0)
+// 노드의 parent는 쓰지 않으므로(공개된 노드는 항상 nil) 이 뷰의 루트에서 x까지의
+// 경로를 다시 찾고, 그 경로를 거슬러 올라가며 이웃을 구한다. x가 이 뷰에 없으면 NULL
+static node_t *pstep(const rbtree *t, const node_t *x, int dir) {
+  node_t *path[PPATH_MAX + 2];
+  int d = 0;
+  if (!ppath_to(t, t->root, x, path, &d)) return NULL;
+  node_t *c = dir > 0 ? x->right : x->left;
+  if (c != t->nil) {
+    // 서브트리가 있으면 그 안의 가장 가까운 노드
+    for (node_t *n = dir > 0 ? c->left : c->right; n != t->nil;
+         n = dir > 0 ? n->left : n->right) {
+      c = n;
+    }
+    return c;
+  }
+  // 없으면 x가 왼쪽(dir < 0이면 오른쪽) 서브트리에 든 가장 가까운 조상
+  for (int i = d - 1; i > 0; i--) {
+    if ((dir > 0 ? path[i - 1]->left : path[i - 1]->right) == path[i]) {
+      return path[i - 1];
+    }
+  }
+  return NULL;
+}
+
+// S[0..top]는 x의 조상 스택 (S[top]이 x의 부모, x가 루트면 top == -1)
+static void perase_fixup(pop_t *op, node_t *x, node_t **S, int top) {
+  node_t *nil = op->t->nil;
+  while (top >= 0 && x->color == RBTREE_BLACK) {
+    node_t *xp = S[top];
+    if (x == xp->left) {
+      node_t *w = pcow(op, xp->right);
+      xp->right = w;
+      if (w->color == RBTREE_RED) { // case 1: 회전 후 w가 xp의 새 부모가 되므로 스택에 끼워넣음
         w->color = RBTREE_BLACK;
-        x->parent->color = RBTREE_RED;
-        rotate_right(t, x->parent);
-        w = x->parent->left;
+        xp->color = RBTREE_RED;
+        prot_left(op, xp, top > 0 ? S[top - 1] : nil);
+        S[top] = w;
+        S[++top] = xp;
+        w = pcow(op, xp->right);
+        xp->right = w;
       }
-      if (w->right->color == RBTREE_BLACK && w->left->color == RBTREE_BLACK) 
-      {
+      if (w->left->color == RBTREE_BLACK && w->right->color == RBTREE_BLACK) { // case 2
         w->color = RBTREE_RED;
-        x = x->parent;
+        x = xp;
+        top--;
+      } else {
+        if (w->right->color == RBTREE_BLACK) { // case 3
+          node_t *wl = pcow(op, w->left);
+          w->left = wl;
+          wl->color = RBTREE_BLACK;
+          w->color = RBTREE_RED;
+          prot_right(op, w, xp);
+          w = wl;
+        }
+        // case 4
+        node_t *wr = pcow(op, w->right);
+        w->right = wr;
+        w->color = xp->color;
+        xp->color = RBTREE_BLACK;
+        wr->color = RBTREE_BLACK;
+        prot_left(op, xp, top > 0 ? S[top - 1] : nil);
+        x = op->root;
+        top = -1;
       }
-      else
-      {
-        if (w->right->color == RBTREE_RED && w->left->color == RBTREE_BLACK) 
-        {
+    } else {
+      node_t *w = pcow(op, xp->left);
+      xp->left = w;
+      if (w->color == RBTREE_RED) {
+        w->color = RBTREE_BLACK;
+        xp->color = RBTREE_RED;
+        prot_right(op, xp, top > 0 ? S[top - 1] : nil);
+        S[top] = w;
+        S[++top] = xp;
+        w = pcow(op, xp->left);
+        xp->left = w;
+      }
+      if (w->right->color == RBTREE_BLACK && w->left->color == RBTREE_BLACK) {
+        w->color = RBTREE_RED;
+        x = xp;
+        top--;
+      } else {
+        if (w->left->color == RBTREE_BLACK) {
+          node_t *wr = pcow(op, w->right);
+          w->right = wr;
+          wr->color = RBTREE_BLACK;
           w->color = RBTREE_RED;
-          w->right->color = RBTREE_BLACK;
-          rotate_left(t, w);
-          w = w->parent;
+          prot_left(op, w, xp);
+          w = wr;
         }
-        if (w->left->color == RBTREE_RED) 
-        {
-          w->color = x->parent->color;
-          x->parent->color = RBTREE_BLACK;
-          w->left->color = RBTREE_BLACK;
-          rotate_right(t, x->parent);
-          x = t->root;
+        node_t *wl = pcow(op, w->left);
+        w->left = wl;
+        w->color = xp->color;
+        xp->color = RBTREE_BLACK;
+        wl->color = RBTREE_BLACK;
+        prot_right(op, xp, top > 0 ? S[top - 1] : nil);
+        x = op->root;
+        top = -1;
+      }
+    }
+  }
+  // 루프가 빨간 x에서 끝났다면 x를 검게 칠한다. (공유 노드일 수 있으므로 복사 후 연결)
+  if (x != nil && x->color == RBTREE_RED) {
+    node_t *c = pcow(op, x);
+    preplace(op, top >= 0 ? S[top] : nil, x, c);
+    c->color = RBTREE_BLACK;
+  }
+}
+
+// target 노드(NULL이면 key를 가진 아무 노드)를 지운 새 버전을 만든다.
+// 지웠으면 1, 없으면 0, 할당에 실패하면 -1 (트리는 그대로)
+static int perase(rbtree *t, const node_t *target, const key_t key) {
+  node_t *path[PPATH_MAX + 2];
+  int d = 0;
+  if (target) {
+    if (!ppath_to(t, t->root, target, path, &d)) return 0;
+  } else {
+    node_t *cur = t->root;
+    while (cur != t->nil) {
+      path[d++] = cur;
+      if (key == cur->key) break;
+      cur = (key < cur->key) ? cur->left : cur->right;
+    }
+    if (cur == t->nil) return 0;
+  }
+
+  pop_t op;
+  node_t *nil = t->nil;
+  const int zi = d - 1;
+
+  if (node_count(t, path[zi]) > 1) {
+    if (pop_begin(&op, t, d) != 0) return -1;
+    pcopy_path(&op, path, d);
+    NODE_COUNT(path[zi])--;
+    pop_publish(&op);
+    return 1;
+  }
+
+  // z가 자식 둘이면 후임 노드 y까지 경로를 늘린다.
+  node_t *z0 = path[zi];
+  if (z0->left != nil && z0->right != nil) {
+    node_t *y = z0->right;
+    path[d++] = y;
+    while (y->left != nil) {
+      y = y->left;
+      path[d++] = y;
+    }
+  }
+  // 경로 d개 + fixup에서 복사하는 형제/조카 (한 단계에 최대 둘) + 마지막 x
+  if (pop_begin(&op, t, 2 * d + 4) != 0) return -1;
+  pcopy_path(&op, path, d);
+
+  node_t *z = path[zi];
+  node_t *zp = zi > 0 ? path[zi - 1] : nil;
+  node_t *x;
+  color_t y_origin_color;
+  int top;
+
+  if (z->left == nil || z->right == nil) {
+    x = (z->left == nil) ? z->right : z->left;
+    y_origin_color = z->color;
+    preplace(&op, zp, z, x);
+    top = zi - 1;
+  } else {
+    node_t *y = path[d - 1];
+    y_origin_color = y->color;
+    x = y->right;
+    if (d - 1 == zi + 1) {
+      // y가 z의 바로 오른쪽 자식: y가 z 자리로 올라가고 x의 부모는 y
+      top = zi;
+    } else {
+      node_t *yp = path[d - 2];
+      yp->left = x;
+      y->right = z->right;
+      top = d - 2;
+    }
+    y->left = z->left;
+    y->color = z->color;
+    preplace(&op, zp, z, y);
+    path[zi] = y;
+  }
+
+  // z의 복사본은 어떤 버전에도 공개되지 않으므로 바로 해제 (원본은 retired로 넘어감)
+  for (size_t i = 0; i < op.nfresh; i++) {
+    if (op.fresh[i] == z) {
+      op.fresh[i] = op.fresh[--op.nfresh];
+      break;
+    }
+  }
+  t->size--;
+  if (t->filter) filter_remove(t, z->key);
+  free(z);
+
+  if (y_origin_color == RBTREE_BLACK) {
+    perase_fixup(&op, x, path, top);
+  }
+  pop_publish(&op);
+  return 1;
+}
+
+// 현재 버전의 읽기 전용 뷰를 O(1)로 얻는다. 다 읽으면 rbtree_release로 반납해야 한다.
+const rbtree *rbtree_snapshot(rbtree *t) {
+  if (!t || !t->pstate) return NULL;
+  struct rbtree_pstate *ps = t->pstate;
+  atomic_fetch_add(&ps->entering, 1);
+  pversion *v = atomic_load(&ps->current);
+  atomic_fetch_add(&v->refs, 1);
+  atomic_fetch_sub(&ps->entering, 1);
+  return &v->view;
+}
+
+void rbtree_release(const rbtree *snap) {
+  if (!snap) return;
+  pversion *v = (pversion *)snap;
+  struct rbtree_pstate *ps = v->owner;
+  if (atomic_fetch_sub(&v->refs, 1) != 1) return; // 아직 다른 보유자가 있다.
+  pthread_mutex_lock(&ps->lock);
+  pstate_collect(ps);
+  pthread_mutex_unlock(&ps->lock);
+}
+
+/*
+연산 로그와 체크포인트
+
+rbtree_log_open으로 트리에 로그를 붙이면 insert/erase가 5바이트 레코드(op, key)를 메모리 버퍼에 덧붙인다.
+버퍼가 차면 그 연산이 버퍼를 writer 스레드에 넘기고, 버퍼의 첫 레코드가 LOG_SYNC_MS보다 오래되면
+writer가 (트리가 쉬고 있어도) 직접 가져간다. writer는 write + fdatasync를 한 번에 처리한다.
+(group commit, 호출한 쪽은 디스크를 기다리지 않음) 그래서 레코드는 LOG_SYNC_MS + 디스크 쓰기 시간 안에 디스크에 닿는다.
+버퍼는 두 개를 번갈아 쓰므로 writer가 앞 버퍼를 쓰는 동안에도 계속 덧붙일 수 있다.
+writer도 버퍼를 바꾸므로 cur/len은 lock 아래에서만 건드린다.
+rbtree_log_sync는 지금까지의 레코드가 디스크에 닿을 때까지 기다린다.
+
+파일은 base.ckpt(정렬된 (key, count) 목록)와 base.log(헤더 + 레코드) 두 개다.
+둘 다 헤더에 세대 번호(gen)가 있다. 체크포인트는 gen + 1로 새 스냅샷을 임시 파일에 쓰고 rename한 뒤
+로그를 비우고 gen + 1 헤더를 쓴다. 그 사이에 죽으면 로그의 gen이 체크포인트보다 작으므로
+복구할 때 그 로그는 이미 스냅샷에 들어간 것으로 보고 버린다.
+rbtree_log_load는 체크포인트를 bulk build로 올리고, 로그는 LOG_REPLAY_BATCH개씩 key로 안정 정렬해서
+hint 삽입으로 다시 적용한다. (다른 key끼리는 순서를 바꿔도 결과가 같고, 같은 key는 순서가 유지된다)
+마지막 레코드가 쓰다 만 것이면 버린다.
+intrusive 트리(노드가 호출한 쪽 것)와 동시성 트리(스레드 간 순서를 정할 수 없음)에는 붙일 수 없다.
+*/
+
+#define LOG_BUF (1u << 16)        // 버퍼 하나의 크기
+#define LOG_REC 5                 // op 1바이트 + key 4바이트
+#define LOG_SYNC_MS 10            // 버퍼를 이보다 오래 붙잡지 않는다
+#define LOG_REPLAY_BATCH (1u << 16)
+#define LOG_MAGIC 0x474c4252u     // "RBLG"
+#define CKPT_MAGIC 0x4b434252u    // "RBCK"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t gen;
+  uint64_t entries;  // 체크포인트의 (key, count) 수 (로그에서는 0)
+} log_header_t;
+
+struct rbtree_log {
+  int fd;
+  char *base;
+  uint64_t gen;
+  unsigned char *bufs[2];
+  unsigned char *cur;   // 지금 덧붙이는 버퍼 (lock 보호)
+  size_t len;
+  struct timespec first;   // cur에 첫 레코드를 넣은 시각 (CLOCK_MONOTONIC)
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  unsigned char *pending;  // writer가 쓸 버퍼 (pending_len이 0이면 비어 있음)
+  size_t pending_len;
+  int closing;
+  int io_error;
+};
+
+static int write_all(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) return -1;
+    p += w;
+    n -= (size_t)w;
+  }
+  return 0;
+}
+
+// cur를 writer가 쓸 버퍼로 넘기고 다른 버퍼로 바꾼다. (lock을 잡고 pending이 빈 상태에서 호출)
+static void log_swap(struct rbtree_log *lg) {
+  lg->pending = lg->cur;
+  lg->pending_len = lg->len;
+  lg->cur = (lg->cur == lg->bufs[0]) ? lg->bufs[1] : lg->bufs[0];
+  lg->len = 0;
+  pthread_cond_signal(&lg->work);
+}
+
+static void *log_writer(void *arg) {
+  struct rbtree_log *lg = arg;
+  pthread_mutex_lock(&lg->lock);
+  for (;;) {
+    while (!lg->pending_len && !lg->closing) {
+      if (!lg->len) {
+        pthread_cond_wait(&lg->work, &lg->lock);
+        continue;
+      }
+      // 덧붙이는 중인 버퍼는 첫 레코드부터 LOG_SYNC_MS가 지나면 직접 가져온다.
+      struct timespec due = lg->first;
+      due.tv_nsec += LOG_SYNC_MS * 1000000L;
+      if (due.tv_nsec >= 1000000000L) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+      }
+      if (pthread_cond_timedwait(&lg->work, &lg->lock, &due) == ETIMEDOUT &&
+          !lg->pending_len && lg->len) {
+        log_swap(lg);
+      }
+    }
+    if (!lg->pending_len) break;
+    unsigned char *buf = lg->pending;
+    size_t n = lg->pending_len;
+    pthread_mutex_unlock(&lg->lock);
+    int err = write_all(lg->fd, buf, n) != 0 || fdatasync(lg->fd) != 0;
+    pthread_mutex_lock(&lg->lock);
+    lg->io_error |= err;
+    lg->pending_len = 0;
+    pthread_cond_broadcast(&lg->done);
+  }
+  pthread_mutex_unlock(&lg->lock);
+  return NULL;
+}
+
+// 지금 버퍼를 writer에 넘기고 다른 버퍼로 바꾼다. wait이면 디스크에 닿을 때까지 기다린다.
+static int log_handoff(struct rbtree_log *lg, int wait) {
+  pthread_mutex_lock(&lg->lock);
+  while (lg->pending_len) pthread_cond_wait(&lg->done, &lg->lock);
+  if (lg->len) log_swap(lg);
+  while (wait && lg->pending_len) pthread_cond_wait(&lg->done, &lg->lock);
+  int err = lg->io_error;
+  pthread_mutex_unlock(&lg->lock);
+  return err ? -1 : 0;
+}
+
+static void log_append(rbtree *t, unsigned char op, const key_t key) {
+  struct rbtree_log *lg = t->log;
+  pthread_mutex_lock(&lg->lock);
+  if (lg->len + LOG_REC > LOG_BUF) {
+    while (lg->pending_len) pthread_cond_wait(&lg->done, &lg->lock);
+    log_swap(lg);
+  }
+  if (!lg->len) {
+    // 빈 버퍼의 첫 레코드: 쉬고 있던 writer가 마감 시각을 재기 시작하도록 깨운다.
+    clock_gettime(CLOCK_MONOTONIC, &lg->first);
+    pthread_cond_signal(&lg->work);
+  }
+  unsigned char *p = lg->cur + lg->len;
+  p[0] = op;
+  memcpy(p + 1, &key, sizeof(key));
+  lg->len += LOG_REC;
+  pthread_mutex_unlock(&lg->lock);
+}
+
+static char *log_path(const char *base, const char *suffix) {
+  size_t n = strlen(base) + strlen(suffix) + 1;
+  char *p = malloc(n);
+  if (p) snprintf(p, n, "%s%s", base, suffix);
+  return p;
+}
+
+// rename이 디스크에 남도록 파일이 든 디렉터리도 fsync
+static int fsync_dir(const char *path) {
+  char *dir = strdup(path);
+  if (!dir) return -1;
+  char *slash = strrchr(dir, '/');
+  if (slash) {
+    slash[slash == dir] = '\0';
+  } else {
+    strcpy(dir, ".");
+  }
+  int fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd < 0) return -1;
+  int r = fsync(fd);
+  close(fd);
+  return r;
+}
+
+// 로그를 비우고 gen 헤더만 남긴다.
+static int log_reset(struct rbtree_log *lg, uint64_t gen) {
+  log_header_t h = {.magic = LOG_MAGIC, .version = 1, .gen = gen};
+  if (ftruncate(lg->fd, 0) != 0 || write_all(lg->fd, &h, sizeof(h)) != 0 ||
+      fdatasync(lg->fd) != 0) {
+    return -1;
+  }
+  lg->gen = gen;
+  return 0;
+}
+
+static void log_free(struct rbtree_log *lg) {
+  if (lg->fd >= 0) close(lg->fd);
+  free(lg->bufs[0]);
+  free(lg->bufs[1]);
+  free(lg->base);
+  free(lg);
+}
+
+// base.log를 열어 t에 붙인다. 헤더가 없거나 gen이 맞지 않으면 gen으로 비운다.
+static int log_attach(rbtree *t, const char *base, uint64_t gen) {
+  if (!t || !base || t->log || (t->flags & (RBTREE_INTRUSIVE | RBTREE_CONCURRENT))) {
+    return -1;
+  }
+  struct rbtree_log *lg = calloc(1, sizeof(*lg));
+  if (!lg) return -1;
+  lg->fd = -1;
+  char *path = log_path(base, ".log");
+  lg->base = strdup(base);
+  lg->bufs[0] = malloc(LOG_BUF);
+  lg->bufs[1] = malloc(LOG_BUF);
+  if (path && lg->base && lg->bufs[0] && lg->bufs[1]) {
+    lg->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+  free(path);
+  log_header_t h;
+  if (lg->fd < 0 ||
+      ((pread(lg->fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != LOG_MAGIC ||
+        h.gen != gen) && log_reset(lg, gen) != 0)) {
+    log_free(lg);
+    return -1;
+  }
+  lg->gen = gen;
+  lg->cur = lg->bufs[0];
+  pthread_mutex_init(&lg->lock, NULL);
+  // writer의 마감 대기는 first와 같은 시계로 잰다.
+  pthread_condattr_t ca;
+  pthread_condattr_init(&ca);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&lg->work, &ca);
+  pthread_condattr_destroy(&ca);
+  pthread_cond_init(&lg->done, NULL);
+  if (pthread_create(&lg->writer, NULL, log_writer, lg) != 0) {
+    pthread_mutex_destroy(&lg->lock);
+    pthread_cond_destroy(&lg->work);
+    pthread_cond_destroy(&lg->done);
+    log_free(lg);
+    return -1;
+  }
+  t->log = lg;
+  return 0;
+}
+
+// t의 지금 상태를 체크포인트로 쓰고 base.log에 이어서 기록한다. (기존 파일은 덮어씀)
+int rbtree_log_open(rbtree *t, const char *base) {
+  if (log_attach(t, base, 0) != 0) return -1;
+  if (rbtree_checkpoint(t) != 0) {
+    rbtree_log_close(t);
+    return -1;
+  }
+  return 0;
+}
+
+// 덧붙인 레코드가 모두 디스크에 닿을 때까지 기다린다. 쓰기 오류가 있었으면 -1
+int rbtree_log_sync(rbtree *t) {
+  if (!t || !t->log) return -1;
+  return log_handoff(t->log, 1);
+}
+
+// 남은 레코드를 쓰고 로그를 뗀다. (파일은 남김)
+// 그동안 writer가 겪은 쓰기 오류가 있었으면 -1 (로그는 그래도 떼어낸다)
+int rbtree_log_close(rbtree *t) {
+  if (!t || !t->log) return -1;
+  struct rbtree_log *lg = t->log;
+  const int err = log_handoff(lg, 1);
+  pthread_mutex_lock(&lg->lock);
+  lg->closing = 1;
+  pthread_cond_signal(&lg->work);
+  pthread_mutex_unlock(&lg->lock);
+  pthread_join(lg->writer, NULL);
+  pthread_mutex_destroy(&lg->lock);
+  pthread_cond_destroy(&lg->work);
+  pthread_cond_destroy(&lg->done);
+  log_free(lg);
+  t->log = NULL;
+  return err;
+}
+
+static int ckpt_put(const rbtree *t, FILE *f, const node_t *x,
+  uint64_t *entries) {
+  if (node_dead(t, x)) return 0; // tombstone (RBTREE_LAZY)
+  const uint32_t rec[2] = {(uint32_t)x->key, (uint32_t)node_count(t, x)};
+  (*entries)++;
+  return fwrite(rec, sizeof(rec), 1, f) != 1;
+}
+
+static int ckpt_walk(const rbtree *t, const node_t *x, FILE *f,
+  uint64_t *entries) {
+  if (x == t->nil) return 0;
+  return ckpt_walk(t, x->left, f, entries) || ckpt_put(t, f, x, entries) ||
+         ckpt_walk(t, x->right, f, entries);
+}
+
+// 트리 전체를 새 세대의 체크포인트로 쓰고 로그를 비운다.
+// 그 전에 writer가 겪은 쓰기 오류가 있었으면 체크포인트를 만들지 않고 -1
+int rbtree_checkpoint(rbtree *t) {
+  if (!t || !t->log) return -1;
+  rbtree_flush(t); // 스냅샷은 트리만 훑는다.
+  struct rbtree_log *lg = t->log;
+  if (log_handoff(lg, 1) != 0) return -1;
+  char *tmp = log_path(lg->base, ".ckpt.tmp");
+  char *path = log_path(lg->base, ".ckpt");
+  FILE *f = tmp ? fopen(tmp, "wb") : NULL;
+  int err = !f || !path;
+  log_header_t h = {.magic = CKPT_MAGIC, .version = 1, .gen = lg->gen + 1};
+  if (!err) err = fwrite(&h, sizeof(h), 1, f) != 1;
+  // (key, count) 쌍을 중위 순서로 쓰고, 쓴 쌍 수를 헤더에 다시 기록한다.
+  if (!err && (t->btree || t->conc || small_inline(t))) {
+    for (node_t *p = rbtree_min(t); p && !err; p = rbtree_next(t, p)) {
+      err = ckpt_put(t, f, p, &h.entries);
+    }
+  } else if (!err) {
+    err = ckpt_walk(t, t->root, f, &h.entries); // persistent 노드에는 parent가 없다.
+  }
+  if (!err) {
+    err = fseek(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1 ||
+          fflush(f) != 0 || fsync(fileno(f)) != 0;
+  }
+  if (f) err |= fclose(f) != 0;
+  if (!err) err = rename(tmp, path) != 0 || fsync_dir(path) != 0;
+  // 스냅샷이 자리를 잡은 뒤에만 로그를 비운다.
+  if (!err) err = log_reset(lg, h.gen) != 0;
+  if (err && tmp) unlink(tmp);
+  free(tmp);
+  free(path);
+  return err ? -1 : 0;
+}
+
+typedef struct {
+  key_t key;
+  uint32_t seq;  // 같은 key의 원래 순서
+  unsigned char op;
+} replay_rec_t;
+
+static int replay_cmp(const void *a, const void *b) {
+  const replay_rec_t *x = a, *y = b;
+  if (x->key != y->key) return x->key < y->key ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// 정렬된 레코드 묶음을 적용. 삽입은 바로 앞에 넣은 노드를 hint로 쓴다.
+static void replay_batch(rbtree *t, replay_rec_t *recs, size_t n) {
+  qsort(recs, n, sizeof(*recs), replay_cmp);
+  node_t *hint = NULL;
+  for (size_t i = 0; i < n; i++) {
+    if (recs[i].op == LOG_INSERT) {
+      hint = hint ? rbtree_insert_hint(t, hint, recs[i].key)
+                  : rbtree_insert(t, recs[i].key);
+    } else {
+      rbtree_erase_key(t, recs[i].key);
+      hint = NULL; // 지운 노드가 hint였을 수 있다.
+    }
+  }
+}
+
+// 체크포인트를 읽어 트리를 만든다. 없으면 빈 트리, gen에는 체크포인트 세대 (없으면 0)
+static rbtree *ckpt_load(const char *path, unsigned int flags, uint64_t *gen) {
+  *gen = 0;
+  FILE *f = fopen(path, "rb");
+  if (!f) return new_rbtree_flags(flags);
+  log_header_t h;
+  uint32_t (*recs)[2] = NULL;
+  rbtree *t = NULL;
+  if (fread(&h, sizeof(h), 1, f) == 1 && h.magic == CKPT_MAGIC &&
+      (recs = malloc((h.entries ? h.entries : 1) * sizeof(*recs))) &&
+      fread(recs, sizeof(*recs), h.entries, f) == h.entries) {
+    *gen = h.gen;
+    size_t total = 0;
+    for (size_t i = 0; i < h.entries; i++) total += recs[i][1];
+    key_t *keys = flags ? NULL : malloc((total ? total : 1) * sizeof(key_t));
+    if (keys) {
+      // 기본 트리는 병렬 bulk build로 한 번에 만든다.
+      size_t k = 0;
+      for (size_t i = 0; i < h.entries; i++) {
+        for (uint32_t c = 0; c < recs[i][1]; c++) keys[k++] = (key_t)recs[i][0];
+      }
+      t = rbtree_build_parallel(keys, total, 0);
+      free(keys);
+    } else if ((t = new_rbtree_flags(flags))) {
+      // 정렬되어 있으므로 바로 앞 노드를 hint로 넣으면 하강 없이 붙는다.
+      node_t *hint = NULL;
+      for (size_t i = 0; i < h.entries; i++) {
+        for (uint32_t c = 0; c < recs[i][1]; c++) {
+          hint = hint ? rbtree_insert_hint(t, hint, (key_t)recs[i][0])
+                      : rbtree_insert(t, (key_t)recs[i][0]);
         }
       }
     }
   }
-  x->color = RBTREE_BLACK;
+  free(recs);
+  fclose(f);
+  return t;
+}
+
+// base.ckpt와 base.log로 트리를 복구하고, 이후 갱신을 같은 로그에 이어서 기록한다.
+rbtree *rbtree_log_load(const char *base, unsigned int flags) {
+  if (!base || (flags & (RBTREE_INTRUSIVE | RBTREE_CONCURRENT))) return NULL;
+  char *cpath = log_path(base, ".ckpt"), *lpath = log_path(base, ".log");
+  uint64_t gen = 0;
+  rbtree *t = (cpath && lpath) ? ckpt_load(cpath, flags, &gen) : NULL;
+  FILE *f = t ? fopen(lpath, "rb") : NULL;
+  log_header_t h;
+  if (f && fread(&h, sizeof(h), 1, f) == 1 && h.magic == LOG_MAGIC &&
+      h.gen >= gen) {
+    // gen이 체크포인트보다 작으면 이미 스냅샷에 들어간 로그이므로 건너뛴다.
+    replay_rec_t *batch = malloc(LOG_REPLAY_BATCH * sizeof(*batch));
+    unsigned char rec[LOG_REC];
+    size_t n = 0, whole = 0;
+    while (batch && fread(rec, LOG_REC, 1, f) == 1 &&
+           (rec[0] == LOG_INSERT || rec[0] == LOG_ERASE)) {
+      whole++;
+      batch[n].op = rec[0];
+      memcpy(&batch[n].key, rec + 1, sizeof(key_t));
+      batch[n].seq = (uint32_t)n;
+      if (++n == LOG_REPLAY_BATCH) {
+        replay_batch(t, batch, n);
+        n = 0;
+      }
+    }
+    if (batch) {
+      replay_batch(t, batch, n);
+    } else {
+      delete_rbtree(t);
+      t = NULL;
+    }
+    free(batch);
+    gen = h.gen;
+    // 쓰다 만 꼬리는 잘라내야 이어서 쓰는 레코드가 어긋나지 않는다.
+    if (t && truncate(lpath, sizeof(h) + whole * LOG_REC) != 0) {
+      delete_rbtree(t);
+      t = NULL;
+    }
+  }
+  if (f) fclose(f);
+  free(cpath);
+  free(lpath);
+  if (t && log_attach(t, base, gen) != 0) {
+    delete_rbtree(t);
+    t = NULL;
+  }
+  return t;
 }
 
 /*
-rbtree_erase 함수에서는 x,y,z 3가지 포인터가 등장한다.
+노드 재배치 (rbtree_compact)
 
-1. z: 삭제 대상
-2. y: 트리에서 실제로 제거되는 노드 (z 또는 z의 successor)
-    - z의 자식이 1개 이하일 경우: y는 z 자신.
-    - z의 자식이 2개일 경우: y는 z의 후임자(successor).
-3. x: y의 유일한 자식(없으면 nil)
-    - y가 빠져나간 빈자리를 메꾸기 위해 y의 원래 위치로 이동하게 됨
-    - 이 때 제거된 y의 색이 흑색일 경우 RB-tree의 5번 속성(bh 보존)이 꺠지게 된다.
-    
+insert/erase가 오래 섞이면 노드가 힙 여기저기에 흩어져서 탐색과 순회가 캐시 미스로 느려진다.
+rbtree_compact는 살아있는 노드를 새 chunk 하나에 전위 순서(DFS)로 옮겨 담는다.
+(부모 바로 뒤에 왼쪽 서브트리가 이어지므로 하강 경로의 앞부분과 중위 순회가 인접한 메모리를 읽는다)
+노드를 옮길 때는 내용을 그대로 복사하고 부모/자식의 포인터만 고치므로 트리 모양, 색, key, count, t->nil은 그대로다.
 
-절차
-1. BST 규칙에 따라 z를 트리에서 제거한다. 이 과정에서 y와 x 포인터가 결정된다.
-2. 제거된 노드 y의 원래 색이 BLACK이었다면, 트리 속성이 깨졌을 수 있다.
-   이때 rbtree_erase_fixup(t, x)를 호출하여 속성을 복구한다.
-*/ 
-int rbtree_erase(rbtree *t, node_t *z) {
-  if (!t || z == t->nil) return 0;
+rbtree_compact_step(t, budget)은 노드 budget개만 보고 돌아오므로 긴 멈춤 없이 조금씩 나눠 돌릴 수 있고,
+그 사이에 insert/erase를 해도 된다. 새 노드는 새 arena에서 할당하고, 옛 자리에 남은 노드 수(old_left)가
+0이 될 때까지 전위 순회를 (필요하면 루트부터 다시) 이어가므로 회전으로 순회 위치가 어긋나도 빠지는 노드가 없다.
+옛 자리가 arena chunk였으면 다 옮긴 뒤 chunk째 해제하고, malloc 노드였으면 옮길 때마다 하나씩 free한다.
 
-  node_t *y = z;
-  node_t *x = t->nil;
-  color_t y_origin_color = y->color;
+옮겨진 노드를 가리키던 node_t *는 더 이상 쓸 수 없다. 호출한 쪽은
+  - rbtree_set_move_hook으로 옮길 때마다 (옛 주소, 새 주소)를 받아서 자기 포인터를 고치거나
+  - RBTREE_PINNED로 만든 트리는 rbtree_compact가 거부하므로 노드 주소가 바뀌지 않는다.
+finger는 옮긴 뒤 next_gen으로 무효화한다.
+intrusive(노드가 호출한 쪽 것), persistent(노드를 버전끼리 공유), B-tree/동시성(자기 노드 구조),
+small/context 트리(구조체나 공유 풀 안의 노드)는 옮기지 않는다.
+*/
 
-  // case 1: z의 왼쪽이 NIL → 오른쪽으로 교체
-  if (z->left == t->nil) {
-    x = z->right;
-    rbtree_transplant(t,z,z->right);
-  } 
-  // case 2: z의 오른쪽이 NIL → 왼쪽으로 교체
-  else if (z->right == t->nil) {
-    x = z->left;
-    rbtree_transplant(t,z,z->left);
-  } 
-  // 위 처리 결과 노드 z는 직접 제거되며 x는 z의 위치로 올라온 노드가 된다.(z에 자식이 없었다면 NIL)
+struct rbtree_compact {
+  node_chunk *dst;            // 전위 순서로 채우는 새 자리 (t->arena의 chunk 중 하나)
+  size_t placed;              // dst에 채운 노드 수
+  struct rbtree_arena *old;   // 옮기기 전의 arena (malloc 노드였으면 NULL)
+  size_t old_left;            // 아직 옛 자리에 있는 노드 수
+  node_t *cursor;             // 다음에 볼 노드 (NULL이면 루트부터)
+};
 
-  // case 3: 양쪽 자식 존재 → 후임 노드로 대체
-  else {
-    // 후임 노드 찾기(y가 가리키게 만듬)
-    y = z->right;                              
-    while (y->left != t->nil) {
-      y = y->left;
+static int compact_ok(const rbtree *t) {
+  return t && !(t->flags & (RBTREE_PINNED | RBTREE_INTRUSIVE)) && !t->pstate &&
+         !t->btree && !t->conc && !t->small && !t->ctx;
+}
+
+static int arena_owns(const struct rbtree_arena *a, const node_t *n) {
+  for (const node_chunk *c = a->chunks; c; c = c->next) {
+    if (chunk_owns(c, n)) return 1;
+  }
+  return 0;
+}
+
+// 재배치 중의 node_free: 옛 자리의 노드면 여기서 처리하고 1 반환
+static int compact_release(rbtree *t, node_t *n) {
+  struct rbtree_compact *c = t->compact;
+  if (n == c->cursor) c->cursor = NULL; // 보던 노드가 없어지면 루트부터 다시
+  if (arena_owns(t->arena, n)) return 0;
+  c->old_left--;
+  if (!c->old) free(n); // 옛 arena의 노드는 끝날 때 chunk째 해제
+  return 1;
+}
+
+// 재배치 중인 트리의 옛 arena (없으면 NULL)
+static const struct rbtree_arena *compact_old(const rbtree *t) {
+  return t->compact ? t->compact->old : NULL;
+}
+
+static int compact_begin(rbtree *t) {
+  struct rbtree_compact *c = calloc(1, sizeof(*c));
+  struct rbtree_arena *a = calloc(1, sizeof(*a));
+  const int huge = t->arena && t->arena->huge;
+  node_chunk *dst = chunk_new(t->size ? t->size : 1, huge, node_bytes(t));
+  if (!c || !a || !dst) {
+    free(c);
+    free(a);
+    if (dst) chunk_release(dst);
+    return -1;
+  }
+  a->huge = huge;
+  a->stride = node_bytes(t);
+  dst->used = dst->cap; // dst 자리는 재배치만 쓰고, 그동안의 insert는 다음 chunk에서
+  a->chunks = dst;
+  c->dst = dst;
+  c->old = t->arena;
+  c->old_left = t->size;
+  t->arena = a;
+  t->compact = c;
+  return 0;
+}
+
+static void compact_finish(rbtree *t) {
+  struct rbtree_compact *c = t->compact;
+  // 그사이 지워져서 남은 dst 자리는 free list로
+  for (size_t i = c->dst->cap; i-- > c->placed;) {
+    chunk_at(c->dst, i)->right = t->arena->free_list;
+    t->arena->free_list = chunk_at(c->dst, i);
+  }
+  if (c->old) {
+    arena_free_chunks(c->old);
+    free(c->old);
+  }
+  free(c);
+  t->compact = NULL;
+}
+
+// x를 y 자리로 옮긴다. (x의 메모리는 아직 해제하지 않음)
+static void compact_move(rbtree *t, node_t *x, node_t *y) {
+  memcpy(y, x, node_bytes(t));
+  if (x->parent == t->nil) {
+    t->root = y;
+  } else if (x == x->parent->left) {
+    x->parent->left = y;
+  } else {
+    x->parent->right = y;
+  }
+  if (x->left != t->nil) x->left->parent = y;
+  if (x->right != t->nil) x->right->parent = y;
+  if (t->max == x) t->max = y;
+  if (t->on_move) t->on_move(t->move_arg, x, y);
+}
+
+// x를 재배치하고 x의 (새) 주소를 반환. 할당에 실패하면 NULL
+static node_t *compact_visit(rbtree *t, node_t *x, int *moved) {
+  struct rbtree_compact *c = t->compact;
+  if (chunk_owns(c->dst, x)) return x;
+  node_t *y;
+  if (c->placed < c->dst->cap) {
+    y = chunk_at(c->dst, c->placed++);
+  } else if (!arena_owns(t->arena, x)) {
+    y = arena_take(t->arena); // dst가 찼으면 옛 자리의 노드만 새 arena로
+    if (!y) return NULL;
+  } else {
+    return x;
+  }
+  compact_move(t, x, y);
+  node_free(t, x);
+  *moved = 1;
+  return y;
+}
+
+static node_t *preorder_next(const rbtree *t, node_t *x) {
+  if (x->left != t->nil) return x->left;
+  if (x->right != t->nil) return x->right;
+  for (node_t *p = x->parent; p != t->nil; x = p, p = p->parent) {
+    if (x == p->left && p->right != t->nil) return p->right;
+  }
+  return NULL;
+}
+
+// 노드를 최대 budget개 보고 돌아온다. 다 옮겼으면 0, 남았으면 1, 옮길 수 없는 트리거나 할당 실패면 -1
+int rbtree_compact_step(rbtree *t, size_t budget) {
+  if (!compact_ok(t)) return -1;
+  if (!t->compact) rbtree_flush(t); // 버퍼의 노드도 트리에 달아서 같이 옮긴다.
+  if (!t->compact && compact_begin(t) != 0) return -1;
+  struct rbtree_compact *c = t->compact;
+  int moved = 0, err = 0;
+  for (size_t i = 0; i < budget && c->old_left > 0; i++) {
+    node_t *x = compact_visit(t, c->cursor ? c->cursor : t->root, &moved);
+    if (!x) {
+      err = 1;
+      break;
     }
-    y_origin_color = y->color;          // 트리에서 빠져나올 y의 색을 미리 저장
-    x = y->right;                       // x는 y의 유일한 자식 (successor는 왼쪽 자식이 없으므로)
+    c->cursor = preorder_next(t, x); // 끝까지 봤으면 다음 바퀴는 루트부터
+  }
+  if (moved) next_gen(t); // 옮긴 노드를 가리키던 finger 무효화
+  if (err) return -1;
+  if (c->old_left > 0) return 1;
+  compact_finish(t);
+  return 0;
+}
 
-    // y를 원래 위치에서 제거하기
-    if (y->parent == z) {
-      // y가 z의 바로 오른쪽 자식인 경우,
-      // x가 NIL 노드일 수 있으므로, 부모 포인터를 명시적으로 설정
-      x->parent = y; // x가 NIL일 때도 x의 부모는 y여야 하므로 이를 명시해줘야한다.
+// 한 번에 끝까지 재배치
+int rbtree_compact(rbtree *t) {
+  return rbtree_compact_step(t, SIZE_MAX);
+}
+
+// 노드를 옮길 때마다 fn(arg, 옛 주소, 새 주소)를 부른다. (NULL이면 해제)
+// 옛 주소의 내용은 fn 안에서까지만 읽을 수 있다.
+void rbtree_set_move_hook(rbtree *t, rbtree_move_fn fn, void *arg) {
+  if (!t) return;
+  t->on_move = fn;
+  t->move_arg = arg;
+}
+
+/*
+트리 해제를 호출 스레드 밖으로 (delete_rbtree_async, delete_rbtree_parallel)
+
+노드가 수천만 개인 트리를 delete_rbtree로 지우면 free를 그만큼 부르는 동안 호출 스레드가 멈춘다.
+delete_rbtree_async는 트리를 대기열에 넣고 바로 돌아오며, 백그라운드 스레드(처음 쓸 때 하나 띄움)가
+노드를 RECLAIM_BATCH 걸음씩 반복문으로 해제하고 그 사이마다 CPU를 양보한다.
+(arena 트리는 chunk째 해제하므로 나눌 필요 없이 delete_rbtree를 그대로 부른다)
+연산 로그는 호출 스레드에서 닫으므로 돌아온 뒤에는 로그 파일이 완성되어 있다.
+context 트리는 노드를 context 풀로 돌려줘야 하는데 context가 먼저 지워질 수 있으므로 바로 해제한다.
+delete_rbtree_parallel은 위쪽 몇 단계를 잘라 생긴 서브트리들을 여러 스레드가 나눠 해제한다.
+*/
+
+#define RECLAIM_BATCH 4096
+
+typedef struct reclaim_job {
+  struct reclaim_job *next;
+  rbtree *t;
+} reclaim_job_t;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work, idle;
+  reclaim_job_t *head, *tail;
+  int busy;     // 지금 해제 중인 트리가 있음
+  int started;  // reclaimer 스레드를 띄웠음
+} reclaimer = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .idle = PTHREAD_COND_INITIALIZER,
+};
+
+// 노드를 하나씩 free하는 트리면 RECLAIM_BATCH 걸음씩 나눠서 해제한 뒤 나머지를 delete_rbtree로
+static void reclaim_tree(rbtree *t) {
+  if (!t->arena && !t->compact && !(t->flags & RBTREE_INTRUSIVE)) {
+    node_t *x = t->root;
+    t->root = t->nil;
+    while ((x = free_some(t, x, RECLAIM_BATCH)) != t->nil) sched_yield();
+  }
+  delete_rbtree(t);
+}
+
+static void *reclaim_worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&reclaimer.lock);
+  for (;;) {
+    while (!reclaimer.head) {
+      pthread_cond_broadcast(&reclaimer.idle);
+      pthread_cond_wait(&reclaimer.work, &reclaimer.lock);
+    }
+    reclaim_job_t *job = reclaimer.head;
+    reclaimer.head = job->next;
+    if (!reclaimer.head) reclaimer.tail = NULL;
+    reclaimer.busy = 1;
+    pthread_mutex_unlock(&reclaimer.lock);
+    reclaim_tree(job->t);
+    free(job);
+    pthread_mutex_lock(&reclaimer.lock);
+    reclaimer.busy = 0;
+  }
+  return NULL;
+}
+
+// t를 백그라운드에서 해제한다. (돌아온 뒤 t를 쓰면 안 됨)
+void delete_rbtree_async(rbtree *t) {
+  if (!t) return;
+  rbtree_log_close(t);
+  reclaim_job_t *job = t->ctx ? NULL : malloc(sizeof(*job));
+  if (!job) {
+    delete_rbtree(t);
+    return;
+  }
+  job->next = NULL;
+  job->t = t;
+  pthread_mutex_lock(&reclaimer.lock);
+  if (!reclaimer.started) {
+    pthread_t tid;
+    reclaimer.started = pthread_create(&tid, NULL, reclaim_worker, NULL) == 0;
+    if (reclaimer.started) pthread_detach(tid);
+  }
+  if (!reclaimer.started) {
+    pthread_mutex_unlock(&reclaimer.lock);
+    free(job);
+    delete_rbtree(t); // 스레드를 못 띄웠으면 직접 해제
+    return;
+  }
+  if (reclaimer.tail) {
+    reclaimer.tail->next = job;
+  } else {
+    reclaimer.head = job;
+  }
+  reclaimer.tail = job;
+  pthread_cond_signal(&reclaimer.work);
+  pthread_mutex_unlock(&reclaimer.lock);
+}
+
+// 지금까지 delete_rbtree_async로 넘긴 트리가 모두 해제될 때까지 기다린다.
+void rbtree_reclaim_wait(void) {
+  pthread_mutex_lock(&reclaimer.lock);
+  while (reclaimer.started && (reclaimer.head || reclaimer.busy)) {
+    pthread_cond_wait(&reclaimer.idle, &reclaimer.lock);
+  }
+  pthread_mutex_unlock(&reclaimer.lock);
+}
+
+typedef struct {
+  rbtree *t;
+  node_t **pieces;
+  size_t npieces;
+  atomic_size_t next;
+} free_job_t;
+
+// 위쪽 depth 단계의 노드는 tops에, 그 아래 서브트리의 루트는 pieces에 모은다.
+static void free_split(const rbtree *t, node_t *x, int depth, node_t **pieces,
+  size_t *np, node_t **tops, size_t *nt) {
+  if (x == t->nil) return;
+  if (depth == 0) {
+    pieces[(*np)++] = x;
+    return;
+  }
+  tops[(*nt)++] = x;
+  free_split(t, x->left, depth - 1, pieces, np, tops, nt);
+  free_split(t, x->right, depth - 1, pieces, np, tops, nt);
+}
+
+static void *free_worker(void *arg) {
+  free_job_t *job = arg;
+  size_t i;
+  while ((i = atomic_fetch_add(&job->next, 1)) < job->npieces) {
+    free_some(job->t, job->pieces[i], SIZE_MAX);
+  }
+  return NULL;
+}
+
+// 서브트리들을 nthreads개 스레드가 나눠서 해제한 뒤 나머지를 delete_rbtree로 (nthreads <= 0이면 코어 수)
+void delete_rbtree_parallel(rbtree *t, int nthreads) {
+  if (!t) return;
+  nthreads = par_threads(nthreads);
+  // 하나씩 free하는 노드만 나눌 가치가 있다. (arena는 chunk째, context는 풀의 lock 하나,
+  // small 트리는 구조체 안 노드 자리의 비트맵을 여러 스레드가 고치게 되므로 제외)
+  if (nthreads == 1 || t->size < PAR_EXPORT_MIN || t->arena || t->ctx ||
+      t->small || t->compact || (t->flags & RBTREE_INTRUSIVE)) {
+    delete_rbtree(t);
+    return;
+  }
+  int depth = 0;
+  while ((1u << depth) < (unsigned)nthreads * PAR_PIECES_PER_THREAD) depth++;
+  node_t **pieces = malloc(sizeof(node_t *) << (depth + 1));
+  if (!pieces) {
+    delete_rbtree(t);
+    return;
+  }
+  node_t **tops = pieces + ((size_t)1 << depth);
+  size_t nt = 0;
+  free_job_t job = {.t = t, .pieces = pieces};
+  free_split(t, t->root, depth, pieces, &job.npieces, tops, &nt);
+  t->root = t->nil;
+  par_run(nthreads, free_worker, &job, 0);
+  for (size_t i = 0; i < nt; i++) node_free(t, tops[i]);
+  free(pieces);
+  delete_rbtree(t);
+}
+
+/*
+트리 복제 (rbtree_clone)
+
+what-if 계산용으로 트리를 통째로 복사한다. 원본을 전위 순서로 한 번 훑으면서 복사본도 같은 경로로
+따라 내려가므로 (원본 노드 → 복사본 노드) 표나 재귀 스택 없이 부모를 이어 붙일 수 있다.
+노드는 arena chunk 하나에 전위 순서로 연달아 놓이고, 모양, 색(rank), key, count는 그대로,
+nil과 max는 복사본 것으로 바꾼다. 회전이나 비교가 전혀 없으므로 노드 바이트를 옮기는 비용만 든다.
+(원본이 rbtree_compact로 전위 순서로 놓여 있으면 원본 쪽 읽기도 순차가 된다)
+filter는 카운터 블록을 그대로 복사하고, 연산 로그, 재배치 상태, 이동 콜백은 복사하지 않는다.
+노드 배치가 다른 트리(persistent, B-tree, 동시성, inline 상태의 small)는 key를 정렬 순서로 꺼내서
+hint 삽입으로 다시 만든다. intrusive 트리는 노드가 호출한 쪽 것이므로 복제할 수 없다. (NULL)
+*/
+
+// 원본 노드 x를 slot에 복사해서 parent 아래에 둔다. (자식은 내려갈 때 잇는다)
+static node_t *clone_copy(rbtree *c, const rbtree *t, const node_t *x,
+  node_t *slot, node_t *parent) {
+  memcpy(slot, x, node_bytes(t)); // counted 트리면 count까지
+  slot->parent = parent;
+  slot->left = slot->right = c->nil;
+  if (x == t->max) c->max = slot;
+  return slot;
+}
+
+static void clone_nodes(rbtree *c, const rbtree *t, node_chunk *chunk) {
+  size_t i = 0;
+  const node_t *x = t->root;
+  node_t *y = clone_copy(c, t, x, chunk_at(chunk, i++), c->nil);
+  c->root = y;
+  for (;;) {
+    if (x->left != t->nil) {
+      x = x->left;
+      y = y->left = clone_copy(c, t, x, chunk_at(chunk, i++), y);
+      continue;
+    }
+    if (x->right != t->nil) {
+      x = x->right;
+      y = y->right = clone_copy(c, t, x, chunk_at(chunk, i++), y);
+      continue;
+    }
+    // 아직 안 간 오른쪽 서브트리가 있는 조상까지 둘이 같이 올라간다.
+    for (;;) {
+      const node_t *p = x->parent;
+      if (p == t->nil) return;
+      y = y->parent;
+      if (x == p->left && p->right != t->nil) {
+        x = p->right;
+        y = y->right = clone_copy(c, t, x, chunk_at(chunk, i++), y);
+        break;
+      }
+      x = p;
+    }
+  }
+}
+
+static int filter_copy(rbtree *c, const rbtree *t) {
+  const struct rbtree_filter *f = t->filter;
+  filter_block_t *blocks = aligned_alloc(64, f->nblocks * sizeof(filter_block_t));
+  if (!blocks) return -1;
+  memcpy(blocks, f->blocks, f->nblocks * sizeof(filter_block_t));
+  free(c->filter->blocks);
+  c->filter->blocks = blocks;
+  c->filter->nblocks = f->nblocks;
+  c->filter->capacity = f->capacity;
+  return 0;
+}
+
+// 정렬 순서로 꺼낸 key를 hint 삽입으로 다시 넣는다.
+static rbtree *clone_by_keys(const rbtree *t) {
+  size_t cap = t->size > 16 ? t->size : 16;
+  key_t *keys = NULL;
+  size_t n;
+  for (;;) {
+    key_t *grown = realloc(keys, cap * sizeof(key_t));
+    if (!grown) {
+      free(keys);
+      return NULL;
+    }
+    keys = grown;
+    n = rbtree_to_array_parallel(t, keys, cap, 1);
+    if (n < cap) break;
+    cap *= 2; // count가 있으면 key 수가 노드 수보다 많다.
+  }
+  rbtree *c = new_rbtree_flags(t->flags);
+  node_t *hint = NULL;
+  for (size_t i = 0; c && i < n; i++) {
+    hint = hint ? rbtree_insert_hint(c, hint, keys[i]) : rbtree_insert(c, keys[i]);
+  }
+  free(keys);
+  return c;
+}
+
+// t와 같은 내용의 독립된 트리를 만든다. (실패하거나 intrusive 트리면 NULL)
+rbtree *rbtree_clone(const rbtree *t) {
+  if (!t || (t->flags & RBTREE_INTRUSIVE)) return NULL;
+  // 스냅샷 뷰는 pstate가 없으므로 persistent 여부는 flag로 본다.
+  if ((t->flags & RBTREE_PERSISTENT) || t->btree || t->conc || small_inline(t)) {
+    return clone_by_keys(t);
+  }
+
+  // 트리로 바뀐 small 트리의 노드는 구조체 안팎에 섞여 있으므로 복사본은 보통 트리로 만든다.
+  rbtree *c = new_rbtree_flags(t->flags & ~RBTREE_SMALL);
+  if (!c) return NULL;
+  if (t->size) {
+    node_chunk *chunk = arena_reserve(c, t->size);
+    if (!chunk || (t->filter && filter_copy(c, t) != 0)) {
+      delete_rbtree(c);
+      return NULL;
+    }
+    chunk->used = t->size;
+    clone_nodes(c, t, chunk);
+  }
+  c->size = t->size;
+  c->tombstones = t->tombstones;
+  c->purge_share = t->purge_share;
+  if (t->wbuf && wbuf_copy(c, t) != 0) {
+    delete_rbtree(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+정렬된 key 묶음 조회 (rbtree_contains_sorted, rbtree_find_sorted)
+
+join처럼 정렬된 probe 배열을 한꺼번에 확인할 때 probe마다 root에서 내려가지 않고,
+직전 probe의 lower bound 노드(cursor)에서 이어서 찾는다.
+- probe가 촘촘하면 cursor를 중위 순서로 몇 칸(SORTED_STEPS) 옮기는 것으로 끝난다. (merge, 전체 O(n + m))
+- 그 안에 닿지 않으면 rbtree_find_from처럼 probe를 포함하는 서브트리까지만 올라갔다가 내려간다.
+  cursor와 순위 차이가 d이면 O(log d)이므로 probe가 드물어도 전체가 O(m log n)을 넘지 않는다.
+- 한 번 건너뛰었으면 다음 probe부터는 옮겨 보지 않고 바로 건너뛴다. (한 칸마다 캐시 미스라서)
+  건너뛴 거리가 짧았으면(조금만 올라갔으면) 다시 옮겨 보는 쪽으로 돌아온다. (timsort의 galloping)
+probe가 정렬돼 있지 않아도 답은 맞다. (앞 probe보다 작으면 그 probe만 root에서 찾는다)
+부모 포인터로 이어 갈 수 없는 트리(persistent, B-tree, 동시성, inline 상태의 small, intrusive)는
+probe마다 rbtree_find를 부른다.
+*/
+
+enum { SORTED_STEPS = 4, SORTED_NEAR = 2 };
+
+// from 서브트리에서 key와 같은 노드, 없으면 key보다 큰 가장 작은 노드 (모두 없으면 bound)
+// 같은 key가 여러 개여도 아무거나 돌려준다. 다음 probe는 key 이상이므로 cursor로 충분하다.
+static node_t *lower_below(const rbtree *t, node_t *from, const key_t key,
+  node_t *bound) {
+  node_t *x = from;
+  while (x != t->nil) {
+    if (x->key == key) return x;
+    if (x->key > key) {
+      bound = x;
+      x = x->left;
     } else {
-      // y가 z의 오른쪽 서브트리 깊숙이 있는 경우,
-      // 1. y의 원래 위치를 x로 대체하여 y를 트리에서 분리
-      rbtree_transplant(t, y, x);
-      // 2. y가 z의 자리를 차지할 준비: z의 오른쪽 서브트리를 y에게 넘김
-      y->right = z->right;
-      y->right->parent = y;
+      x = x->right;
     }
+  }
+  return bound;
+}
 
-    // 공통 후처리: z 자리에 y 올리고, z의 왼쪽 서브트리를 y.left로, 색은 z의 색 유지
-    rbtree_transplant(t,z,y);
-    y->left = z->left;
-    y->left->parent = y;
-    y->color = z->color;
+// key보다 작은 cur에서 key의 lower bound로 옮긴다. (없으면 NULL)
+// *steps칸까지 중위 순서로 옮겨 보고, 그 뒤의 *steps를 정해 둔다.
+static node_t *lower_from(const rbtree *t, node_t *cur, const key_t key,
+  int *steps) {
+  node_t *c = cur;
+  for (int i = 0; i < *steps; i++) {
+    node_t *next = tree_next(t, c);
+    if (!next || next->key >= key) return next;
+    c = next;
   }
 
-  // 제거된 y자리가 원래 흑색이었다면 높이 위반 가능 → fixup
-  if (y_origin_color == RBTREE_BLACK) {
-    rbtree_erase_fixup(t,x);
+  // c가 오른쪽 자식이거나 부모도 key보다 작으면 c의 서브트리는 모두 key보다 작으므로 올라간다.
+  // 멈춘 곳의 부모는 key 이상이므로 c의 오른쪽 서브트리에 답이 없을 때의 답이다.
+  int climbed = 0;
+  while (c->parent != t->nil &&
+         (c == c->parent->right || c->parent->key < key)) {
+    c = c->parent;
+    climbed++;
+  }
+  *steps = climbed <= SORTED_NEAR ? SORTED_STEPS : 0;
+  node_t *bound = c->parent == t->nil ? NULL : c->parent;
+  return lower_below(t, c->right, key, bound);
+}
+
+static size_t sorted_join(const rbtree *t, const key_t *probes, const size_t n,
+  uint8_t *bits, node_t **out) {
+  if (bits) memset(bits, 0, (n + 7) / 8);
+  // persistent 노드에는 parent가 없다. (스냅샷 뷰는 pstate도 없으므로 flag로 본다)
+  const int walk = t && !(t->btree || t->conc || small_inline(t) ||
+                          (t->flags & (RBTREE_PERSISTENT | RBTREE_INTRUSIVE)));
+  size_t hits = 0;
+  node_t *cur = NULL; // 직전 probe의 lower bound (NULL이면 모든 key가 probe보다 작음)
+  int steps = SORTED_STEPS;
+  for (size_t i = 0; i < n; i++) {
+    const key_t key = probes[i];
+    node_t *found;
+    if (!walk) {
+      found = rbtree_find(t, key);
+    } else {
+      if (i == 0 || key < probes[i - 1]) {
+        cur = lower_below(t, t->root, key, NULL);
+      } else if (cur && cur->key < key) {
+        cur = lower_from(t, cur, key, &steps);
+      }
+      found = cur;
+      if (found && (found->key != key || node_dead(t, found))) {
+        found = NULL; // 없거나 tombstone (RBTREE_LAZY)
+      }
+      if (!found && t->wbuf) found = wbuf_find(t, key);
+    }
+    if (found) {
+      hits++;
+      if (bits) bits[i >> 3] |= (uint8_t)(1u << (i & 7));
+    }
+    if (out) out[i] = found;
   }
+  return hits;
+}
+
+// 오름차순 probes[i]가 트리에 있으면 out_bitmap의 i번째 비트(바이트 i/8의 i%8번 비트)를 켠다.
+// out_bitmap은 (n + 7) / 8 바이트이고 NULL이면 개수만 센다. 찾은 probe 개수를 반환
+size_t rbtree_contains_sorted(const rbtree *t, const key_t *probes, size_t n,
+  uint8_t *out_bitmap) {
+  return sorted_join(t, probes, n, out_bitmap, NULL);
+}
+
+// rbtree_contains_sorted와 같지만 probes[i]에 해당하는 노드를 out[i]에 둔다. (없으면 NULL)
+size_t rbtree_find_sorted(const rbtree *t, const key_t *probes, size_t n,
+  node_t **out) {
+  return sorted_join(t, probes, n, NULL, out);
+}
+
+/*
+쓰기 버퍼 (RBTREE_BUFFERED)
+
+쓰기가 몰릴 때 insert마다 큰 트리를 내려가서 fixup과 회전을 하면 캐시에 없는 노드를 계속 건드린다.
+RBTREE_BUFFERED 트리는 새 노드를 바로 트리에 달지 않고 작은 정렬 배열(WBUF_CAP개)에 모아 둔다.
+(LSM 트리의 memtable 역할. 배열은 key 순서이고 같은 key끼리는 들어온 순서)
+- insert는 노드를 할당해서 배열의 제자리에 끼워 넣기만 하므로 트리 크기와 상관없이 거의 일정한 시간이 든다.
+- 배열이 차면 rbtree_flush가 노드들을 key 순서로 트리에 단다. 들어갈 자리는 회전을 하기 전에
+  여러 하강을 번갈아 진행하며 한꺼번에 찾으므로 캐시 미스가 겹쳐서 처리되고, 이어지는 fixup은
+  방금 읽은 경로를 다시 건드린다.
+- 버퍼의 노드는 할당된 그대로 트리에 달리므로 insert가 돌려준 포인터는 flush 뒤에도 유효하다.
+  아직 트리에 달리지 않은 노드는 parent가 NULL이다.
+- erase는 버퍼에 있는 key면 버퍼에서 빼는 것으로 끝나고, 아니면 트리에서 지운다.
+  (RBTREE_LAZY와 같이 쓰면 트리 쪽 erase도 tombstone 표시만 한다)
+- rbtree_find, min/max, next/prev, rbtree_to_array는 버퍼와 트리를 함께 본다.
+  같은 key면 트리의 노드가 버퍼의 노드보다 앞이다. (바로 insert했을 때의 순서와 같다)
+- counted 트리는 같은 key를 노드 하나로 모아야 하므로 버퍼에는 트리에 없는 key만 둔다.
+  filter가 "확실히 없음"이라고 하는 key만 버퍼로 보내고, 나머지는 트리를 찾아서 count를 올리거나
+  찾은 자리에 바로 단다. (그래서 counted 트리는 RBTREE_FILTER와 같이 써야 효과가 있다)
+트리는 한 스레드가 고치는 구조이므로 버퍼도 트리마다 하나다. (여러 스레드가 쓰면 RBTREE_CONCURRENT)
+rbtree_compact, rbtree_checkpoint처럼 트리의 노드 전체를 다루는 연산은 먼저 버퍼를 비운다.
+*/
+
+#define WBUF_CAP 256
+#define WBUF_LANES 16  // rbtree_flush가 한꺼번에 진행하는 하강 수
 
-  free(z); // 삭제된 노드 z의 메모리를 해제해야 메모리 누수가 발생하지 않음
+struct rbtree_wbuf {
+  size_t n;
+  key_t keys[WBUF_CAP];     // 버퍼 노드의 key (오름차순, 이진 탐색을 노드를 읽지 않고 하도록)
+  node_t *nodes[WBUF_CAP];  // keys[i]의 노드
+};
+
+static int wbuf_init(rbtree *t) {
+  t->wbuf = calloc(1, sizeof(*t->wbuf));
+  return t->wbuf ? 0 : -1;
+}
+
+// 트리를 지울 때 버퍼의 노드까지 해제
+static void wbuf_destroy(rbtree *t) {
+  for (size_t i = 0; i < t->wbuf->n; i++) node_free(t, t->wbuf->nodes[i]);
+  free(t->wbuf);
+  t->wbuf = NULL;
+}
+
+// 아직 트리에 달지 않은 노드 수
+static size_t wbuf_size(const rbtree *t) {
+  return t->wbuf ? t->wbuf->n : 0;
+}
+
+static size_t wbuf_bytes(void) {
+  return sizeof(struct rbtree_wbuf);
+}
+
+// t의 버퍼 노드를 복제본 c의 버퍼로 복사 (같은 크기이므로 넘치지 않는다)
+static int wbuf_copy(rbtree *c, const rbtree *t) {
+  for (size_t i = 0; i < t->wbuf->n; i++) {
+    node_t *s = wbuf_insert(c, t->wbuf->keys[i]);
+    if (!s) return -1;
+    if (t->flags & RBTREE_COUNTED) NODE_COUNT(s) = NODE_COUNT(t->wbuf->nodes[i]);
+  }
   return 0;
 }
 
-static void inorder(const rbtree *t, const node_t *x, 
-  key_t *arr, const size_t n, size_t *idx) {
-  if (x == t->nil || *idx >= n) return;
+// key 이상(upper면 key 초과)인 첫 자리
+static size_t wbuf_bound(const struct rbtree_wbuf *b, const key_t key,
+  int upper) {
+  size_t lo = 0, hi = b->n;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (b->keys[mid] < key || (upper && b->keys[mid] == key)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
 
-  inorder(t, x->left, arr, n, idx);
-  if (*idx < n) {
-    arr[*idx] = x->key;
-    (*idx)++;
+// 버퍼에서 key를 가진 노드 (없으면 NULL)
+static node_t *wbuf_find(const rbtree *t, const key_t key) {
+  const struct rbtree_wbuf *b = t->wbuf;
+  const size_t i = wbuf_bound(b, key, 0);
+  return (i < b->n && b->keys[i] == key) ? b->nodes[i] : NULL;
+}
+
+// 버퍼 노드 x의 자리
+static size_t wbuf_index(const struct rbtree_wbuf *b, const node_t *x) {
+  size_t i = wbuf_bound(b, x->key, 0);
+  while (b->nodes[i] != x) i++;
+  return i;
+}
+
+// 새 노드를 버퍼의 제자리(같은 key들의 뒤)에 넣는다. 버퍼가 차 있으면 먼저 트리에 단다.
+static node_t *wbuf_insert(rbtree *t, const key_t key) {
+  struct rbtree_wbuf *b = t->wbuf;
+  if (b->n == WBUF_CAP) rbtree_flush(t);
+  node_t *node = node_alloc(t);
+  if (!node) return NULL;
+  node->key = key;
+  node_count_init(t, node);
+  node->parent = node->left = node->right = NULL;
+  const size_t i = wbuf_bound(b, key, 1);
+  memmove(b->keys + i + 1, b->keys + i, (b->n - i) * sizeof(key_t));
+  memmove(b->nodes + i + 1, b->nodes + i, (b->n - i) * sizeof(node_t *));
+  b->keys[i] = key;
+  b->nodes[i] = node;
+  b->n++;
+  return node;
+}
+
+// RBTREE_BUFFERED 트리의 insert
+static node_t *wbuf_put(rbtree *t, const key_t key) {
+  if (!(t->flags & RBTREE_COUNTED)) return wbuf_insert(t, key);
+  node_t *s = wbuf_find(t, key);
+  if (s) {
+    NODE_COUNT(s)++;
+    return s;
   }
-  inorder(t, x->right, arr, n, idx);
+  if (t->filter && !filter_maybe(t, key)) return wbuf_insert(t, key);
+  // 트리에 있을 수도 있는 key: 같은 key가 있으면 count를, 없으면 하강한 자리에 바로 단다.
+  node_t *parent;
+  node_t *dup = descend(t, t->root, key, &parent);
+  return dup ? count_up(t, dup) : insert_at(t, parent, key);
 }
 
-int rbtree_to_array(const rbtree *t, key_t *arr, const size_t n) {
-  if (t == NULL || arr == NULL || n == 0) return 0;
+// 버퍼 노드 x를 빼고 해제
+static void wbuf_remove(rbtree *t, node_t *x) {
+  struct rbtree_wbuf *b = t->wbuf;
+  const size_t i = wbuf_index(b, x);
+  memmove(b->keys + i, b->keys + i + 1, (b->n - i - 1) * sizeof(key_t));
+  memmove(b->nodes + i, b->nodes + i + 1, (b->n - i - 1) * sizeof(node_t *));
+  b->n--;
+  node_free(t, x);
+}
 
-  size_t idx = 0;
-  inorder(t, t->root, arr, n, &idx);
-  return 0; 
+// 버퍼의 각 key가 들어갈 자리 바로 앞의 트리 노드(key 이하인 가장 큰 노드, 없으면 NULL)를 pred에 구한다.
+// 하강 WBUF_LANES개를 한 걸음씩 번갈아 진행하면서 다음에 읽을 자식을 prefetch하므로
+// 한 하강의 캐시 미스를 기다리는 동안 다른 하강들의 미스가 같이 처리된다. (트리는 읽기만 한다)
+static void wbuf_locate(const rbtree *t, node_t **pred) {
+  const struct rbtree_wbuf *b = t->wbuf;
+  node_t *cur[WBUF_LANES];
+  for (size_t base = 0; base < b->n; base += WBUF_LANES) {
+    const size_t m = b->n - base < WBUF_LANES ? b->n - base : WBUF_LANES;
+    for (size_t i = 0; i < m; i++) {
+      // 최대 노드 이상인 key는 내려갈 필요 없이 그 뒤 (rbtree_insert의 빠른 경로와 같음)
+      const int tail = t->max != t->nil && b->keys[base + i] >= t->max->key;
+      cur[i] = tail ? t->nil : t->root;
+      pred[base + i] = tail ? t->max : NULL;
+    }
+    for (size_t live = m; live > 0;) {
+      live = 0;
+      for (size_t i = 0; i < m; i++) {
+        node_t *x = cur[i];
+        if (x == t->nil) continue;
+        if (b->keys[base + i] >= x->key) {
+          pred[base + i] = x;
+          x = x->right;
+        } else {
+          x = x->left;
+        }
+        __builtin_prefetch(x);
+        cur[i] = x;
+        live += x != t->nil;
+      }
+    }
+  }
+}
+
+// 버퍼의 노드를 key 순서로 트리에 달고 단 노드 수를 반환
+// 자리는 먼저 wbuf_locate로 한꺼번에 찾는다. 회전은 중위 순서를 바꾸지 않으므로 앞 노드 p 뒤의 빈 자리는
+// 그동안 회전이 있었어도 p의 오른쪽 자식이 비었으면 거기, 아니면 p 다음 노드의 왼쪽이다.
+size_t rbtree_flush(rbtree *t) {
+  if (!t || !t->wbuf) return 0;
+  struct rbtree_wbuf *b = t->wbuf;
+  node_t *pred[WBUF_CAP];
+  wbuf_locate(t, pred);
+  node_t *prev = NULL;
+  for (size_t i = 0; i < b->n; i++) {
+    node_t *z = b->nodes[i];
+    node_t *p = pred[i];
+    // 같은 틈에 앞서 단 버퍼 노드가 있으면 그것이 새 앞 노드 (같은 key면 버퍼 노드가 뒤)
+    if (prev && (!p || prev->key >= p->key)) p = prev;
+    node_t *parent = p ? p->right : t->root;
+    int left = 1;
+    if (p && parent == t->nil) {
+      parent = p;
+      left = 0;
+    } else if (parent != t->nil) {
+      while (parent->left != t->nil) parent = parent->left;
+    }
+    link_at(t, parent, z, left);
+    prev = z;
+  }
+  const size_t n = b->n;
+  b->n = 0;
+  return n;
+}
+
+// 트리에서 key보다 큰(dir > 0) 또는 key 이하(dir < 0)인 노드 중 key에 가장 가까운 것 (없으면 NULL)
+static node_t *tree_beyond(const rbtree *t, const key_t key, int dir) {
+  node_t *best = NULL;
+  node_t *x = t->root;
+  while (x != t->nil) {
+    if (dir > 0 ? x->key > key : x->key <= key) {
+      best = x;
+      x = dir > 0 ? x->left : x->right;
+    } else {
+      x = dir > 0 ? x->right : x->left;
+    }
+  }
+  while (best && node_dead(t, best)) { // tombstone은 건너뜀
+    best = dir > 0 ? tree_next(t, best) : tree_prev(t, best);
+  }
+  return best;
+}
+
+// 트리 쪽 후보 tn과 버퍼 쪽 후보 bn 중 중위 순서로 먼저(dir > 0) 또는 나중(dir < 0)인 것
+// 같은 key면 트리 노드가 앞이다.
+static node_t *wbuf_pick(node_t *tn, node_t *bn, int dir) {
+  if (!tn || !bn) return tn ? tn : bn;
+  if (dir > 0) return tn->key <= bn->key ? tn : bn;
+  return bn->key >= tn->key ? bn : tn;
+}
+
+// 트리의 처음(dir > 0) 또는 끝(dir < 0) 노드 tn과 버퍼의 같은 쪽 끝을 견준다.
+static node_t *wbuf_end(const rbtree *t, node_t *tn, int dir) {
+  const struct rbtree_wbuf *b = t->wbuf;
+  if (!b || b->n == 0) return tn;
+  return wbuf_pick(tn, b->nodes[dir > 0 ? 0 : b->n - 1], dir);
+}
+
+// 버퍼와 트리를 합친 중위 순서에서 x의 다음(dir > 0) 또는 이전(dir < 0) 노드 (없으면 NULL)
+static node_t *wbuf_step(const rbtree *t, const node_t *x, int dir) {
+  const struct rbtree_wbuf *b = t->wbuf;
+  node_t *tn;
+  size_t next; // 버퍼 쪽 후보의 자리 (dir < 0이면 바로 뒤 자리)
+  if (x->parent == NULL) {
+    // 버퍼 노드: 같은 key의 트리 노드는 모두 앞에 있다.
+    const size_t i = wbuf_index(b, x);
+    next = dir > 0 ? i + 1 : i;
+    tn = tree_beyond(t, x->key, dir);
+  } else {
+    // 트리 노드: 같은 key의 버퍼 노드는 모두 뒤에 있다.
+    next = wbuf_bound(b, x->key, 0);
+    tn = dir > 0 ? tree_next(t, x) : tree_prev(t, x);
+    while (tn && node_dead(t, tn)) {
+      tn = dir > 0 ? tree_next(t, tn) : tree_prev(t, tn);
+    }
+  }
+  node_t *bn = NULL;
+  if (dir > 0 && next < b->n) bn = b->nodes[next];
+  if (dir < 0 && next > 0) bn = b->nodes[next - 1];
+  return wbuf_pick(tn, bn, dir);
+}
+
+// 트리의 key len개가 든 arr에 버퍼의 key를 뒤에서부터 합쳐 넣는다. (앞쪽 n개까지만 남김)
+static size_t wbuf_merge_array(const rbtree *t, key_t *arr, const size_t n,
+  size_t len) {
+  const struct rbtree_wbuf *b = t->wbuf;
+  size_t total = len;
+  for (size_t i = 0; i < b->n; i++) total += node_count(t, b->nodes[i]);
+  size_t j = b->n, left = 0; // 아직 안 넣은 버퍼 노드 수, 지금 노드의 남은 count
+  key_t bk = 0;
+  for (size_t pos = total; pos-- > 0;) {
+    if (left == 0) {
+      if (j == 0) break; // 남은 트리 key는 이미 제자리
+      bk = b->keys[--j];
+      left = node_count(t, b->nodes[j]);
+    }
+    key_t v;
+    if (len > 0 && arr[len - 1] > bk) { // 같은 key면 버퍼 쪽이 뒤
+      v = arr[--len];
+    } else {
+      v = bk;
+      left--;
+    }
+    if (pos < n) arr[pos] = v;
+  }
+  return total < n ? total : n;
 }
@@ -2,31 +2,245 @@
 #define _RBTREE_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum { RBTREE_RED, RBTREE_BLACK } color_t;
 
 typedef int key_t;
 
+// 균형 정책. 컴파일할 때 -DRBTREE_BALANCE=...로 고른다. (API와 노드 구조는 같음)
+#define RBTREE_BALANCE_RB 0    // 레드-블랙: 삽입/삭제 회전이 적다 (기본)
+#define RBTREE_BALANCE_AVL 1   // AVL: 높이가 가장 낮아 탐색 위주에 유리
+#define RBTREE_BALANCE_WAVL 2  // weak AVL: 삽입만 하면 AVL, 삭제 회전은 2번 이내
+#ifndef RBTREE_BALANCE
+#define RBTREE_BALANCE RBTREE_BALANCE_RB
+#endif
+
+// 트리 생성 옵션 (new_rbtree_flags에 OR로 조합해서 전달)
+enum {
+  RBTREE_COUNTED = 1u << 0,  // 같은 key는 노드 하나에 count로 모아서 저장
+  RBTREE_FINGER = 1u << 1,   // rbtree_find가 스레드별 직전 탐색 위치에서 시작
+  RBTREE_PERSISTENT = 1u << 2,  // 경로 복사로 버전을 남기고 rbtree_snapshot 지원
+  RBTREE_INTRUSIVE = 1u << 3,   // 노드를 호출한 쪽이 소유 (new_rbtree_intrusive로 생성)
+  RBTREE_FILTER = 1u << 4,      // rbtree_find 앞에 "확실히 없음"을 답하는 filter를 둠
+  RBTREE_SMALL = 1u << 5,       // 노드가 적을 때는 트리 구조체 안의 정렬 배열로 저장
+  RBTREE_BTREE = 1u << 6,       // key를 덩어리로 담는 B-tree 엔진 (SIMD 탐색)
+  RBTREE_CONCURRENT = 1u << 7,  // 여러 스레드가 락 없이 동시에 갱신/탐색 (relaxed balance)
+  RBTREE_LAZY = 1u << 8,        // erase는 tombstone 표시만, 실제 제거는 rbtree_purge로 모아서
+  RBTREE_PINNED = 1u << 9,      // 노드 주소가 바뀌지 않음을 보장 (rbtree_compact를 거부)
+  RBTREE_HUGEPAGE = 1u << 10,   // 노드를 huge page mmap chunk(arena)에 저장 (TLB 미스 감소)
+  RBTREE_BUFFERED = 1u << 11,   // 새 노드를 작은 정렬 버퍼에 모았다가 key 순서로 한꺼번에 트리에 닮
+};
+
 typedef struct node_t {
-  color_t color;
+  color_t color;  // AVL/WAVL 정책에서는 rank (RBTREE_BALANCE 참고)
   key_t key;
+  // RBTREE_PERSISTENT 트리와 그 스냅샷의 노드는 여러 버전이 공유하므로 parent가 없다. (항상 nil)
   struct node_t *parent, *left, *right;
 } node_t;
 
+// counted 트리(RBTREE_COUNTED, RBTREE_LAZY, RBTREE_CONCURRENT)가 할당하는 노드.
+// 같은 key의 개수는 이 트리들의 노드 뒤에만 두므로 다른 트리의 node_t는 크기가 그대로다.
+// 개수는 rbtree_count로 읽는다. (counted 트리가 아니면 1)
+typedef struct {
+  node_t node;
+  size_t count;  // 이 노드가 나타내는 key의 개수 (RBTREE_LAZY의 tombstone은 0)
+} rbtree_counted_node;
+
+// rbtree_compact가 노드를 from에서 to로 옮겼을 때 부르는 콜백
+typedef void (*rbtree_move_fn)(void *arg, const struct node_t *from,
+                               struct node_t *to);
+
+// intrusive 트리의 순서 비교: a < b이면 음수, 같으면 0, a > b이면 양수
+typedef int (*rbtree_cmp_t)(const struct node_t *a, const struct node_t *b);
+
+// node_t를 품고 있는 바깥 구조체 포인터 얻기 (container_of)
+#define rbtree_entry(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// 증강(augment) 콜백: 노드마다 요약(합, 최솟값 등)을 바깥 구조체에 두고 트리가 최신으로 유지한다.
+// 요약은 intrusive 트리의 바깥 구조체에 저장하므로 intrusive 트리에서만 쓸 수 있다.
+typedef struct {
+  // n의 요약을 자기 값과 두 자식의 요약으로 다시 계산 (자식이 nil이면 빈 요약)
+  void (*update)(struct node_t *n, const struct node_t *nil);
+  // 범위 질의용: 노드 하나의 값 / 서브트리 전체 요약을 acc에 누적
+  void (*add_node)(void *acc, const struct node_t *n);
+  void (*add_subtree)(void *acc, const struct node_t *n);
+} rbtree_augment_t;
+
+// interval 트리 노드: 호출한 쪽 구조체에 넣어서 쓴다. 닫힌 구간 [link.key, end]
+typedef struct {
+  struct node_t link;  // link.key가 구간 시작점 (정렬 기준)
+  key_t end;           // 구간 끝점 (포함)
+  key_t max_end;       // 이 노드 서브트리의 가장 큰 end (트리가 관리)
+} rbtree_interval;
+
+// 바이트 문자열 key 노드 (new_rbtree_str 트리가 할당하고 해제). memcmp 순서로 정렬
+#define RBTREE_STR_INLINE 8  // 이 길이 이하의 key는 노드 안에 통째로 저장
+typedef struct {
+  struct node_t link;
+  uint64_t prefix;  // key 앞 8바이트를 big-endian으로 읽은 값 (모자라면 0으로 채움)
+  size_t len;       // key 길이 (바이트)
+  union {
+    unsigned char inl[RBTREE_STR_INLINE];  // len <= RBTREE_STR_INLINE이면 key 자체
+    const unsigned char *ptr;              // 더 길면 노드 뒤에 붙여 할당한 key
+  } bytes;
+} rbtree_str;
+
+// s의 key 바이트 (길이는 s->len)
+#define rbtree_str_bytes(s) \
+  ((s)->len <= RBTREE_STR_INLINE ? (s)->bytes.inl : (s)->bytes.ptr)
+
+struct rbtree_pstate;
+struct rbtree_arena;
+struct rbtree_filter;
+struct rbtree_small;
+struct rbtree_btree;
+struct rbtree_conc;
+struct rbtree_log;
+struct rbtree_compact;
+struct rbtree_wbuf;
+
+// rbtree_memory_usage가 채우는 메모리 사용량 (바이트)
+typedef struct {
+  size_t reserved;       // 트리가 잡고 있는 전체 (구조체, sentinel, 노드 저장소, filter, B-tree 덩어리)
+  size_t in_use;         // 그중 살아있는 노드와 부가 구조가 차지하는 부분
+  size_t node_reserved;  // 노드 저장소 (arena chunk 합, 아니면 노드 수 × 노드 크기)
+  size_t huge_bytes;     // 노드 저장소 중 huge page를 요청한 mmap 영역
+  size_t chunks;         // arena chunk 수
+  size_t empty_chunks;   // 살아있는 노드가 없는 chunk 수 (rbtree_shrink가 돌려줄 수 있음)
+  double fragmentation;  // 노드 저장소 중 비어있는 비율 (0 ~ 1)
+} rbtree_memory;
+
+// 여러 트리가 sentinel과 노드 풀을 공유하는 context (rbtree_ctx_new로 생성)
+typedef struct rbtree_ctx rbtree_ctx;
+
+// rbtree_get_stats가 채우는 트리 통계
+typedef struct {
+  size_t nodes;             // 트리의 노드 수
+  size_t filter_bytes;      // 부정 탐색 filter 크기 (없으면 0)
+  size_t filter_negatives;  // filter만으로 "없음"을 답한 탐색 수
+  size_t filter_false_pos;  // filter는 통과했지만 트리에 없던 탐색 수
+  double filter_fpr;        // 관측된 false positive 비율 (없는 key 탐색 중)
+  size_t height;            // 루트에서 가장 깊은 노드까지의 노드 수 (B-tree는 덩어리 단계 수)
+  unsigned long rotations;  // 지금까지 일어난 회전 수
+  size_t tombstones;        // RBTREE_LAZY에서 지웠지만 아직 트리에 남은 노드 수
+  size_t buffered;          // RBTREE_BUFFERED에서 아직 트리에 달지 않은 노드 수 (nodes에 포함)
+} rbtree_stats;
+
 typedef struct {
   node_t *root;
   node_t *nil;  // for sentinel
+  node_t *max;  // 최대 노드 캐시 (빈 트리면 nil)
+  unsigned int flags;
+  unsigned long gen;  // 노드가 해제될 때마다 바뀜 (finger 유효성 검사용)
+  struct rbtree_pstate *pstate;  // persistent 모드의 버전 목록 (아니면 NULL)
+  struct rbtree_arena *arena;    // 노드를 chunk로 관리할 때의 arena (아니면 NULL)
+  rbtree_cmp_t cmp;              // intrusive 트리의 비교 함수 (NULL이면 key로 비교)
+  const rbtree_augment_t *aug;   // 증강 콜백 (안 쓰면 NULL)
+  struct rbtree_filter *filter;  // RBTREE_FILTER의 부정 탐색 filter (아니면 NULL)
+  size_t size;                   // 노드 수
+  struct rbtree_small *small;    // RBTREE_SMALL의 inline 저장 공간 (아니면 NULL)
+  rbtree_ctx *ctx;               // new_rbtree_in으로 만든 트리의 context (아니면 NULL)
+  unsigned long rotations;       // 회전 수 (정책 비교용 통계)
+  struct rbtree_btree *btree;    // RBTREE_BTREE 엔진의 덩어리 트리 (아니면 NULL)
+  struct rbtree_conc *conc;      // RBTREE_CONCURRENT의 chromatic 트리 (아니면 NULL)
+  size_t tombstones;             // RBTREE_LAZY: count가 0인 채로 남아있는 노드 수 (size에 포함)
+  unsigned purge_share;          // tombstone이 노드의 이 %를 넘으면 erase가 rbtree_purge 호출 (기본 0: 안 함)
+  int purge_resume;              // rbtree_purge_step이 purge_from 다음부터 이어서 볼지
+  key_t purge_from;              // rbtree_purge_step이 마지막으로 본 key
+  struct rbtree_log *log;        // rbtree_log_open으로 붙인 연산 로그 (아니면 NULL)
+  struct rbtree_compact *compact;  // 진행 중인 rbtree_compact_step 상태 (아니면 NULL)
+  rbtree_move_fn on_move;        // 노드를 옮길 때 부르는 콜백 (rbtree_set_move_hook)
+  void *move_arg;
+  struct rbtree_wbuf *wbuf;      // RBTREE_BUFFERED의 쓰기 버퍼 (아니면 NULL)
 } rbtree;
 
 rbtree *new_rbtree(void);
+rbtree *new_rbtree_flags(unsigned int flags);
+rbtree *new_rbtree_intrusive(rbtree_cmp_t cmp);
+rbtree *rbtree_build_parallel(const key_t *, size_t, int nthreads);
+rbtree *rbtree_clone(const rbtree *);
 void delete_rbtree(rbtree *);
+void delete_rbtree_async(rbtree *);
+void delete_rbtree_parallel(rbtree *, int nthreads);
+void rbtree_reclaim_wait(void);
+
+rbtree_ctx *rbtree_ctx_new(void);
+void rbtree_ctx_delete(rbtree_ctx *);
+rbtree *new_rbtree_in(rbtree_ctx *);
 
 node_t *rbtree_insert(rbtree *, const key_t);
+node_t *rbtree_insert_hint(rbtree *, node_t *hint, const key_t);
+node_t *rbtree_insert_unique(rbtree *, const key_t, int *existed);
 node_t *rbtree_find(const rbtree *, const key_t);
+size_t rbtree_count(const rbtree *, const node_t *);
+node_t *rbtree_find_from(const rbtree *, node_t *finger, const key_t);
+size_t rbtree_contains_sorted(const rbtree *, const key_t *probes, size_t n,
+                              uint8_t *out_bitmap);
+size_t rbtree_find_sorted(const rbtree *, const key_t *probes, size_t n,
+                          node_t **out);
 node_t *rbtree_min(const rbtree *);
 node_t *rbtree_max(const rbtree *);
 int rbtree_erase(rbtree *, node_t *);
+int rbtree_erase_key(rbtree *, const key_t);
+
+// RBTREE_CONCURRENT: 돌려받은 노드는 read_lock ~ read_unlock 사이에서만 유효하다.
+void rbtree_read_lock(const rbtree *);
+void rbtree_read_unlock(const rbtree *);
 
 int rbtree_to_array(const rbtree *, key_t *, const size_t);
+size_t rbtree_to_array_parallel(const rbtree *, key_t *, const size_t,
+                                int nthreads);
+
+node_t *rbtree_next(const rbtree *, const node_t *);
+node_t *rbtree_prev(const rbtree *, const node_t *);
+
+void rbtree_link(rbtree *, node_t *);
+void rbtree_unlink(rbtree *, node_t *);
+node_t *rbtree_lookup(const rbtree *, const node_t *probe);
+
+int rbtree_set_augment(rbtree *, const rbtree_augment_t *);
+void rbtree_range_aggregate(const rbtree *, const node_t *lo, const node_t *hi,
+                            void *acc);
+
+rbtree *new_rbtree_interval(void);
+void rbtree_interval_init(rbtree_interval *, key_t start, key_t end);
+size_t rbtree_interval_overlaps(const rbtree *, key_t lo, key_t hi,
+                                rbtree_interval **out, size_t max);
+size_t rbtree_interval_stab(const rbtree *, key_t point,
+                            rbtree_interval **out, size_t max);
+
+rbtree *new_rbtree_str(void);
+rbtree_str *rbtree_str_insert(rbtree *, const void *key, size_t len,
+                              int *existed);
+rbtree_str *rbtree_str_find(const rbtree *, const void *key, size_t len);
+int rbtree_str_erase(rbtree *, const void *key, size_t len);
+
+void rbtree_get_stats(const rbtree *, rbtree_stats *);
+void rbtree_memory_usage(const rbtree *, rbtree_memory *);
+size_t rbtree_shrink(rbtree *);
+
+size_t rbtree_purge(rbtree *);
+int rbtree_purge_step(rbtree *, size_t budget);
+size_t rbtree_flush(rbtree *);
+void rbtree_set_purge_share(rbtree *, unsigned percent);
+
+int rbtree_compact(rbtree *);
+int rbtree_compact_step(rbtree *, size_t budget);
+void rbtree_set_move_hook(rbtree *, rbtree_move_fn fn, void *arg);
+
+// insert/erase는 레코드를 버퍼에 덧붙이기만 하므로 디스크 쓰기 오류를 돌려주지 않는다.
+// writer가 겪은 오류는 남아 있다가 rbtree_log_sync/rbtree_checkpoint/rbtree_log_close가 -1로 알린다.
+// (delete_rbtree도 로그를 닫지만 결과를 버리므로 오류를 알려면 rbtree_log_close를 먼저 부른다)
+int rbtree_log_open(rbtree *, const char *base);
+rbtree *rbtree_log_load(const char *base, unsigned int flags);
+int rbtree_checkpoint(rbtree *);
+int rbtree_log_sync(rbtree *);
+int rbtree_log_close(rbtree *);
+
+// 락을 잡지 않고 현재 버전의 불변 뷰를 얻는다. (쓰기 스레드와 동시에 불러도 된다)
+const rbtree *rbtree_snapshot(rbtree *);
+void rbtree_release(const rbtree *);
 
 #endif  // _RBTREE_H_
@@ -1,8 +1,17 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <rbtree.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // new_rbtree should return rbtree struct with null root node
 void test_init(void)
@@ -83,6 +92,38 @@ static void insert_arr(rbtree *t, const key_t *arr, const size_t n)
   }
 }
 
+// allocation failure injection: the test binary is linked with
+// --wrap=malloc and --wrap=calloc, so every allocation in the tree goes here.
+// Once alloc_budget reaches 0 all allocations fail; -1 disables injection.
+static long alloc_budget = -1;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+
+static bool alloc_allowed(void)
+{
+  if (alloc_budget < 0)
+  {
+    return true;
+  }
+  if (alloc_budget == 0)
+  {
+    return false;
+  }
+  alloc_budget--;
+  return true;
+}
+
+void *__wrap_malloc(size_t size)
+{
+  return alloc_allowed() ? __real_malloc(size) : NULL;
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  return alloc_allowed() ? __real_calloc(nmemb, size) : NULL;
+}
+
 static int comp(const void *p1, const void *p2)
 {
   const key_t *e1 = (const key_t *)p1;
@@ -157,6 +198,67 @@ void test_to_array(rbtree *t, const key_t *arr, const size_t n)
   free(res);
 }
 
+// parallel export should match the sequential result, including truncation
+void test_to_array_parallel(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree();
+  rbtree *c = new_rbtree_flags(RBTREE_COUNTED);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = rand() % (n / 4);
+    rbtree_insert(t, arr[i]);
+    rbtree_insert(c, arr[i]);
+  }
+  qsort((void *)arr, n, sizeof(key_t), comp);
+
+  key_t *res = calloc(n, sizeof(key_t));
+  const size_t limits[] = {n, n - 1, n / 2 + 3, 100000, 1};
+  for (int k = 0; k < sizeof(limits) / sizeof(limits[0]); k++)
+  {
+    const size_t m = limits[k];
+    for (int threads = 1; threads <= 5; threads += 2)
+    {
+      for (const rbtree *u = t; u != NULL; u = (u == t) ? c : NULL)
+      {
+        memset(res, -1, n * sizeof(key_t));
+        assert(rbtree_to_array_parallel(u, res, m, threads) == m);
+        for (int i = 0; i < m; i++)
+        {
+          assert(res[i] == arr[i]);
+        }
+        for (int i = m; i < n; i++)
+        {
+          assert(res[i] == -1);
+        }
+      }
+    }
+  }
+  assert(rbtree_to_array(t, res, n) == n);
+
+  // a small tree exported into a large buffer stays sequential and exact
+  rbtree *small = new_rbtree();
+  for (int i = 0; i < 100; i++)
+  {
+    rbtree_insert(small, arr[i]);
+  }
+  memset(res, -1, n * sizeof(key_t));
+  assert(rbtree_to_array_parallel(small, res, n, 5) == 100);
+  assert(rbtree_to_array(small, res, n) == 100);
+  for (int i = 0; i < 100; i++)
+  {
+    assert(res[i] == arr[i]);
+  }
+  assert(res[100] == -1);
+  delete_rbtree(small);
+
+  free(res);
+  free(arr);
+  delete_rbtree(c);
+  delete_rbtree(t);
+}
+
 void test_multi_instance()
 {
   rbtree *t1 = new_rbtree();
@@ -282,6 +384,29 @@ static bool color_traverse(const node_t *p, const color_t parent_color,
          color_traverse(p->right, p->color, next_depth, nil);
 }
 
+#if RBTREE_BALANCE != RBTREE_BALANCE_RB
+// AVL/WAVL builds keep a rank in the color field (nil is rank 0, leaves rank 1)
+static int rank_traverse(const node_t *p, const node_t *nil)
+{
+  if (p == nil)
+  {
+    return 0;
+  }
+  const int l = rank_traverse(p->left, nil);
+  const int r = rank_traverse(p->right, nil);
+  const int rank = (int)p->color - RBTREE_BLACK;
+#if RBTREE_BALANCE == RBTREE_BALANCE_AVL
+  assert(l - r <= 1 && r - l <= 1);
+  assert(rank == 1 + (l > r ? l : r));
+#else
+  assert(rank - l >= 1 && rank - l <= 2);
+  assert(rank - r >= 1 && rank - r <= 2);
+  assert(p->left != nil || p->right != nil || rank == 1);
+#endif
+  return rank;
+}
+#endif
+
 void test_color_constraint(const rbtree *t)
 {
   assert(t != NULL);
@@ -291,6 +416,14 @@ void test_color_constraint(const rbtree *t)
   node_t *nil = NULL;
 #endif
   node_t *p = t->root;
+#if RBTREE_BALANCE != RBTREE_BALANCE_RB
+  // persistent trees are always red-black
+  if (!(t->flags & RBTREE_PERSISTENT))
+  {
+    rank_traverse(p, nil);
+    return;
+  }
+#endif
   assert(p == nil || p->color == RBTREE_BLACK);
 
   init_color_traverse();
@@ -328,6 +461,58 @@ void test_duplicate_values()
   test_rb_constraints(entries, n);
 }
 
+// counted tree should keep one node per key and expand counts in to_array
+void test_counted_duplicates()
+{
+  const key_t entries[] = {10, 5, 5, 34, 6, 23, 12, 12, 6, 12};
+  const size_t n = sizeof(entries) / sizeof(entries[0]);
+  rbtree *t = new_rbtree_flags(RBTREE_COUNTED);
+  assert(t != NULL);
+
+  insert_arr(t, entries, n);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  node_t *p = rbtree_find(t, 12);
+  assert(p != NULL);
+  assert(rbtree_count(t, p) == 3);
+  assert(rbtree_insert(t, 12) == p);
+  assert(rbtree_count(t, p) == 4);
+
+  key_t sorted[] = {5, 5, 6, 6, 10, 12, 12, 12, 12, 23, 34};
+  const size_t m = sizeof(sorted) / sizeof(sorted[0]);
+  key_t *res = calloc(m, sizeof(key_t));
+  rbtree_to_array(t, res, m);
+  for (int i = 0; i < m; i++)
+  {
+    assert(res[i] == sorted[i]);
+  }
+
+  // erase should decrement the count until the last copy is gone
+  for (int i = 0; i < 4; i++)
+  {
+    p = rbtree_find(t, 12);
+    assert(p != NULL);
+    assert(rbtree_count(t, p) == 4 - i);
+    rbtree_erase(t, p);
+  }
+  assert(rbtree_find(t, 12) == NULL);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  free(res);
+  delete_rbtree(t);
+
+  // the count lives only in counted nodes; a plain tree's node has none and reports 1
+  assert(offsetof(rbtree_counted_node, count) == sizeof(node_t));
+  t = new_rbtree();
+  insert_arr(t, entries, n);
+  p = rbtree_find(t, 12);
+  assert(p != NULL && rbtree_count(t, p) == 1);
+  assert(rbtree_count(t, NULL) == 0);
+  delete_rbtree(t);
+}
+
 void test_minmax_suite()
 {
   key_t entries[] = {10, 5, 8, 34, 67, 23, 156, 24, 2, 12};
@@ -384,46 +569,2190 @@ void test_find_erase(rbtree *t, const key_t *arr, const size_t n)
   }
 }
 
-void test_find_erase_fixed()
+// erase_key and insert_unique should behave like find + erase / find + insert
+void test_single_descent_ops()
 {
   const key_t arr[] = {10, 5, 8, 34, 67, 23, 156, 24, 2, 12, 24, 36, 990, 25};
   const size_t n = sizeof(arr) / sizeof(arr[0]);
   rbtree *t = new_rbtree();
   assert(t != NULL);
 
-  test_find_erase(t, arr, n);
+  int existed = -1;
+  for (int i = 0; i < n; i++)
+  {
+    node_t *p = rbtree_insert_unique(t, arr[i], &existed);
+    assert(p != NULL);
+    assert(p->key == arr[i]);
+    assert(existed == (arr[i] == 24 && i == 10));
+  }
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  assert(rbtree_erase_key(t, 1000) == 0);
+  for (int i = 0; i < n; i++)
+  {
+    // 24 appears twice in arr but was stored once
+    assert(rbtree_erase_key(t, arr[i]) == !(arr[i] == 24 && i == 10));
+    assert(rbtree_find(t, arr[i]) == NULL);
+    test_color_constraint(t);
+    test_search_constraint(t);
+  }
+  assert(t->root == t->nil);
 
   delete_rbtree(t);
 }
 
-void test_find_erase_rand(const size_t n, const unsigned int seed)
+// hinted insert should place keys exactly like rbtree_insert
+void test_insert_hint(const size_t n, const unsigned int seed)
 {
   srand(seed);
   rbtree *t = new_rbtree();
   key_t *arr = calloc(n, sizeof(key_t));
+  node_t *hint = NULL;
   for (int i = 0; i < n; i++)
   {
-    arr[i] = rand();
+    // nearly sorted keys with occasional jumps backwards and duplicates
+    arr[i] = i * 4 - (rand() % 16);
+    hint = rbtree_insert_hint(t, (rand() % 8) ? hint : rbtree_min(t), arr[i]);
+    assert(hint != NULL);
+    assert(hint->key == arr[i]);
   }
+  test_color_constraint(t);
+  test_search_constraint(t);
 
-  test_find_erase(t, arr, n);
+  qsort((void *)arr, n, sizeof(key_t), comp);
+  key_t *res = calloc(n, sizeof(key_t));
+  rbtree_to_array(t, res, n);
+  for (int i = 0; i < n; i++)
+  {
+    assert(arr[i] == res[i]);
+  }
+
+  // the cached max should follow erases of the maximum
+  for (int i = n - 1; i >= 0; i--)
+  {
+    node_t *q = rbtree_max(t);
+    assert(q != NULL);
+    assert(q->key == arr[i]);
+    rbtree_erase(t, q);
+  }
+  assert(rbtree_max(t) == NULL);
 
+  free(res);
   free(arr);
   delete_rbtree(t);
 }
 
-int main(void)
+// a hint in the right subtree of an equal key must count that key instead of
+// adding a second node for it (counted and lazy trees)
+void test_insert_hint_equal_parent(void)
 {
-  test_init();
-  test_insert_single(1024);
-  test_find_single(512, 1024);
-  test_erase_root(128);
-  test_find_erase_fixed();
-  test_minmax_suite();
-  test_to_array_suite();
-  test_distinct_values();
-  test_duplicate_values();
-  test_multi_instance();
+  const key_t keys[] = {10, 5, 20, 3, 7, 15, 25, 6, 8};
+  const size_t n = sizeof(keys) / sizeof(keys[0]);
+  const unsigned int flags[] = {RBTREE_COUNTED, RBTREE_LAZY};
+  for (int f = 0; f < 2; f++)
+  {
+    rbtree *t = new_rbtree_flags(flags[f]);
+    insert_arr(t, keys, n);
+    const size_t size = t->size;
+    node_t *p = rbtree_insert_hint(t, rbtree_find(t, 8), 7);
+    assert(p != NULL);
+    assert(p == rbtree_find(t, 7));
+    assert(rbtree_count(t, p) == 2);
+    assert(t->size == size);
+
+    // a tombstone of an equal key is revived the same way
+    if (flags[f] & RBTREE_LAZY)
+    {
+      rbtree_erase(t, rbtree_find(t, 10));
+      node_t *q = rbtree_insert_hint(t, rbtree_find(t, 15), 10);
+      assert(q != NULL && q->key == 10 && rbtree_count(t, q) == 1);
+      assert(t->size == size);
+    }
+    test_color_constraint(t);
+    test_search_constraint(t);
+    delete_rbtree(t);
+  }
+}
+
+// finger search should find the same keys as a search from the root
+void test_find_from(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree_flags(RBTREE_FINGER);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = rand() % (2 * n);
+    rbtree_insert(t, arr[i]);
+  }
+
+  // random fingers, present and absent keys
+  for (int i = 0; i < n; i++)
+  {
+    node_t *finger = rbtree_find(t, arr[rand() % n]);
+    assert(finger != NULL);
+    node_t *p = rbtree_find_from(t, finger, arr[i]);
+    assert(p != NULL);
+    assert(p->key == arr[i]);
+    p = rbtree_find_from(t, finger, -1 - i);
+    assert(p == NULL);
+  }
+
+  // localized scan through the implicit per-thread finger, with erases in between
+  qsort((void *)arr, n, sizeof(key_t), comp);
+  for (int i = 0; i < n; i++)
+  {
+    node_t *p = rbtree_find(t, arr[i]);
+    assert(p != NULL);
+    assert(p->key == arr[i]);
+    if (i % 3 == 0)
+    {
+      rbtree_erase(t, p);
+    }
+  }
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  free(arr);
+  delete_rbtree(t);
+}
+
+static void check_snapshot(const rbtree *s, const key_t *sorted, const size_t n)
+{
+  test_color_constraint(s);
+  test_search_constraint(s);
+  key_t *res = calloc(n + 1, sizeof(key_t));
+  rbtree_to_array(s, res, n + 1);
+  for (int i = 0; i < n; i++)
+  {
+    assert(res[i] == sorted[i]);
+  }
+  if (n > 0)
+  {
+    assert(rbtree_min(s)->key == sorted[0]);
+    assert(rbtree_max(s)->key == sorted[n - 1]);
+  }
+  // persistent nodes have no parent pointers; next/prev must still walk the view
+  // (later writes never touch a shared node, so its parent stays nil)
+  size_t i = 0;
+  for (node_t *p = rbtree_min(s); p != NULL; p = rbtree_next(s, p))
+  {
+    assert(i < n && p->key == sorted[i] && p->parent == s->nil);
+    i++;
+  }
+  assert(i == n);
+  for (node_t *p = rbtree_max(s); p != NULL; p = rbtree_prev(s, p))
+  {
+    assert(i > 0 && p->key == sorted[i - 1]);
+    i--;
+  }
+  assert(i == 0);
+  // the sorted join walks the view from its own root
+  uint8_t *bits = calloc(n / 8 + 1, 1);
+  assert(rbtree_contains_sorted(s, sorted, n, bits) == n);
+  free(bits);
+  // a clone of a tree or a snapshot is an independent persistent tree
+  rbtree *c = rbtree_clone(s);
+  assert(c != NULL && (c->flags & RBTREE_PERSISTENT));
+  memset(res, 0, (n + 1) * sizeof(key_t));
+  assert(rbtree_to_array(c, res, n + 1) == n);
+  for (int i = 0; i < n; i++)
+  {
+    assert(res[i] == sorted[i]);
+  }
+  test_color_constraint(c);
+  test_search_constraint(c);
+  delete_rbtree(c);
+  free(res);
+}
+
+static void *snapshot_reader(void *arg)
+{
+  rbtree *t = arg;
+  for (int i = 0; i < 200; i++)
+  {
+    const rbtree *s = rbtree_snapshot(t);
+    test_color_constraint(s);
+    test_search_constraint(s);
+    rbtree_release(s);
+  }
+  return NULL;
+}
+
+// snapshots of a persistent tree should not change while the tree is modified
+void test_persistent_snapshots(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree_flags(RBTREE_PERSISTENT);
+  assert(t != NULL);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = rand() % n;
+    assert(rbtree_insert(t, arr[i])->key == arr[i]);
+  }
+  const rbtree *s1 = rbtree_snapshot(t);
+  key_t *sorted1 = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    sorted1[i] = arr[i];
+  }
+  qsort((void *)sorted1, n, sizeof(key_t), comp);
+
+  pthread_t reader;
+  pthread_create(&reader, NULL, snapshot_reader, t);
+
+  // erase the first half (by node and by key) and insert new keys
+  for (int i = 0; i < n / 2; i++)
+  {
+    if (i % 2)
+    {
+      assert(rbtree_erase_key(t, arr[i]) == 1);
+    }
+    else
+    {
+      node_t *p = rbtree_find(t, arr[i]);
+      assert(p != NULL);
+      rbtree_erase(t, p);
+    }
+    arr[i] = n + rand() % n;
+    rbtree_insert(t, arr[i]);
+  }
+  pthread_join(reader, NULL);
+
+  const rbtree *s2 = rbtree_snapshot(t);
+  qsort((void *)arr, n, sizeof(key_t), comp);
+  check_snapshot(s1, sorted1, n);
+  check_snapshot(s2, arr, n);
+  check_snapshot(t, arr, n);
+  rbtree_release(s1);
+
+  // erase everything; s2 must stay intact until released
+  for (int i = 0; i < n; i++)
+  {
+    assert(rbtree_erase_key(t, arr[i]) == 1);
+  }
+  assert(t->root == t->nil);
+  check_snapshot(s2, arr, n);
+  rbtree_release(s2);
+
+  free(sorted1);
+  free(arr);
+  delete_rbtree(t);
+}
+
+// a failed allocation must leave a persistent tree and its current version
+// untouched: insert returns NULL, erase reports -1, and retrying succeeds
+void test_persistent_alloc_failure(const size_t n)
+{
+  rbtree *t = new_rbtree_flags(RBTREE_PERSISTENT);
+  assert(t != NULL);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = (key_t)(i * 7919 % n);
+  }
+  key_t *sorted = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    const rbtree *before = rbtree_snapshot(t);
+    for (long budget = 0;; budget++)
+    {
+      alloc_budget = budget;
+      node_t *p = rbtree_insert(t, arr[i]);
+      alloc_budget = -1;
+      if (p != NULL)
+      {
+        assert(p->key == arr[i]);
+        break;
+      }
+      const rbtree *after = rbtree_snapshot(t);
+      assert(after == before);
+      rbtree_release(after);
+      assert(t->size == i);
+      check_snapshot(t, sorted, i);
+    }
+    rbtree_release(before);
+    sorted[i] = arr[i];
+    qsort((void *)sorted, i + 1, sizeof(key_t), comp);
+  }
+
+  size_t left = n;
+  for (int i = 0; i < n; i++)
+  {
+    const rbtree *before = rbtree_snapshot(t);
+    for (long budget = 0;; budget++)
+    {
+      alloc_budget = budget;
+      const int r = budget % 2 ? rbtree_erase_key(t, arr[i])
+                               : rbtree_erase(t, rbtree_find(t, arr[i]));
+      alloc_budget = -1;
+      if (r >= 0)
+      {
+        break;
+      }
+      const rbtree *after = rbtree_snapshot(t);
+      assert(after == before);
+      rbtree_release(after);
+      assert(t->size == left);
+      check_snapshot(t, sorted, left);
+    }
+    rbtree_release(before);
+    // drop arr[i] from the expected keys
+    size_t j = 0;
+    while (sorted[j] != arr[i])
+    {
+      j++;
+    }
+    memmove(sorted + j, sorted + j + 1, (left - j - 1) * sizeof(key_t));
+    left--;
+    check_snapshot(t, sorted, left);
+  }
+  assert(t->root == t->nil);
+
+  free(sorted);
+  free(arr);
+  delete_rbtree(t);
+}
+
+// bulk-built tree should satisfy the constraints and keep working afterwards
+void test_build_parallel(const size_t n, const int nthreads,
+                         const unsigned int seed)
+{
+  srand(seed);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = rand() - RAND_MAX / 2;
+    if (i % 10 == 0 && i > 0)
+    {
+      arr[i] = arr[i - 1];
+    }
+  }
+  rbtree *t = rbtree_build_parallel(arr, n, nthreads);
+  assert(t != NULL);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  qsort((void *)arr, n, sizeof(key_t), comp);
+  key_t *res = calloc(n, sizeof(key_t));
+  assert(rbtree_to_array(t, res, n) == n);
+  for (int i = 0; i < n; i++)
+  {
+    assert(arr[i] == res[i]);
+  }
+  if (n > 0)
+  {
+    assert(rbtree_min(t)->key == arr[0]);
+    assert(rbtree_max(t)->key == arr[n - 1]);
+  }
+
+  // nodes from the bulk slab must be erasable and reusable
+  for (int i = 0; i < n; i += 2)
+  {
+    assert(rbtree_erase_key(t, arr[i]) == 1);
+  }
+  for (int i = 0; i < n; i += 2)
+  {
+    rbtree_insert(t, arr[i]);
+  }
+  test_color_constraint(t);
+  test_search_constraint(t);
+  assert(rbtree_to_array(t, res, n) == n);
+  for (int i = 0; i < n; i++)
+  {
+    assert(arr[i] == res[i]);
+  }
+
+  free(res);
+  free(arr);
+  delete_rbtree(t);
+}
+
+typedef struct
+{
+  double score;
+  int id;
+  node_t link;
+} entry_t;
+
+static int entry_cmp(const node_t *a, const node_t *b)
+{
+  const entry_t *x = rbtree_entry(a, entry_t, link);
+  const entry_t *y = rbtree_entry(b, entry_t, link);
+  return (x->score > y->score) - (x->score < y->score);
+}
+
+// intrusive tree should order caller-owned objects without allocating nodes
+void test_intrusive(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  entry_t *items = calloc(n, sizeof(entry_t));
+  rbtree *t = new_rbtree_intrusive(entry_cmp);
+  assert(t != NULL);
+  assert(rbtree_insert(t, 1) == NULL);
+  for (int i = 0; i < n; i++)
+  {
+    items[i].id = i;
+    items[i].score = (rand() % 1000) / 10.0;
+    rbtree_link(t, &items[i].link);
+  }
+  test_color_constraint(t);
+
+  // in-order walk should visit scores in non-decreasing order
+  size_t seen = 0;
+  double prev = -1;
+  for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p))
+  {
+    entry_t *e = rbtree_entry(p, entry_t, link);
+    assert(e->score >= prev);
+    prev = e->score;
+    seen++;
+  }
+  assert(seen == n);
+  assert(rbtree_entry(rbtree_max(t), entry_t, link)->score == prev);
+
+  entry_t probe = {.score = items[n / 2].score};
+  node_t *hit = rbtree_lookup(t, &probe.link);
+  assert(hit != NULL);
+  assert(rbtree_entry(hit, entry_t, link)->score == probe.score);
+
+  // unlink every other object, then relink them
+  for (int i = 0; i < n; i += 2)
+  {
+    rbtree_unlink(t, &items[i].link);
+  }
+  test_color_constraint(t);
+  for (int i = 0; i < n; i += 2)
+  {
+    rbtree_link(t, &items[i].link);
+  }
+  test_color_constraint(t);
+  seen = 0;
+  for (node_t *p = rbtree_max(t); p != NULL; p = rbtree_prev(t, p))
+  {
+    seen++;
+  }
+  assert(seen == n);
+
+  // the tree must not free caller-owned nodes
+  delete_rbtree(t);
+  free(items);
+}
+
+typedef struct
+{
+  long sum;
+  int min, max;
+  size_t cnt;
+} agg_t;
+
+typedef struct
+{
+  node_t link; // ordered by link.key
+  int value;
+  agg_t agg;   // summary of the subtree rooted here
+} item_t;
+
+static const agg_t agg_identity = {0, INT_MAX, INT_MIN, 0};
+
+static void agg_merge(agg_t *acc, const agg_t *a)
+{
+  acc->sum += a->sum;
+  acc->min = a->min < acc->min ? a->min : acc->min;
+  acc->max = a->max > acc->max ? a->max : acc->max;
+  acc->cnt += a->cnt;
+}
+
+static void item_update(node_t *n, const node_t *nil)
+{
+  item_t *it = rbtree_entry(n, item_t, link);
+  it->agg = (agg_t){it->value, it->value, it->value, 1};
+  if (n->left != nil)
+  {
+    agg_merge(&it->agg, &rbtree_entry(n->left, item_t, link)->agg);
+  }
+  if (n->right != nil)
+  {
+    agg_merge(&it->agg, &rbtree_entry(n->right, item_t, link)->agg);
+  }
+}
+
+static void item_add_node(void *acc, const node_t *n)
+{
+  const item_t *it = rbtree_entry(n, item_t, link);
+  const agg_t one = {it->value, it->value, it->value, 1};
+  agg_merge(acc, &one);
+}
+
+static void item_add_subtree(void *acc, const node_t *n)
+{
+  agg_merge(acc, &rbtree_entry(n, item_t, link)->agg);
+}
+
+static const rbtree_augment_t item_aug = {item_update, item_add_node,
+                                          item_add_subtree};
+
+// range aggregates should match a linear scan through link/unlink churn
+void test_range_aggregate(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  item_t *items = calloc(n, sizeof(item_t));
+  bool *linked = calloc(n, sizeof(bool));
+  rbtree *t = new_rbtree_intrusive(NULL);
+  assert(rbtree_set_augment(t, &item_aug) == 0);
+  for (int i = 0; i < n; i++)
+  {
+    items[i].link.key = rand() % 500;
+    items[i].value = rand() % 2001 - 1000;
+  }
+
+  for (int round = 0; round < 4 * n; round++)
+  {
+    const int i = rand() % n;
+    if (linked[i])
+    {
+      rbtree_unlink(t, &items[i].link);
+    }
+    else
+    {
+      rbtree_link(t, &items[i].link);
+    }
+    linked[i] = !linked[i];
+    if (round % 50 != 0)
+    {
+      continue;
+    }
+
+    test_color_constraint(t);
+    node_t lo = {.key = rand() % 520 - 10};
+    node_t hi = {.key = lo.key + rand() % 200};
+    agg_t got = agg_identity, want = agg_identity;
+    rbtree_range_aggregate(t, &lo, &hi, &got);
+    for (int j = 0; j < n; j++)
+    {
+      if (linked[j] && items[j].link.key >= lo.key &&
+          items[j].link.key <= hi.key)
+      {
+        const agg_t one = {items[j].value, items[j].value, items[j].value, 1};
+        agg_merge(&want, &one);
+      }
+    }
+    assert(got.sum == want.sum && got.cnt == want.cnt);
+    assert(got.min == want.min && got.max == want.max);
+  }
+
+  // plain trees have nowhere to keep summaries
+  rbtree *u = new_rbtree();
+  assert(rbtree_set_augment(u, &item_aug) == -1);
+  delete_rbtree(u);
+
+  delete_rbtree(t);
+  free(linked);
+  free(items);
+}
+
+typedef struct
+{
+  int session_id;
+  rbtree_interval iv;
+} session_t;
+
+// overlap and stabbing queries should match a linear scan
+void test_interval_queries(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  session_t *s = calloc(n, sizeof(session_t));
+  bool *linked = calloc(n, sizeof(bool));
+  rbtree_interval **out = calloc(n, sizeof(rbtree_interval *));
+  rbtree *t = new_rbtree_interval();
+  assert(t != NULL);
+  for (int i = 0; i < n; i++)
+  {
+    const key_t start = rand() % 10000;
+    s[i].session_id = i;
+    rbtree_interval_init(&s[i].iv, start, start + rand() % 300);
+    rbtree_link(t, &s[i].iv.link);
+    linked[i] = true;
+  }
+  // drop a third of them again
+  for (int i = 0; i < n; i += 3)
+  {
+    rbtree_unlink(t, &s[i].iv.link);
+    linked[i] = false;
+  }
+  test_color_constraint(t);
+
+  for (int q = 0; q < 200; q++)
+  {
+    const key_t lo = rand() % 10500 - 200;
+    const key_t hi = (q % 2) ? lo : lo + rand() % 500;
+    const size_t got = (lo == hi) ? rbtree_interval_stab(t, lo, out, n)
+                                  : rbtree_interval_overlaps(t, lo, hi, out, n);
+    size_t want = 0;
+    for (int i = 0; i < n; i++)
+    {
+      if (linked[i] && s[i].iv.link.key <= hi && s[i].iv.end >= lo)
+      {
+        want++;
+      }
+    }
+    assert(got == want);
+    for (int k = 0; k < got; k++)
+    {
+      assert(out[k]->link.key <= hi && out[k]->end >= lo);
+      assert(k == 0 || out[k - 1]->link.key <= out[k]->link.key);
+      session_t *owner = rbtree_entry(out[k], session_t, iv);
+      assert(linked[owner->session_id]);
+    }
+    // output limit
+    if (got > 2)
+    {
+      assert(rbtree_interval_overlaps(t, lo, hi, out, 2) == 2);
+    }
+  }
+
+  delete_rbtree(t);
+  free(out);
+  free(linked);
+  free(s);
+}
+
+void test_negative_filter(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree_flags(RBTREE_FILTER);
+  assert(t != NULL);
+  key_t *arr = calloc(n, sizeof(key_t));
+  rbtree_stats st;
+  rbtree_get_stats(t, &st);
+  const size_t initial_bytes = st.filter_bytes;
+  assert(initial_bytes > 0);
+
+  // even keys only, so every odd key is a guaranteed miss
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = (rand() % (int)(n * 10)) * 2;
+    rbtree_insert(t, arr[i]);
+  }
+  test_color_constraint(t);
+  rbtree_get_stats(t, &st);
+  assert(st.nodes == n);
+  assert(st.filter_bytes > initial_bytes); // grew past the starting capacity
+
+  // erase half, then no false negatives for what remains
+  for (int i = 0; i < n; i += 2)
+  {
+    assert(rbtree_erase_key(t, arr[i]));
+  }
+  for (int i = 1; i < n; i += 2)
+  {
+    node_t *p = rbtree_find(t, arr[i]);
+    assert(p != NULL && p->key == arr[i]);
+  }
+  for (int i = 0; i < n; i++)
+  {
+    assert(rbtree_find(t, arr[i] + 1) == NULL);
+  }
+  rbtree_get_stats(t, &st);
+  assert(st.nodes == n - (n + 1) / 2);
+  assert(st.filter_negatives + st.filter_false_pos >= n);
+  assert(st.filter_fpr < 0.05);
+
+  delete_rbtree(t);
+  free(arr);
+}
+
+void test_small_trees(const int ntrees, const unsigned int seed)
+{
+  srand(seed);
+  key_t arr[24], res[24];
+  node_t *nodes[24];
+  for (int k = 0; k < ntrees; k++)
+  {
+    const unsigned int flags = RBTREE_SMALL | ((k % 3 == 0) ? RBTREE_COUNTED : 0);
+    rbtree *t = new_rbtree_flags(flags);
+    assert(t != NULL);
+    assert(rbtree_min(t) == NULL && rbtree_max(t) == NULL);
+    const int n = k % 24;
+    for (int i = 0; i < n; i++)
+    {
+      arr[i] = rand() % 16;
+      nodes[i] = rbtree_insert(t, arr[i]);
+      assert(nodes[i] != NULL && nodes[i]->key == arr[i]);
+    }
+    // node pointers survive the switch to a real tree
+    for (int i = 0; i < n; i++)
+    {
+      assert(nodes[i]->key == arr[i]);
+    }
+    test_color_constraint(t);
+    qsort((void *)arr, n, sizeof(key_t), comp);
+    assert(rbtree_to_array(t, res, n) == n);
+    for (int i = 0; i < n; i++)
+    {
+      assert(res[i] == arr[i]);
+      assert(rbtree_find(t, arr[i]) != NULL);
+    }
+
+    // walk forward and back
+    int seen = 0;
+    for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p))
+    {
+      seen += rbtree_count(t, p);
+      assert(rbtree_next(t, p) == NULL || rbtree_next(t, p)->key >= p->key);
+    }
+    assert(seen == n);
+    for (node_t *p = rbtree_max(t); p != NULL; p = rbtree_prev(t, p))
+    {
+      seen -= rbtree_count(t, p);
+    }
+    assert(seen == 0);
+
+    int existed;
+    node_t *u = rbtree_insert_unique(t, 100, &existed);
+    assert(u != NULL && u->key == 100 && !existed);
+    assert(rbtree_insert_unique(t, 100, &existed) == u && existed);
+    assert(rbtree_max(t) == u);
+    assert(rbtree_erase_key(t, 100) && rbtree_find(t, 100) == NULL);
+
+    for (int i = 0; i < n; i++)
+    {
+      assert(rbtree_erase_key(t, arr[i]));
+    }
+    assert(rbtree_min(t) == NULL);
+    test_color_constraint(t);
+    // freed slots are handed out again
+    for (int i = 0; i < 3; i++)
+    {
+      rbtree_insert(t, i);
+    }
+    assert(rbtree_to_array(t, res, 3) == 3 && res[0] == 0 && res[2] == 2);
+    delete_rbtree(t);
+  }
+}
+
+#define CTX_TREES 64
+#define CTX_KEYS 48
+
+typedef struct
+{
+  rbtree_ctx *ctx;
+  rbtree *trees[CTX_TREES];
+  int counts[CTX_TREES][CTX_KEYS];
+  unsigned int seed;
+} ctx_worker_t;
+
+// random inserts/erases on trees sharing one context, checked against counts
+static void *ctx_worker(void *arg)
+{
+  ctx_worker_t *w = arg;
+  for (int i = 0; i < CTX_TREES; i++)
+  {
+    w->trees[i] = new_rbtree_in(w->ctx);
+    assert(w->trees[i] != NULL);
+  }
+  for (int op = 0; op < 40000; op++)
+  {
+    const int i = rand_r(&w->seed) % CTX_TREES;
+    const key_t key = rand_r(&w->seed) % CTX_KEYS;
+    if (rand_r(&w->seed) % 3)
+    {
+      assert(rbtree_insert(w->trees[i], key)->key == key);
+      w->counts[i][key]++;
+    }
+    else
+    {
+      assert(rbtree_erase_key(w->trees[i], key) == (w->counts[i][key] > 0));
+      if (w->counts[i][key] > 0)
+      {
+        w->counts[i][key]--;
+      }
+    }
+    // now and then throw a tree away so its nodes go back to the pool
+    if (op % 5000 == 4999)
+    {
+      delete_rbtree(w->trees[i]);
+      w->trees[i] = new_rbtree_in(w->ctx);
+      memset(w->counts[i], 0, sizeof(w->counts[i]));
+    }
+  }
+  for (int i = 0; i < CTX_TREES; i++)
+  {
+    int prev = -1;
+    int total = 0;
+    for (node_t *p = rbtree_min(w->trees[i]); p != NULL;
+         p = rbtree_next(w->trees[i], p))
+    {
+      assert(p->key >= prev && w->counts[i][p->key] > 0);
+      prev = p->key;
+      total++;
+    }
+    for (int k = 0; k < CTX_KEYS; k++)
+    {
+      total -= w->counts[i][k];
+    }
+    assert(total == 0);
+  }
+  return NULL;
+}
+
+// trees created in one context share the sentinel and node pool across threads
+void test_shared_ctx(const int nthreads, const unsigned int seed)
+{
+  rbtree_ctx *ctx = rbtree_ctx_new();
+  assert(ctx != NULL);
+  ctx_worker_t *w = calloc(nthreads, sizeof(ctx_worker_t));
+  pthread_t *th = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+  {
+    w[i].ctx = ctx;
+    w[i].seed = seed + i;
+    pthread_create(&th[i], NULL, ctx_worker, &w[i]);
+  }
+  for (int i = 0; i < nthreads; i++)
+  {
+    pthread_join(th[i], NULL);
+  }
+
+  const node_t *nil = w[0].trees[0]->nil;
+  for (int i = 0; i < nthreads; i++)
+  {
+    for (int k = 0; k < CTX_TREES; k++)
+    {
+      assert(w[i].trees[k]->nil == nil);
+      test_color_constraint(w[i].trees[k]);
+      test_search_constraint(w[i].trees[k]);
+      delete_rbtree(w[i].trees[k]);
+    }
+  }
+  // the shared sentinel is never written
+  assert(nil->color == RBTREE_BLACK && nil->parent == nil);
+  rbtree_ctx_delete(ctx);
+  free(th);
+  free(w);
+}
+
+// the B-tree engine keeps the same multiset semantics behind the same API
+void test_btree_engine(const size_t n, const unsigned int flags,
+                       const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree_flags(RBTREE_BTREE | flags);
+  assert(t != NULL);
+  assert(rbtree_min(t) == NULL && rbtree_max(t) == NULL);
+  key_t *arr = calloc(n, sizeof(key_t));
+  key_t *res = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = rand() % (int)(n / 4) - (int)(n / 8);
+    node_t *p = rbtree_insert(t, arr[i]);
+    assert(p != NULL && p->key == arr[i]);
+  }
+  qsort((void *)arr, n, sizeof(key_t), comp);
+  assert(rbtree_to_array(t, res, n) == n);
+  for (int i = 0; i < n; i++)
+  {
+    assert(res[i] == arr[i]);
+    assert(rbtree_find(t, arr[i])->key == arr[i]);
+  }
+  assert(rbtree_find(t, INT_MAX) == NULL && rbtree_find(t, INT_MIN) == NULL);
+  assert(rbtree_min(t)->key == arr[0] && rbtree_max(t)->key == arr[n - 1]);
+
+  size_t seen = 0;
+  for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p))
+  {
+    assert(p->key == arr[seen]);
+    seen += rbtree_count(t, p);
+  }
+  assert(seen == n);
+  for (node_t *p = rbtree_max(t); p != NULL; p = rbtree_prev(t, p))
+  {
+    seen -= rbtree_count(t, p);
+    assert(p->key == arr[seen]);
+  }
+  assert(seen == 0);
+
+  int existed;
+  assert(rbtree_insert_unique(t, arr[0], &existed)->key == arr[0] && existed);
+
+  // erase by node and by key, then drain
+  for (int i = 0; i < n; i += 2)
+  {
+    if (i % 4)
+    {
+      assert(rbtree_erase_key(t, arr[i]));
+    }
+    else
+    {
+      rbtree_erase(t, rbtree_find(t, arr[i]));
+    }
+  }
+  for (int i = 1; i < n; i += 2)
+  {
+    assert(rbtree_find(t, arr[i]) != NULL);
+  }
+  for (int i = 1; i < n; i += 2)
+  {
+    assert(rbtree_erase_key(t, arr[i]));
+  }
+  assert(rbtree_min(t) == NULL && rbtree_to_array(t, res, n) == 0);
+
+  free(res);
+  free(arr);
+  delete_rbtree(t);
+}
+
+#define CONC_OWNED 512  // keys owned by each writer
+#define CONC_STABLE 256 // keys inserted up front and never erased
+#define CONC_HOT 4      // keys every writer inserts and erases
+
+typedef struct
+{
+  rbtree *t;
+  int id, nthreads;
+  int counts[CONC_OWNED];
+  unsigned int seed;
+} conc_worker_t;
+
+// owned key i of writer w; stable keys are the negative ones
+static key_t conc_owned_key(const conc_worker_t *w, const int i)
+{
+  return CONC_HOT + i * w->nthreads + w->id;
+}
+
+// Each writer checks the result of every operation on its own keys against a
+// sequential model, while all writers race on the hot keys and on the shape of
+// the tree. Lookups of keys nobody touches must never see a transient state.
+static void *conc_worker(void *arg)
+{
+  conc_worker_t *w = arg;
+  int hot[CONC_HOT] = {0};
+  for (int op = 0; op < 20000; op++)
+  {
+    const int i = rand_r(&w->seed) % CONC_OWNED;
+    const key_t key = conc_owned_key(w, i);
+    const int h = rand_r(&w->seed) % CONC_HOT;
+    switch (rand_r(&w->seed) % 6)
+    {
+    case 0:
+    case 1:
+      // the returned leaf may already be replaced by a rebalancing step of
+      // another writer, so counts are only compared once everyone is done
+      assert(rbtree_insert(w->t, key) != NULL);
+      w->counts[i]++;
+      break;
+    case 2:
+      assert(rbtree_erase_key(w->t, key) == (w->counts[i] > 0));
+      w->counts[i] -= w->counts[i] > 0;
+      break;
+    case 3:
+    {
+      // returned leaves may be replaced at any time; they stay readable only
+      // inside a read section (nested calls enter it again)
+      rbtree_read_lock(w->t);
+      node_t *p = rbtree_find(w->t, key);
+      assert((p != NULL) == (w->counts[i] > 0));
+      node_t *q = rbtree_find(w->t, h);
+      node_t *r = rbtree_next(w->t, rbtree_min(w->t));
+      sched_yield();
+      assert(p == NULL || (p->key == key && rbtree_count(w->t, p) == w->counts[i]));
+      assert(q == NULL || (q->key == h && rbtree_count(w->t, q) > 0));
+      assert(r != NULL && r->key == 1 - CONC_STABLE && rbtree_count(w->t, r) == 1);
+      rbtree_read_unlock(w->t);
+      break;
+    }
+    case 4:
+      // a hot key holds at least the copies this writer has not erased yet
+      if (hot[h] > 0 && rand_r(&w->seed) % 2)
+      {
+        assert(rbtree_erase_key(w->t, h) == 1);
+        hot[h]--;
+      }
+      else
+      {
+        assert(rbtree_insert(w->t, h) != NULL);
+        hot[h]++;
+      }
+      break;
+    default:
+      assert(rbtree_find(w->t, -1 - rand_r(&w->seed) % CONC_STABLE) != NULL);
+      assert(rbtree_find(w->t, INT_MIN) == NULL);
+      break;
+    }
+  }
+  for (int h = 0; h < CONC_HOT; h++)
+  {
+    for (; hot[h] > 0; hot[h]--)
+    {
+      assert(rbtree_erase_key(w->t, h) == 1);
+    }
+  }
+  return NULL;
+}
+
+// RBTREE_CONCURRENT: writers update one tree without a global lock
+void test_concurrent_tree(const int nthreads, const unsigned int seed)
+{
+  rbtree *t = new_rbtree_flags(RBTREE_CONCURRENT);
+  assert(t != NULL);
+  assert(rbtree_min(t) == NULL && rbtree_max(t) == NULL);
+  for (int k = 1; k <= CONC_STABLE; k++)
+  {
+    assert(rbtree_insert(t, -k)->key == -k);
+  }
+  conc_worker_t *w = calloc(nthreads, sizeof(conc_worker_t));
+  pthread_t *th = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+  {
+    w[i].t = t;
+    w[i].id = i;
+    w[i].nthreads = nthreads;
+    w[i].seed = seed + i;
+    pthread_create(&th[i], NULL, conc_worker, &w[i]);
+  }
+  for (int i = 0; i < nthreads; i++)
+  {
+    pthread_join(th[i], NULL);
+  }
+
+  // quiescent: the tree holds exactly the model, in order
+  size_t total = CONC_STABLE, distinct = CONC_STABLE;
+  for (int i = 0; i < nthreads; i++)
+  {
+    for (int k = 0; k < CONC_OWNED; k++)
+    {
+      total += w[i].counts[k];
+      distinct += w[i].counts[k] > 0;
+      node_t *p = rbtree_find(t, conc_owned_key(&w[i], k));
+      assert(p == NULL ? w[i].counts[k] == 0 : rbtree_count(t, p) == w[i].counts[k]);
+    }
+  }
+  for (int h = 0; h < CONC_HOT; h++)
+  {
+    assert(rbtree_find(t, h) == NULL);
+  }
+  key_t *res = calloc(total + 1, sizeof(key_t));
+  assert(rbtree_to_array(t, res, total + 1) == total);
+  for (size_t i = 1; i < total; i++)
+  {
+    assert(res[i - 1] <= res[i]);
+  }
+  size_t seen = 0;
+  for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p))
+  {
+    assert(p->key == res[seen]);
+    seen += rbtree_count(t, p);
+  }
+  assert(seen == total);
+  for (node_t *p = rbtree_max(t); p != NULL; p = rbtree_prev(t, p))
+  {
+    seen -= rbtree_count(t, p);
+    assert(p->key == res[seen]);
+  }
+  assert(seen == 0);
+
+  // every writer repaired what it broke, so the tree is red-black again:
+  // a leaf-oriented tree of m keys has 2m nodes and height <= 2 log2(2m) + 2
+  rbtree_stats st;
+  rbtree_get_stats(t, &st);
+  assert(st.nodes == distinct);
+  size_t lg = 0;
+  while ((1u << lg) <= 2 * distinct)
+  {
+    lg++;
+  }
+  assert(st.height <= 2 * lg + 2);
+
+  free(res);
+  free(th);
+  free(w);
+  delete_rbtree(t);
+}
+
+// RBTREE_LAZY: erased nodes stay as tombstones that every read skips until a
+// purge removes them all at once and rebalances the tree
+void test_lazy_erase(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree_flags(RBTREE_LAZY); // purges only when asked
+  bool *alive = calloc(n, sizeof(bool));
+  key_t *res = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    const key_t key = (key_t)((i * 7919u) % n);
+    rbtree_insert(t, key);
+    alive[key] = true;
+  }
+  size_t live = n, erased = 0;
+  for (int i = 0; i < n; i++)
+  {
+    const key_t key = rand() % n;
+    assert(rbtree_erase_key(t, key) == alive[key]);
+    erased += alive[key];
+    live -= alive[key];
+    alive[key] = false;
+  }
+
+  rbtree_stats st;
+  rbtree_get_stats(t, &st);
+  assert(st.nodes == live && st.tombstones == erased);
+  assert(rbtree_to_array(t, res, n) == live);
+  size_t idx = 0;
+  for (key_t k = 0; k < n; k++)
+  {
+    assert((rbtree_find(t, k) != NULL) == alive[k]);
+    if (alive[k])
+    {
+      assert(res[idx++] == k);
+    }
+  }
+  size_t seen = 0;
+  for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p))
+  {
+    assert(p->key == res[seen++]);
+  }
+  assert(seen == live);
+  for (node_t *p = rbtree_max(t); p != NULL; p = rbtree_prev(t, p))
+  {
+    assert(p->key == res[--seen]);
+  }
+  assert(seen == 0);
+
+  // inserting an erased key brings its node back
+  key_t dead = 0;
+  while (alive[dead])
+  {
+    dead++;
+  }
+  int existed;
+  assert(rbtree_insert_unique(t, dead, &existed)->key == dead && !existed);
+  alive[dead] = true;
+  live++;
+  erased--;
+
+  // purge frees only tombstones; live nodes keep their address
+  node_t *keep = rbtree_find(t, dead);
+  assert(rbtree_purge(t) == erased);
+  assert(rbtree_find(t, dead) == keep);
+  rbtree_get_stats(t, &st);
+  assert(st.nodes == live && st.tombstones == 0);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  assert(rbtree_to_array(t, res, n) == live);
+  for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p))
+  {
+    assert(alive[p->key]);
+  }
+
+  // purge_step removes tombstones a budget of nodes at a time, resuming
+  // where it stopped; erases and inserts between steps are fine
+  for (int i = 0; i < n; i += 3)
+  {
+    rbtree_erase_key(t, i);
+    alive[i] = false;
+  }
+  keep = rbtree_min(t);
+  rbtree_get_stats(t, &st);
+  const size_t tombs = st.tombstones;
+  size_t steps = 0;
+  while (rbtree_purge_step(t, 64))
+  {
+    steps++;
+    assert(steps <= n);
+    if (steps == 3)
+    {
+      rbtree_erase_key(t, keep->key); // behind the cursor: found next round
+      alive[keep->key] = false;
+    }
+  }
+  assert(steps >= tombs / 64);
+  rbtree_get_stats(t, &st);
+  assert(st.tombstones == 0);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  for (key_t k = 0; k < n; k++)
+  {
+    assert((rbtree_find(t, k) != NULL) == alive[k]);
+  }
+  assert(rbtree_purge_step(t, 64) == 0);
+
+  // with a purge share the tree purges itself during erase
+  delete_rbtree(t);
+  t = new_rbtree_flags(RBTREE_LAZY);
+  rbtree_set_purge_share(t, 25);
+  for (int i = 0; i < n; i++)
+  {
+    rbtree_insert(t, i);
+  }
+  for (int i = 0; i < n; i += 2)
+  {
+    assert(rbtree_erase_key(t, i));
+    rbtree_get_stats(t, &st);
+    assert(st.tombstones * 4 <= st.nodes + st.tombstones);
+  }
+  test_color_constraint(t);
+  test_search_constraint(t);
+  assert(rbtree_to_array(t, res, n) == n / 2);
+  assert(res[0] == 1 && rbtree_min(t)->key == 1);
+
+  free(res);
+  free(alive);
+  delete_rbtree(t);
+}
+
+// height and rotation counts reported for the compiled balancing policy
+void test_balance_stats(const size_t n)
+{
+  rbtree *t = new_rbtree();
+  rbtree_stats st;
+  for (int i = 0; i < n; i++)
+  {
+    rbtree_insert(t, i);
+  }
+  test_color_constraint(t);
+  rbtree_get_stats(t, &st);
+  size_t lg = 0;
+  while ((1u << lg) <= n)
+  {
+    lg++;
+  }
+  // lg = floor(log2 n) + 1 is the smallest possible height
+  assert(st.height >= lg);
+#if RBTREE_BALANCE == RBTREE_BALANCE_RB
+  assert(st.height <= 2 * lg);
+#else
+  assert(st.height <= lg + lg / 2 + 1); // AVL bound is ~1.44 log2 n
+#endif
+  assert(st.rotations > 0);
+
+  const unsigned long before = st.rotations;
+  for (int i = 0; i < n; i += 3)
+  {
+    assert(rbtree_erase_key(t, i));
+  }
+  test_color_constraint(t);
+  rbtree_get_stats(t, &st);
+  assert(st.rotations >= before);
+  assert(st.nodes == n - (n + 2) / 3);
+  delete_rbtree(t);
+}
+
+void test_find_erase_fixed()
+{
+  const key_t arr[] = {10, 5, 8, 34, 67, 23, 156, 24, 2, 12, 24, 36, 990, 25};
+  const size_t n = sizeof(arr) / sizeof(arr[0]);
+  rbtree *t = new_rbtree();
+  assert(t != NULL);
+
+  test_find_erase(t, arr, n);
+
+  delete_rbtree(t);
+}
+
+void test_find_erase_rand(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree();
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (int i = 0; i < n; i++)
+  {
+    arr[i] = rand();
+  }
+
+  test_find_erase(t, arr, n);
+
+  free(arr);
+  delete_rbtree(t);
+}
+
+typedef struct
+{
+  unsigned char b[32];
+  size_t len;
+} str_key;
+
+static int str_key_cmp(const void *a, const void *b)
+{
+  const str_key *x = a, *y = b;
+  const int c = memcmp(x->b, y->b, x->len < y->len ? x->len : y->len);
+  return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+// byte-string keys come back in memcmp order, including keys that share
+// their first 8 bytes, embedded zero bytes and the empty key
+void test_string_keys(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  str_key *keys = calloc(n, sizeof(str_key));
+  for (size_t i = 0; i < n; i++)
+  {
+    str_key *k = &keys[i];
+    if (i % 3 == 0)
+    {
+      k->len = (size_t)snprintf((char *)k->b, sizeof(k->b), "/srv/tenant-%u/d",
+                                (unsigned)(rand() % n));
+    }
+    else
+    {
+      // short keys stay inline; long ones differ only after byte 8
+      k->len = (i % 3 == 1) ? (size_t)(rand() % 9) : (size_t)(9 + rand() % 12);
+      for (size_t j = 0; j < k->len; j++)
+      {
+        k->b[j] = "\0ab"[rand() % 3];
+      }
+    }
+  }
+
+  rbtree *t = new_rbtree_str();
+  size_t distinct = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    int existed;
+    rbtree_str *s = rbtree_str_insert(t, keys[i].b, keys[i].len, &existed);
+    assert(s != NULL && s->len == keys[i].len);
+    assert(memcmp(rbtree_str_bytes(s), keys[i].b, s->len) == 0);
+    distinct += !existed;
+  }
+  test_color_constraint(t);
+
+  qsort(keys, n, sizeof(str_key), str_key_cmp);
+  size_t uniq = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (uniq == 0 || str_key_cmp(&keys[uniq - 1], &keys[i]) != 0)
+    {
+      keys[uniq++] = keys[i];
+    }
+  }
+  assert(uniq == distinct);
+
+  size_t idx = 0;
+  for (node_t *p = rbtree_min(t); p != NULL; p = rbtree_next(t, p))
+  {
+    const rbtree_str *s = rbtree_entry(p, rbtree_str, link);
+    assert(idx < uniq && s->len == keys[idx].len);
+    assert(memcmp(rbtree_str_bytes(s), keys[idx].b, s->len) == 0);
+    assert(rbtree_str_find(t, keys[idx].b, keys[idx].len) == s);
+    idx++;
+  }
+  assert(idx == uniq);
+
+  // a key one byte longer than a stored key is a different key
+  for (size_t i = 0; i < uniq; i++)
+  {
+    str_key k = keys[i];
+    k.b[k.len++] = 'z';
+    assert(rbtree_str_find(t, k.b, k.len) == NULL);
+  }
+
+  for (size_t i = 0; i < uniq; i += 2)
+  {
+    assert(rbtree_str_erase(t, keys[i].b, keys[i].len) == 1);
+    assert(rbtree_str_erase(t, keys[i].b, keys[i].len) == 0);
+  }
+  test_color_constraint(t);
+  for (size_t i = 0; i < uniq; i++)
+  {
+    assert((rbtree_str_find(t, keys[i].b, keys[i].len) != NULL) == (i % 2 == 1));
+  }
+  delete_rbtree(t);
+  free(keys);
+}
+
+static void track_move(void *arg, const node_t *from, node_t *to)
+{
+  node_t **held = arg;
+  if (*held == from)
+  {
+    *held = to;
+  }
+}
+
+// after a full compaction the nodes sit next to each other in preorder
+static void check_preorder_layout(const rbtree *t, const node_t *x, const node_t **prev)
+{
+  if (x == t->nil)
+  {
+    return;
+  }
+  const size_t stride =
+      (t->flags & RBTREE_COUNTED) ? sizeof(rbtree_counted_node) : sizeof(node_t);
+  assert(*prev == NULL || (const char *)x == (const char *)*prev + stride);
+  *prev = x;
+  check_preorder_layout(t, x->left, prev);
+  check_preorder_layout(t, x->right, prev);
+}
+
+// compaction in small steps interleaved with updates keeps the tree and
+// the caller's handles valid
+void test_compact(const size_t n, const unsigned int flags, const unsigned int seed)
+{
+  srand(seed);
+  const key_t range = (key_t)(2 * n);
+  int *model = calloc(range, sizeof(int));
+  key_t *res = calloc(2 * n, sizeof(key_t));
+  rbtree *t = new_rbtree_flags(flags);
+  for (size_t i = 0; i < 2 * n; i++)
+  {
+    const key_t key = rand() % range;
+    if (i % 3 == 2)
+    {
+      assert(rbtree_erase_key(t, key) == (model[key] > 0));
+      model[key] -= model[key] > 0;
+    }
+    else
+    {
+      rbtree_insert(t, key);
+      model[key]++;
+    }
+  }
+  key_t held_key = 0;
+  while (model[held_key] != 1)
+  {
+    held_key++;
+  }
+  node_t *held = rbtree_find(t, held_key);
+  rbtree_set_move_hook(t, track_move, &held);
+
+  int r;
+  size_t steps = 0;
+  while ((r = rbtree_compact_step(t, 64)) == 1)
+  {
+    steps++;
+    for (int j = 0; j < 8; j++)
+    {
+      const key_t key = rand() % range;
+      if (key == held_key)
+      {
+        continue;
+      }
+      if (j % 2)
+      {
+        assert(rbtree_erase_key(t, key) == (model[key] > 0));
+        model[key] -= model[key] > 0;
+      }
+      else
+      {
+        rbtree_insert(t, key);
+        model[key]++;
+      }
+    }
+  }
+  assert(r == 0 && steps > 0);
+  assert(held->key == held_key && rbtree_find(t, held_key) == held);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  size_t total = 0;
+  for (key_t k = 0; k < range; k++)
+  {
+    total += model[k];
+  }
+  assert(rbtree_to_array(t, res, 2 * n) == total);
+  for (size_t i = 1; i < total; i++)
+  {
+    assert(res[i - 1] <= res[i]);
+  }
+
+  assert(rbtree_compact(t) == 0);
+  const node_t *prev = NULL;
+  check_preorder_layout(t, t->root, &prev);
+  assert(held->key == held_key);
+  assert(rbtree_max(t)->key == res[total - 1]);
+
+  // a tree dropped in the middle of a compaction frees everything
+  rbtree_insert(t, 1);
+  assert(rbtree_compact_step(t, 1) == 1);
+  delete_rbtree(t);
+
+  // trees whose nodes must not move refuse
+  t = new_rbtree_flags(RBTREE_PINNED);
+  rbtree_insert(t, 1);
+  assert(rbtree_compact(t) == -1);
+  delete_rbtree(t);
+  t = new_rbtree_flags(RBTREE_PERSISTENT);
+  assert(rbtree_compact(t) == -1);
+  delete_rbtree(t);
+
+  // nodes that start out in an arena (bulk build) move too
+  for (size_t i = 0; i < n; i++)
+  {
+    res[i] = (key_t)i;
+  }
+  t = rbtree_build_parallel(res, n, 2);
+  for (size_t i = 0; i < n; i += 3)
+  {
+    rbtree_erase_key(t, (key_t)i);
+  }
+  assert(rbtree_compact(t) == 0);
+  prev = NULL;
+  check_preorder_layout(t, t->root, &prev);
+  test_color_constraint(t);
+  delete_rbtree(t);
+  free(model);
+  free(res);
+}
+
+// trees handed to the background reclaimer or freed in parallel are
+// released completely (the sanitizer build checks for leaks)
+void test_async_delete(const size_t n, const unsigned int seed)
+{
+  srand(seed);
+  const unsigned int modes[] = {0, RBTREE_COUNTED | RBTREE_FILTER, RBTREE_PERSISTENT,
+                                RBTREE_SMALL, RBTREE_LAZY, RBTREE_BTREE};
+  const size_t nmodes = sizeof(modes) / sizeof(modes[0]);
+  for (size_t m = 0; m < nmodes; m++)
+  {
+    rbtree *t = new_rbtree_flags(modes[m]);
+    for (size_t i = 0; i < n; i++)
+    {
+      rbtree_insert(t, rand());
+    }
+    if (m % 2)
+    {
+      delete_rbtree_async(t);
+    }
+    else
+    {
+      delete_rbtree_parallel(t, 4);
+    }
+  }
+
+  key_t *keys = malloc(n * sizeof(key_t));
+  for (size_t i = 0; i < n; i++)
+  {
+    keys[i] = (key_t)i;
+  }
+  delete_rbtree_async(rbtree_build_parallel(keys, n, 2));
+
+  // dropped in the middle of a compaction
+  rbtree *t = new_rbtree();
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, keys[i]);
+  }
+  assert(rbtree_compact_step(t, n / 2) == 1);
+  delete_rbtree_async(t);
+
+  rbtree *s = new_rbtree_str();
+  rbtree_str_insert(s, "async", 5, NULL);
+  rbtree_str_insert(s, "a much longer key", 17, NULL);
+  delete_rbtree_async(s);
+
+  rbtree_reclaim_wait();
+  free(keys);
+}
+
+// memory accounting follows the node storage and rbtree_shrink hands back
+// chunks that no longer hold a live node
+void test_memory_usage(const size_t n)
+{
+  rbtree_memory m;
+  rbtree *t = new_rbtree();
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, (key_t)i);
+  }
+  rbtree_memory_usage(t, &m);
+  assert(m.chunks == 0 && m.fragmentation == 0.0);
+  assert(m.node_reserved == n * sizeof(node_t) && m.reserved == m.in_use);
+  assert(rbtree_shrink(t) == 0);
+  delete_rbtree(t);
+
+  // a counted tree pays for the count in each node
+  t = new_rbtree_flags(RBTREE_COUNTED);
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, (key_t)i);
+  }
+  rbtree_memory_usage(t, &m);
+  assert(m.node_reserved == n * sizeof(rbtree_counted_node));
+  delete_rbtree(t);
+
+  t = new_rbtree_flags(RBTREE_HUGEPAGE | RBTREE_FILTER);
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, (key_t)i);
+  }
+  rbtree_memory_usage(t, &m);
+  assert(m.chunks > 1 && m.empty_chunks == 0);
+  assert(m.node_reserved >= n * sizeof(node_t) && m.reserved >= m.in_use);
+  assert(m.in_use >= n * sizeof(node_t));
+  assert(m.huge_bytes <= m.node_reserved);
+  assert(m.fragmentation >= 0.0 && m.fragmentation < 0.5);
+  const size_t before = m.reserved;
+
+  // nodes are handed out in order, so keeping only the first keys
+  // leaves every later chunk empty
+  const size_t keep = 1000;
+  for (size_t i = keep; i < n; i++)
+  {
+    assert(rbtree_erase_key(t, (key_t)i));
+  }
+  rbtree_memory_usage(t, &m);
+  assert(m.empty_chunks > 0 && m.fragmentation > 0.5);
+  const size_t released = rbtree_shrink(t);
+  assert(released > 0);
+  rbtree_memory_usage(t, &m);
+  assert(m.empty_chunks == 0 && m.chunks == 1);
+  assert(m.reserved == before - released);
+  assert(rbtree_shrink(t) == 0);
+
+  // the arena keeps working after shrinking
+  for (size_t i = keep; i < n; i++)
+  {
+    rbtree_insert(t, (key_t)i);
+  }
+  for (size_t i = 0; i < n; i += 97)
+  {
+    assert(rbtree_find(t, (key_t)i) != NULL);
+  }
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  // compaction keeps huge-page chunks and leaves nothing to shrink
+  for (size_t i = 0; i < n; i += 2)
+  {
+    rbtree_erase_key(t, (key_t)i);
+  }
+  assert(rbtree_compact(t) == 0);
+  assert(rbtree_shrink(t) == 0);
+  rbtree_memory_usage(t, &m);
+  assert(m.fragmentation < 0.5);
+  delete_rbtree(t);
+}
+
+static void check_same_shape(const rbtree *a, const node_t *x, const rbtree *b,
+                             const node_t *y, const node_t *yparent)
+{
+  if (x == a->nil)
+  {
+    assert(y == b->nil);
+    return;
+  }
+  assert(y != b->nil && x != y);
+  assert(x->key == y->key && x->color == y->color);
+  assert(rbtree_count(a, x) == rbtree_count(b, y));
+  assert(y->parent == yparent);
+  check_same_shape(a, x->left, b, y->left, y);
+  check_same_shape(a, x->right, b, y->right, y);
+}
+
+// a clone has the source's exact shape in its own contiguous nodes and
+// changes independently of it
+void test_clone(const size_t n, const unsigned int flags, const unsigned int seed)
+{
+  srand(seed);
+  rbtree *t = new_rbtree_flags(flags);
+  for (size_t i = 0; i < n; i++)
+  {
+    rbtree_insert(t, rand() % (key_t)n);
+  }
+  for (size_t i = 0; i < n / 4; i++)
+  {
+    rbtree_erase_key(t, rand() % (key_t)n);
+  }
+  rbtree *c = rbtree_clone(t);
+  assert(c != NULL && c->nil != t->nil);
+  check_same_shape(t, t->root, c, c->root, c->nil);
+  const node_t *prev = NULL;
+  check_preorder_layout(c, c->root, &prev);
+  assert(rbtree_max(c)->key == rbtree_max(t)->key && rbtree_max(c) != rbtree_max(t));
+  test_color_constraint(c);
+  test_search_constraint(c);
+
+  key_t *a = calloc(n, sizeof(key_t)), *b = calloc(n, sizeof(key_t));
+  const int len = rbtree_to_array(t, a, n);
+  assert(rbtree_to_array(c, b, n) == len);
+  assert(memcmp(a, b, len * sizeof(key_t)) == 0);
+
+  // the two trees no longer share anything
+  for (size_t i = 0; i < n / 2; i++)
+  {
+    rbtree_erase_key(c, rand() % (key_t)n);
+    rbtree_insert(c, (key_t)(n + i));
+  }
+  assert(rbtree_to_array(t, b, n) == len);
+  assert(memcmp(a, b, len * sizeof(key_t)) == 0);
+  test_color_constraint(c);
+  test_search_constraint(c);
+  delete_rbtree(c);
+  delete_rbtree(t);
+
+  // engines with their own node layout are rebuilt from their keys
+  const unsigned int others[] = {RBTREE_BTREE, RBTREE_PERSISTENT, RBTREE_SMALL,
+                                 RBTREE_CONCURRENT};
+  for (size_t m = 0; m < sizeof(others) / sizeof(others[0]); m++)
+  {
+    t = new_rbtree_flags(others[m] | (flags & RBTREE_COUNTED));
+    const size_t k = others[m] == RBTREE_SMALL ? 5 : n;
+    for (size_t i = 0; i < k; i++)
+    {
+      rbtree_insert(t, rand() % (key_t)n);
+    }
+    c = rbtree_clone(t);
+    const int got = rbtree_to_array(t, a, n);
+    assert(rbtree_to_array(c, b, n) == got);
+    assert(memcmp(a, b, got * sizeof(key_t)) == 0);
+    delete_rbtree(c);
+    delete_rbtree(t);
+  }
+
+  // intrusive nodes belong to the caller
+  t = new_rbtree_intrusive(NULL);
+  assert(rbtree_clone(t) == NULL);
+  delete_rbtree(t);
+  free(a);
+  free(b);
+}
+
+// every probe answer of the merge join must agree with rbtree_find
+static void check_sorted_probes(const rbtree *t, const key_t *probes, const size_t m)
+{
+  uint8_t *bits = malloc((m + 7) / 8);
+  node_t **found = malloc(m * sizeof(node_t *));
+  memset(bits, 0xff, (m + 7) / 8);
+  const size_t hits = rbtree_contains_sorted(t, probes, m, bits);
+  assert(rbtree_find_sorted(t, probes, m, found) == hits);
+  size_t expect = 0;
+  for (size_t i = 0; i < m; i++)
+  {
+    const node_t *p = rbtree_find(t, probes[i]);
+    const int bit = (bits[i >> 3] >> (i & 7)) & 1;
+    assert(bit == (p != NULL));
+    assert((found[i] != NULL) == (p != NULL));
+    assert(found[i] == NULL || found[i]->key == probes[i]);
+    expect += p != NULL;
+  }
+  assert(hits == expect);
+  free(bits);
+  free(found);
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+  const key_t x = *(const key_t *)a, y = *(const key_t *)b;
+  return (x > y) - (x < y);
+}
+
+// sorted probe batches, dense and sparse, against every engine
+void test_contains_sorted(const size_t n, const unsigned int flags, const unsigned int seed)
+{
+  srand(seed);
+  const key_t range = (key_t)(4 * n);
+  key_t *probes = malloc(2 * n * sizeof(key_t));
+  const unsigned int engines[] = {0, RBTREE_BTREE, RBTREE_PERSISTENT,
+                                  RBTREE_CONCURRENT, RBTREE_SMALL};
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+  {
+    rbtree *t = new_rbtree_flags(flags | engines[e]);
+    const size_t k = engines[e] == RBTREE_SMALL ? 6 : n;
+    for (size_t i = 0; i < k; i++)
+    {
+      rbtree_insert(t, rand() % range);
+    }
+    for (size_t i = 0; i < k / 4; i++)
+    {
+      rbtree_erase_key(t, rand() % range);
+    }
+
+    // dense: every key in the range, so the cursor mostly steps
+    for (key_t i = 0; i < range / 2; i++)
+    {
+      probes[i] = 2 * i;
+    }
+    check_sorted_probes(t, probes, range / 2);
+
+    // sparse with repeats, so the cursor jumps and stays put
+    size_t m = 0;
+    for (key_t v = -3; v < range + 3 && m < 2 * n; v += 1 + rand() % 500)
+    {
+      probes[m++] = v;
+      if (rand() % 4 == 0 && m < 2 * n)
+      {
+        probes[m++] = v;
+      }
+    }
+    check_sorted_probes(t, probes, m);
+
+    // unsorted input is still answered, one probe at a time
+    for (size_t i = 0; i < n; i++)
+    {
+      probes[i] = rand() % range;
+    }
+    check_sorted_probes(t, probes, n);
+    qsort(probes, n, sizeof(key_t), cmp_key);
+    check_sorted_probes(t, probes, n);
+    check_sorted_probes(t, probes, 0);
+    delete_rbtree(t);
+  }
+  assert(rbtree_contains_sorted(NULL, probes, 4, NULL) == 0);
+  free(probes);
+}
+
+// the buffered tree and the plain reference tree hold the same keys, in the
+// same order whether read whole or node by node in either direction
+static void check_same_contents(const rbtree *t, const rbtree *ref, key_t *a, key_t *b,
+                                const size_t cap)
+{
+  const int len = rbtree_to_array(ref, a, cap);
+  assert(rbtree_to_array(t, b, cap) == len);
+  assert(memcmp(a, b, len * sizeof(key_t)) == 0);
+  if (len > 3)
+  {
+    assert(rbtree_to_array(t, b, len / 3) == len / 3);
+    assert(memcmp(a, b, (len / 3) * sizeof(key_t)) == 0);
+  }
+
+  int i = 0;
+  for (const node_t *p = rbtree_min(t); p; p = rbtree_next(t, p))
+  {
+    for (size_t c = 0; c < rbtree_count(t, p); c++)
+    {
+      assert(i < len && a[i++] == p->key);
+    }
+  }
+  assert(i == len);
+  for (const node_t *p = rbtree_max(t); p; p = rbtree_prev(t, p))
+  {
+    for (size_t c = 0; c < rbtree_count(t, p); c++)
+    {
+      assert(i > 0 && a[--i] == p->key);
+    }
+  }
+  assert(i == 0);
+}
+
+// inserts and erases land in the write buffer first, reads see both parts,
+// and flushing links the very nodes insert returned
+void test_write_buffer(const size_t n, const unsigned int flags, const unsigned int seed)
+{
+  srand(seed);
+  const key_t range = (key_t)n;
+  rbtree *t = new_rbtree_flags(flags | RBTREE_BUFFERED);
+  rbtree *ref = new_rbtree_flags(flags);
+  key_t *a = calloc(2 * n, sizeof(key_t)), *b = calloc(2 * n, sizeof(key_t));
+  node_t **kept = calloc(n, sizeof(node_t *));
+  size_t nkept = 0;
+  rbtree_stats st;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    const key_t k = rand() % range;
+    const int op = rand() % 8;
+    if (op < 4)
+    {
+      node_t *p = rbtree_insert(t, k);
+      assert(p != NULL && p->key == k);
+      rbtree_insert(ref, k);
+      kept[nkept++] = p;
+    }
+    else if (op == 4)
+    {
+      int e1, e2;
+      node_t *p = rbtree_insert_unique(t, k, &e1);
+      rbtree_insert_unique(ref, k, &e2);
+      assert(p != NULL && p->key == k && e1 == e2);
+    }
+    else if (op == 5)
+    {
+      assert(rbtree_erase_key(t, k) == rbtree_erase_key(ref, k));
+      nkept = 0; // the erase may have freed a kept node
+    }
+    else if (op == 6)
+    {
+      node_t *p = rbtree_find(t, k), *q = rbtree_find(ref, k);
+      assert((p == NULL) == (q == NULL));
+      if (p)
+      {
+        assert(p->key == k);
+        rbtree_erase(t, p);
+        rbtree_erase(ref, q);
+        nkept = 0;
+      }
+    }
+    else
+    {
+      node_t *hint = rbtree_max(t);
+      rbtree_insert_hint(t, hint, k);
+      rbtree_insert(ref, k);
+    }
+    assert((rbtree_find(t, k) == NULL) == (rbtree_find(ref, k) == NULL));
+    if (i % 97 == 0)
+    {
+      check_same_contents(t, ref, a, b, 2 * n);
+    }
+  }
+  check_same_contents(t, ref, a, b, 2 * n);
+
+  // a non-empty buffer shows up in the stats until it is flushed
+  rbtree_insert(t, range + 1);
+  rbtree_insert(ref, range + 1);
+  rbtree_get_stats(t, &st);
+  assert(st.nodes == st.buffered + t->size - t->tombstones);
+  // (a counted tree links a key the filter might hold right away)
+  assert(st.buffered > 0 || (t->flags & RBTREE_COUNTED));
+  rbtree *c = rbtree_clone(t);
+  assert(rbtree_flush(t) == st.buffered);
+  rbtree_get_stats(t, &st);
+  assert(st.buffered == 0 && rbtree_flush(t) == 0);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  check_same_contents(t, ref, a, b, 2 * n);
+  check_same_contents(c, ref, a, b, 2 * n);
+  delete_rbtree(c);
+
+  // pointers handed out before the flush are the nodes now in the tree
+  for (size_t i = 0; i < nkept; i++)
+  {
+    assert(kept[i]->parent != NULL && rbtree_count(t, kept[i]) > 0);
+    assert(rbtree_find(t, kept[i]->key) != NULL);
+  }
+
+  // sorted probes see keys that are still buffered
+  for (key_t k = 0; k < 50; k++)
+  {
+    rbtree_insert(t, range + 10 + 2 * k);
+    rbtree_insert(ref, range + 10 + 2 * k);
+  }
+  for (key_t k = 0; k < range + 120; k++)
+  {
+    a[k] = k;
+  }
+  uint8_t *bits = calloc((range + 120) / 8 + 1, 1);
+  const size_t hits = rbtree_contains_sorted(t, a, range + 120, bits);
+  assert(hits == rbtree_contains_sorted(ref, a, range + 120, NULL));
+  assert(bits[(range + 10) >> 3] & (1u << ((range + 10) & 7)));
+  free(bits);
+  check_same_contents(t, ref, a, b, 2 * n);
+
+  // compaction links the buffered nodes before moving them
+  assert(rbtree_compact(t) == 0);
+  rbtree_get_stats(t, &st);
+  assert(st.buffered == 0);
+  test_search_constraint(t);
+  check_same_contents(t, ref, a, b, 2 * n);
+  delete_rbtree(ref);
+  delete_rbtree(t);
+
+  // engines with their own layout ignore the flag
+  t = new_rbtree_flags(RBTREE_BTREE | RBTREE_BUFFERED);
+  assert(t->wbuf == NULL && !(t->flags & RBTREE_BUFFERED));
+  delete_rbtree(t);
+  free(kept);
+  free(a);
+  free(b);
+}
+
+static void check_log_model(const rbtree *t, const int *model, const key_t range,
+                            key_t *res, const size_t cap)
+{
+  size_t total = 0;
+  for (key_t k = 0; k < range; k++)
+  {
+    total += model[k];
+  }
+  assert(rbtree_to_array(t, res, cap) == total);
+  size_t idx = 0;
+  for (key_t k = 0; k < range; k++)
+  {
+    for (int c = 0; c < model[k]; c++)
+    {
+      assert(res[idx++] == k);
+    }
+  }
+}
+
+static void log_random_ops(rbtree *t, int *model, const key_t range, const size_t ops)
+{
+  for (size_t i = 0; i < ops; i++)
+  {
+    const key_t key = rand() % range;
+    if (rand() % 3)
+    {
+      assert(rbtree_insert(t, key) != NULL);
+      model[key]++;
+    }
+    else
+    {
+      assert(rbtree_erase_key(t, key) == (model[key] > 0));
+      model[key] -= model[key] > 0;
+    }
+  }
+}
+
+static void copy_file(const char *from, const char *to)
+{
+  FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+  assert(in && out);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+  {
+    assert(fwrite(buf, 1, n, out) == n);
+  }
+  fclose(in);
+  fclose(out);
+}
+
+// a tree rebuilt from checkpoint + log equals the tree that wrote them
+void test_operation_log(const size_t n, const unsigned int flags, const unsigned int seed)
+{
+  srand(seed);
+  char base[64], ckpt[80], log[80], saved[80];
+  snprintf(base, sizeof(base), "/tmp/rbtree-log-%d-%u", (int)getpid(), seed);
+  snprintf(ckpt, sizeof(ckpt), "%s.ckpt", base);
+  snprintf(log, sizeof(log), "%s.log", base);
+  snprintf(saved, sizeof(saved), "%s.saved", base);
+  const key_t range = (key_t)(n / 4 + 1);
+  int *model = calloc(range, sizeof(int));
+  key_t *res = calloc(2 * n, sizeof(key_t));
+
+  rbtree *t = new_rbtree_flags(flags);
+  log_random_ops(t, model, range, n / 4);
+  assert(rbtree_log_open(t, base) == 0);
+  log_random_ops(t, model, range, n / 4);
+  assert(rbtree_checkpoint(t) == 0);
+  log_random_ops(t, model, range, n / 4);
+  assert(rbtree_log_sync(t) == 0);
+  delete_rbtree(t);
+
+  // checkpoint + log tail
+  t = rbtree_log_load(base, flags);
+  assert(t != NULL);
+  check_log_model(t, model, range, res, 2 * n);
+
+  // the loaded tree keeps appending to the same log
+  log_random_ops(t, model, range, n / 4);
+
+  // records of an idle tree reach the file within LOG_SYNC_MS (10 ms) without
+  // rbtree_log_sync; allow a generous margin for a slow disk
+  struct stat st;
+  assert(rbtree_log_sync(t) == 0);
+  assert(stat(log, &st) == 0);
+  const off_t synced = st.st_size;
+  assert(rbtree_insert(t, 0) != NULL);
+  model[0]++;
+  for (int waited = 0; stat(log, &st) == 0 && st.st_size == synced; waited++)
+  {
+    assert(waited < 400);
+    usleep(5000);
+  }
+  assert(st.st_size == synced + 5);
+  delete_rbtree(t);
+  t = rbtree_log_load(base, flags);
+  check_log_model(t, model, range, res, 2 * n);
+
+  // a log older than the checkpoint (crash before the log was reset) is skipped
+  log_random_ops(t, model, range, n / 8);
+  assert(rbtree_log_sync(t) == 0);
+  copy_file(log, saved);
+  assert(rbtree_checkpoint(t) == 0);
+  delete_rbtree(t);
+  rename(saved, log);
+  t = rbtree_log_load(base, flags);
+  check_log_model(t, model, range, res, 2 * n);
+
+  // a torn last record is dropped and later records still line up
+  log_random_ops(t, model, range, n / 8);
+  delete_rbtree(t);
+  FILE *f = fopen(log, "ab");
+  fputc(1, f);
+  fputc(0x7f, f);
+  fclose(f);
+  t = rbtree_log_load(base, flags);
+  check_log_model(t, model, range, res, 2 * n);
+  log_random_ops(t, model, range, n / 8);
+  delete_rbtree(t);
+  t = rbtree_log_load(base, flags);
+  check_log_model(t, model, range, res, 2 * n);
+
+  assert(rbtree_log_close(t) == 0);
+  assert(rbtree_log_close(t) == -1); // already closed
+  delete_rbtree(t);
+
+  // a failed write is remembered: appends cannot report it, so sync,
+  // checkpoint and close do (the file size limit makes write fail)
+  t = rbtree_log_load(base, flags);
+  assert(t != NULL);
+  struct rlimit old, lim;
+  assert(getrlimit(RLIMIT_FSIZE, &old) == 0);
+  assert(stat(log, &st) == 0);
+  lim = old;
+  lim.rlim_cur = st.st_size;
+  void (*prev)(int) = signal(SIGXFSZ, SIG_IGN);
+  assert(setrlimit(RLIMIT_FSIZE, &lim) == 0);
+  assert(rbtree_insert(t, 0) != NULL);
+  assert(rbtree_log_sync(t) == -1);
+  assert(setrlimit(RLIMIT_FSIZE, &old) == 0);
+  signal(SIGXFSZ, prev);
+  assert(rbtree_insert(t, 0) != NULL);
+  assert(rbtree_checkpoint(t) == -1);
+  assert(rbtree_log_close(t) == -1);
+  delete_rbtree(t);
+
+  unlink(ckpt);
+  unlink(log);
+  free(model);
+  free(res);
+}
+
+int main(void)
+{
+  test_init();
+  test_insert_single(1024);
+  test_find_single(512, 1024);
+  test_erase_root(128);
+  test_find_erase_fixed();
+  test_minmax_suite();
+  test_to_array_suite();
+  test_distinct_values();
+  test_duplicate_values();
+  test_counted_duplicates();
+  test_multi_instance();
+  test_to_array_parallel(300000, 41);
+  for (int n = 0; n < 40; n++)
+  {
+    test_build_parallel(n, 1, 43);
+  }
+  test_build_parallel(100000, 4, 47);
+  test_intrusive(2000, 53);
+  test_range_aggregate(600, 59);
+  test_interval_queries(3000, 61);
+  test_negative_filter(20000, 67);
+  test_small_trees(500, 71);
+  test_shared_ctx(4, 73);
+  test_balance_stats(10000);
+  test_btree_engine(50000, 0, 79);
+  test_btree_engine(20000, RBTREE_COUNTED | RBTREE_FILTER, 83);
+  test_concurrent_tree(1, 89);
+  test_concurrent_tree(8, 97);
+  test_lazy_erase(10000, 101);
+  test_operation_log(20000, 0, 103);
+  test_operation_log(20000, RBTREE_COUNTED | RBTREE_BTREE, 107);
+  test_operation_log(20000, RBTREE_PERSISTENT | RBTREE_LAZY, 109);
+  test_string_keys(30000, 113);
+  test_compact(20000, 0, 127);
+  test_compact(20000, RBTREE_COUNTED | RBTREE_FINGER | RBTREE_FILTER, 131);
+  test_compact(20000, RBTREE_LAZY, 137);
+  test_async_delete(100000, 139);
+  test_memory_usage(300000);
+  test_clone(20000, 0, 149);
+  test_clone(20000, RBTREE_COUNTED | RBTREE_FILTER | RBTREE_HUGEPAGE, 151);
+  test_clone(20000, RBTREE_LAZY, 157);
+  test_contains_sorted(20000, 0, 163);
+  test_contains_sorted(20000, RBTREE_COUNTED | RBTREE_FILTER, 167);
+  test_contains_sorted(20000, RBTREE_LAZY, 173);
+  test_write_buffer(20000, 0, 179);
+  test_write_buffer(20000, RBTREE_COUNTED | RBTREE_FILTER, 181);
+  test_write_buffer(20000, RBTREE_LAZY | RBTREE_HUGEPAGE, 191);
   test_find_erase_rand(10000, 17);
+  test_single_descent_ops();
+  test_insert_hint(10000, 29);
+  test_insert_hint_equal_parent();
+  test_find_from(10000, 31);
+  test_persistent_snapshots(5000, 37);
+  test_persistent_alloc_failure(200);
   printf("Passed all tests!\n");
 }